@@ -1,17 +1,245 @@
 
 // #region base
 
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FS_IO_URING
+// linux/fs.h comes along with its own BLOCK_SIZE
+#undef BLOCK_SIZE
+#endif
+
 #include "fs.h"
 
 #include <iostream>
 #include <chrono>
+#include <atomic>
 #include <cstring>
 #include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "printc.h"
 
 #define min(a, b) ( a < b ? a : b )
 #define max(a, b) ( a > b ? a : b )
 
+uint hashName(const char* name, char type);
+
+struct Crc32cTable {
+
+  uint entries[256];
+
+  Crc32cTable() {
+    for(uint i = 0; i < 256; i++) {
+      uint c = i;
+      for(int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+      entries[i] = c;
+    }
+  }
+
+};
+
+uint crc32cSoftware(uint crc, const unsigned char* p, uint64 len) {
+
+  static const Crc32cTable table;
+
+  while(len--) crc = table.entries[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+
+}
+
+#if defined(__x86_64__)
+
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+uint crc32cHardware(uint crc, const unsigned char* p, uint64 len) {
+
+  uint64 c = crc;
+
+  for(; len >= 8; p += 8, len -= 8) {
+    uint64 word;
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+
+  for(; len > 0; p++, len--) c = _mm_crc32_u8((uint)c, *p);
+
+  return (uint)c;
+
+}
+
+#endif
+
+uint crc32c(const void* data, uint64 len, uint crc) {
+
+  const unsigned char* p = (const unsigned char*)data;
+
+#if defined(__x86_64__)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if(hardware) return ~crc32cHardware(~crc, p, len);
+#endif
+
+  return ~crc32cSoftware(~crc, p, len);
+
+}
+
+// a compressed chunk is an LZ4 block, a run of sequences, each starts with a
+// token holding the literal count in its high and the match length minus 4 in
+// its low four bits, a count of 15 goes on in bytes that are added up until one
+// is below 255, then come the literals and a two byte offset back to the match,
+// the last sequence has literals only
+
+// like LZ4 the last 5 bytes are always literals and no match starts in the last
+// 12, so chunks written here decode with any LZ4 decoder
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MATCH_HASH_BITS 12
+
+unsigned char* putLength(unsigned char* p, int n) {
+
+  if(n < 15) return p;
+
+  for(n -= 15; n >= 255; n -= 255) *p++ = 255;
+  *p++ = n;
+
+  return p;
+
+}
+
+bool putSequence(unsigned char** out, unsigned char* end, const unsigned char* literals, int literalCount, int offset, int match) {
+
+  int matchCode = match > 0 ? match - MIN_MATCH : 0;
+  int needed = 1 + literalCount / 255 + 1 + literalCount + 2 + matchCode / 255 + 1;
+  if(end - *out < needed) return false;
+
+  unsigned char* p = *out;
+
+  *p++ = min(literalCount, 15) << 4 | min(matchCode, 15);
+  p = putLength(p, literalCount);
+
+  memcpy(p, literals, literalCount);
+  p += literalCount;
+
+  if(match > 0) {
+    *p++ = offset & 0xFF;
+    *p++ = offset >> 8;
+    p = putLength(p, matchCode);
+  }
+
+  *out = p;
+  return true;
+
+}
+
+bool getLength(const unsigned char** p, const unsigned char* end, int* n) {
+
+  if(*n < 15) return true;
+
+  while(*p < end) {
+    int byte = *(*p)++;
+    *n += byte;
+    if(byte < 255) return true;
+    if(*n > CHUNK_SIZE) return false;
+  }
+
+  return false;
+
+}
+
+int compressChunk(const char* in, int len, char* out, int capacity) {
+
+  const unsigned char* src = (const unsigned char*)in;
+  unsigned char* p = (unsigned char*)out;
+  unsigned char* end = p + capacity;
+
+  int table[1 << MATCH_HASH_BITS];
+  for(int i = 0; i < (1 << MATCH_HASH_BITS); i++) table[i] = -1;
+
+  int anchor = 0;
+  int i = 0;
+
+  while(i + MATCH_LIMIT <= len) {
+
+    uint sequence;
+    memcpy(&sequence, src + i, sizeof(sequence));
+
+    uint h = (sequence * 2654435761u) >> (32 - MATCH_HASH_BITS);
+    int candidate = table[h];
+    table[h] = i;
+
+    if(candidate < 0 || i - candidate > 0xFFFF || memcmp(src + candidate, src + i, MIN_MATCH) != 0) {
+      // the search speeds up over data that does not compress
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    int match = MIN_MATCH;
+    while(i + match < len - LAST_LITERALS && src[candidate + match] == src[i + match]) match++;
+
+    if(!putSequence(&p, end, src + anchor, i - anchor, i - candidate, match)) return 0;
+
+    i += match;
+    anchor = i;
+
+  }
+
+  if(!putSequence(&p, end, src + anchor, len - anchor, 0, 0)) return 0;
+
+  return p - (unsigned char*)out;
+
+}
+
+int decompressChunk(const char* in, int len, char* out, int capacity) {
+
+  const unsigned char* p = (const unsigned char*)in;
+  const unsigned char* end = p + len;
+  char* o = out;
+  char* limit = out + capacity;
+
+  while(p < end) {
+
+    int token = *p++;
+
+    int literals = token >> 4;
+    if(!getLength(&p, end, &literals)) return -1;
+    if(literals > end - p || literals > limit - o) return -1;
+
+    memcpy(o, p, literals);
+    o += literals;
+    p += literals;
+
+    if(p == end) break;
+    if(end - p < 2) return -1;
+
+    int offset = p[0] | p[1] << 8;
+    p += 2;
+
+    int match = token & 15;
+    if(!getLength(&p, end, &match)) return -1;
+    match += MIN_MATCH;
+
+    if(offset == 0 || offset > o - out || match > limit - o) return -1;
+
+    // a match overlapping its own output repeats the bytes just written
+    const char* from = o - offset;
+    if(offset >= match) memcpy(o, from, match);
+    else for(int k = 0; k < match; k++) o[k] = from[k];
+    o += match;
+
+  }
+
+  return o - out;
+
+}
+
 uint64 getCurrentTime() {
   const auto now = std::chrono::system_clock::now();
   return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
@@ -111,6 +339,10 @@ char* PathSeparator::name() {
   return pName;
 }
 
+char* PathSeparator::parent() {
+  return buffer;
+}
+
 PathSeparator::~PathSeparator() {
   delete[] buffer;
 }
@@ -121,16 +353,58 @@ PathSeparator::~PathSeparator() {
 
 FileSystem::FileSystem() {
   capacity = 0;
+  maxCapacity = DEFAULT_MAX_CAPACITY;
+  reserved = 0;
   memory = NULL;
+  fd = -1;
+  mapped = false;
+  pool = NULL;
+  poolSize = DEFAULT_POOL_SIZE;
+  checksums = false;
+  compression = false;
+  residentBlocks = 0;
+  io = NULL;
+  dirtyBlocks = NULL;
+  pendingBlocks = NULL;
+  journaledBlocks = NULL;
+  flushBlocks = NULL;
+  pendingCount = 0;
+  failed = false;
+  headerDirty = false;
+  headerPending = false;
+  journalHead = 0;
+  journalSequence = 1;
+  committing = false;
+  runningTransaction = 1;
+  durableTransaction = 0;
+  freeSummary = NULL;
+  allocationHint = 0;
+  slotBlocksFound = false;
+  pathCacheHits = 0;
+  pathCacheMisses = 0;
+  memset(directoryVersions, 0, sizeof(directoryVersions));
+  resetAllocationCaches();
+  memset(chunkCache, 0, sizeof(chunkCache));
+  chunkPacked = NULL;
+  chunkCacheTick = 0;
+  resetChunkCache();
+  #ifdef FS_COROUTINES
+  executor = NULL;
+  #endif
 }
 
-void FileSystem::create(uint32_t capacity) {
+void FileSystem::create(uint64 capacity) {
 
   printfc("Creating memory  ( %.1f MB )\n", COLOR_BLUE, MB(capacity));
 
   this->capacity = capacity;
-  memory = new char[capacity];
 
+  if(!reserve(capacity) || mprotect(memory, capacity, PROT_READ | PROT_WRITE) != 0) {
+    printc("FATAL ERROR: CANNOT ALLOCATE VOLUME MEMORY\n", COLOR_RED);
+    exit(1);
+  }
+
+  initDirtyTracking();
   format();
 
 }
@@ -140,7 +414,7 @@ bool FileSystem::load(const char* file) {
   std::fstream in(file, std::ios::in | std::ios::binary | std::ios::ate);
   if(!in) return false;
 
-  int size = in.tellg();
+  uint64 size = in.tellg();
   in.seekg(0);
 
   if(size < MB(1)) {
@@ -149,60 +423,313 @@ bool FileSystem::load(const char* file) {
   }
 
   capacity = size;
-  memory = new char[size];
+
+  if(!reserve(capacity) || mprotect(memory, capacity, PROT_READ | PROT_WRITE) != 0) {
+    in.close();
+    release();
+    return false;
+  }
 
   in.read(memory, size);
   in.close();
 
+  fd = open(file, O_RDWR);
+
+  if(!mount()) {
+    printfc("Cannot load %s, unsupported image format\n", COLOR_RED, file);
+    release();
+    return false;
+  }
+
   return true;
 
 }
 
 void FileSystem::save(const char* file) {
+
   if(memory == NULL) return;
+
+  acquireJournal();
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+
+  if(fd != -1 && isBackingFile(file)) {
+    writeCheckpoint();
+    releaseJournal();
+    return;
+  }
+
+  if(pool != NULL) {
+
+    // after a checkpoint the backing image is current and is copied as it is
+
+    if(writeCheckpoint()) {
+
+      std::fstream out(file, std::ios::out | std::ios::binary);
+      char* buffer = new char[1024 * 1024];
+
+      for(uint64 offset = 0; offset < capacity;) {
+        ssize_t n = pread(fd, buffer, min((uint64)1024 * 1024, capacity - offset), offset);
+        if(n <= 0) break;
+        out.write(buffer, n);
+        offset += n;
+      }
+
+      out.close();
+      delete[] buffer;
+
+    }
+
+    releaseJournal();
+    return;
+
+  }
+
+  flushChunks();
+
+  // the copy shows freed blocks as free, in memory they stay held until a commit
+  std::unique_lock<std::mutex> allocator(allocatorMutex);
+  drainAllocationCaches(true);
+  applyFreedBlocks();
+
+  // the copy must not replay transactions that only exist in our own journal
+  HeaderBlock* header = getHeaderBlock();
+  uint64 sequence = header->journalSequence;
+  header->journalSequence = journalSequence;
+
   std::fstream out(file, std::ios::out| std::ios::binary);
   out.write(memory, capacity);
   out.close();
+
+  holdReleasedBlocks(true);
+  allocator.unlock();
+
+  if(fd == -1) {
+    fd = open(file, O_RDWR);
+    journalHead = 0;
+    clearDirty();
+  }else{
+    header->journalSequence = sequence;
+  }
+
+  releaseJournal();
+
+}
+
+bool FileSystem::map(const char* file) {
+
+  int fd = open(file, O_RDWR);
+  if(fd == -1) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < MB(1)) {
+    ::close(fd);
+    return false;
+  }
+
+  this->fd = fd;
+  this->capacity = st.st_size;
+
+  if(!reserve(capacity) || mmap(memory, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    printfc("Cannot map %s\n", COLOR_RED, file);
+    release();
+    return false;
+  }
+
+  mapped = true;
+
+  if(!mount()) {
+    printfc("Cannot map %s, unsupported image format\n", COLOR_RED, file);
+    release();
+    return false;
+  }
+
+  printfc("Mapping %s  ( %.1f MB )\n", COLOR_BLUE, file, MB(st.st_size));
+
+  return true;
+
+}
+
+bool FileSystem::createMapped(const char* file, uint64 capacity) {
+
+  int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) return false;
+
+  if(ftruncate(fd, capacity) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  this->fd = fd;
+  this->capacity = capacity;
+
+  if(!reserve(capacity) || mmap(memory, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    release();
+    return false;
+  }
+
+  printfc("Mapping %s  ( %.1f MB )\n", COLOR_BLUE, file, MB(capacity));
+
+  mapped = true;
+
+  initDirtyTracking();
+  format();
+
+  return checkpoint();
+
+}
+
+bool FileSystem::openDisk(const char* file) {
+
+  int fd = open(file, O_RDWR);
+  if(fd == -1) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < MB(1)) {
+    ::close(fd);
+    return false;
+  }
+
+  this->fd = fd;
+  this->capacity = st.st_size;
+
+  if(!openPool()) {
+    release();
+    return false;
+  }
+
+  // mount reads the rest of the resident blocks once the header is known
+  if(pread(fd, memory, headerSize, 0) != headerSize || !mount()) {
+    printfc("Cannot open %s, unsupported image format\n", COLOR_RED, file);
+    release();
+    return false;
+  }
+
+  printfc("Opening %s  ( %.1f MB, %.1f MB buffer pool )\n", COLOR_BLUE, file, MB(st.st_size), MB(poolSize));
+
+  return true;
+
+}
+
+bool FileSystem::createDisk(const char* file, uint64 capacity) {
+
+  int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) return false;
+
+  if(ftruncate(fd, capacity) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  this->fd = fd;
+  this->capacity = capacity;
+
+  printfc("Creating %s  ( %.1f MB, %.1f MB buffer pool )\n", COLOR_BLUE, file, MB(capacity), MB(poolSize));
+
+  if(!openPool()) {
+    release();
+    return false;
+  }
+
+  initDirtyTracking();
+  format();
+
+  return checkpoint();
+
+}
+
+void FileSystem::setPoolSize(uint64 poolSize) {
+  this->poolSize = poolSize;
+}
+
+void FileSystem::setChecksums(bool checksums) {
+  this->checksums = checksums;
+}
+
+void FileSystem::setCompression(bool compression) {
+  this->compression = compression;
 }
 
 void FileSystem::format() {
 
+  acquireJournal();
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+  PinScope pins;
+
   printc("Formating memory\n", COLOR_BLUE);
 
+  releaseDirectoryHashes();
+  pathCache.clear();
+  inlineBlocks.clear();
+  slotBlocksFound = true;
+  resetChunkCache();
+  for(int i = 0; i < lockStripes; i++) directoryVersions[i]++;
+  if(pool != NULL) pool->clear();
+
   HeaderBlock* header = getHeaderBlock();
 
-  header->firstEmptyBlock = 1;
+  header->magic = FS_MAGIC;
+  header->version = FS_VERSION;
   header->totalBlocks = (capacity - headerSize) / BLOCK_SIZE;
-  header->usedBlocks = 1;
+
+  // the bitmap covers every block the volume may grow into
+  uint64 maxBlocks = (max((uint64)maxCapacity, (uint64)capacity) - headerSize) / BLOCK_SIZE;
+  header->bitmapBlocks = (maxBlocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+  header->usedBlocks = 0;
+
+  // every single operation has to fit in the journal, the largest ones change
+  // the whole bitmap, like deleting a file that fills the volume
+  header->journalBlock = 1;
+  header->journalBlocks = max(min(max((int)header->totalBlocks / 64, 64), 1024), 2 * header->bitmapBlocks + 16);
+  header->journalSequence = journalSequence;
+
+  header->bitmapBlock = header->journalBlock + header->journalBlocks;
+
+  // the checksum table follows the bitmap and is filled as blocks are written
+  int checksumBlocks = header->bitmapBlocks * 32;
+  header->checksumBlock = 0;
+
+  if(checksums) {
+    if(header->bitmapBlock + header->bitmapBlocks + checksumBlocks < (int)header->totalBlocks) header->checksumBlock = header->bitmapBlock + header->bitmapBlocks;
+    else printc("Volume is too small for block checksums\n", COLOR_YELLOW);
+  }
+
+  // blocks at or above the high-water mark were never allocated and are implicitly
+  // free, their bitmap blocks are initialized once the mark reaches them
+  header->highWaterMark = 0;
+
+  if(pool != NULL) {
+    loadResident(false);
+    header = getHeaderBlock();
+  }
+
+  markDirty(header, headerSize);
+
+  resetAllocationCaches();
+
+  memset(getJournalBlock(header->journalBlock), 0, BLOCK_SIZE);
+  markDirty(getJournalBlock(header->journalBlock));
+  journalHead = 0;
+
+  initAllocator();
+
+  setBlocksUsed(0, 1, true);
+  setBlocksUsed(header->journalBlock, header->journalBlocks, true);
+  setBlocksUsed(header->bitmapBlock, header->bitmapBlocks, true);
+  if(header->checksumBlock != 0) setBlocksUsed(header->checksumBlock, checksumBlocks, true);
 
   DirectoryBlock* rootDir = getDirectoryBlock(0);
 
   rootDir->parentDirectory = -1;
   rootDir->previousBlock = -1;
   rootDir->nextBlock = -1;
+  rootDir->depth = 0;
 
   rootDir->fileCount = 0;
 
-  for(int i = header->firstEmptyBlock; i < header->totalBlocks; i++) {
-    
-    EmptyBlock* block = getEmptyBlock(i);
+  markDirty(rootDir, sizeof(DirectoryBlock));
 
-    if(i == header->firstEmptyBlock) {
-      block->previousBlock = -1;
-      block->nextBlock = i + 1;
-      continue;
-    }
-
-    if(i == header->totalBlocks - 1) {
-      block->previousBlock = i - 1;
-      block->nextBlock = -1;
-      continue;
-    }
-
-    block->previousBlock = i - 1;
-    block->nextBlock = i + 1;
-    
-  }
+  lock.unlock();
+  releaseJournal();
 
   printc("Formating done\n", COLOR_BLUE);
   
@@ -210,24 +737,41 @@ void FileSystem::format() {
 
 bool FileSystem::directoryExist(const char* path) {
 
-  Directory dir = locateParentDirectory(path);
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return false;
 
+  std::shared_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
   return dir.directoryExist(ps.name());
 
 }
 
 bool FileSystem::createDirectory(const char* path) {
 
-  Directory dir = locateParentDirectory(path);
+  limitTransaction();
+
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return false;
 
-  return dir.createDirectory(ps.name());
+  std::unique_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
+  return dir.createDirectory(ps.name()) && intact();
 
 }
 
 bool FileSystem::parentDirectory(Path* parentDir, const char* path) {
 
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+
   bool ok = ps.set(path);
   if(!ok) {
     printfc("Invalid path %s\n", COLOR_RED, path);
@@ -241,6 +785,7 @@ bool FileSystem::parentDirectory(Path* parentDir, const char* path) {
     char* n = ps.next();
     parentDir->push(n);
 
+    std::shared_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
     Directory child = dir.openDirectory(n);
 
     if(child.isValid()) {
@@ -258,107 +803,253 @@ bool FileSystem::parentDirectory(Path* parentDir, const char* path) {
 
 DirectoryIterator FileSystem::directoryIterator(const char* path) {
 
-  if(strcmp(path, "/") == 0) return openRootDirectory().iterator("/");
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
 
-  Directory dir = locateParentDirectory(path);
+  if(strcmp(path, "/") == 0) {
+    std::shared_lock<std::shared_mutex> lock(directoryLock(0));
+    return openRootDirectory().iterator("/");
+  }
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return DirectoryIterator();
 
-  dir = dir.openDirectory(ps.name());
+  {
+    std::shared_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
+    dir = dir.openDirectory(ps.name());
+  }
+
   if(!dir.isValid()) {
     printfc("Cannot find directory %s\n", COLOR_RED, path);
     return DirectoryIterator();
   }
 
+  std::shared_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
   return dir.iterator(path);
 
 }
 
 bool FileSystem::fileExist(const char* path) {
 
-  Directory dir = locateParentDirectory(path);
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return false;
 
+  std::shared_lock<std::shared_mutex> lock(directoryLock(blockIndex(dir.block)));
   return dir.fileExist(ps.name());
 
 }
 
 File FileSystem::openFile(const char* path, FileOpenMode mode) {
 
-  Directory dir = locateParentDirectory(path);
+  if(mode != READ) limitTransaction();
+
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return File();
 
-  return dir.openFile(ps.name(), mode);
+  // opening for writing may create the file
+  std::shared_mutex& lock = directoryLock(blockIndex(dir.block));
+  std::shared_lock<std::shared_mutex> shared(lock, std::defer_lock);
+  std::unique_lock<std::shared_mutex> exclusive(lock, std::defer_lock);
 
-}
+  if(mode == READ) shared.lock();
+  else exclusive.lock();
 
-bool FileSystem::renameDirectory(const char* path, const char* name) {
+  File file = dir.openFile(ps.name(), mode);
+  if(!intact()) return File();
 
-  Directory dir = locateParentDirectory(path);
-  if(!dir.isValid()) return false;
+  return file;
+
+}
 
-  return dir.renameDirectory(ps.name(), name);
+#ifdef FS_COROUTINES
 
+void FileSystem::setExecutor(Executor* executor) {
+  this->executor = executor;
 }
 
-bool FileSystem::deleteDirectory(const char* path) {
+FileOperation<File> FileSystem::openFileAsync(const char* path, FileOpenMode mode) {
+  std::string name = path;
+  return FileOperation<File>(executor, [this, name, mode]() { return openFile(name.c_str(), mode); });
+}
 
-  Directory dir = locateParentDirectory(path);
-  if(!dir.isValid()) return false;
+#endif
 
-  return dir.deleteDirectory(ps.name());
+bool FileSystem::renameDirectory(const char* path, const char* name) {
 
-}
+  limitTransaction();
 
-bool FileSystem::renameFile(const char* path, const char* name) {
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+  PinScope pins;
 
-  Directory dir = locateParentDirectory(path);
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return false;
 
-  return dir.renameFile(ps.name(), name);
+  bool ok = dir.renameDirectory(ps.name(), name);
+  if(ok) invalidatePathCache(path);
+
+  return ok && intact();
 
 }
 
-bool FileSystem::deleteFile(const char* path) {
+bool FileSystem::deleteDirectory(const char* path) {
+
+  limitTransaction();
+
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
+  if(!dir.isValid()) return false;
+
+  bool ok = dir.deleteDirectory(ps.name());
+  if(ok) invalidatePathCache(path);
+
+  return ok && intact();
+
+}
+
+bool FileSystem::renameFile(const char* path, const char* name) {
+
+  limitTransaction();
+
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
+  if(!dir.isValid()) return false;
+
+  int root = blockIndex(dir.block);
 
-  Directory dir = locateParentDirectory(path);
+  // both names are locked in stripe order so writers of either file are waited for
+  std::shared_mutex* first = &fileLock(root, ps.name());
+  std::shared_mutex* second = &fileLock(root, name);
+  if(first > second) std::swap(first, second);
+
+  std::unique_lock<std::shared_mutex> firstFile(*first);
+  std::unique_lock<std::shared_mutex> secondFile(*second, std::defer_lock);
+  if(second != first) secondFile.lock();
+
+  std::unique_lock<std::shared_mutex> lock(directoryLock(root));
+  return dir.renameFile(ps.name(), name) && intact();
+
+}
+
+bool FileSystem::deleteFile(const char* path) {
+
+  limitTransaction();
+
+  std::shared_lock<std::shared_mutex> volume(volumeMutex);
+  PinScope pins;
+
+  PathSeparator ps;
+  Directory dir = locateParentDirectory(path, &ps);
   if(!dir.isValid()) return false;
 
-  return dir.deleteFile(ps.name());
+  int root = blockIndex(dir.block);
+
+  std::unique_lock<std::shared_mutex> file(fileLock(root, ps.name()));
+  std::unique_lock<std::shared_mutex> lock(directoryLock(root));
+  return dir.deleteFile(ps.name()) && intact();
+
+}
+
+uint64 FileSystem::pathCacheHitCount() {
+  std::lock_guard<std::mutex> lock(pathCacheMutex);
+  return pathCacheHits;
+}
+
+uint64 FileSystem::pathCacheMissCount() {
+  std::lock_guard<std::mutex> lock(pathCacheMutex);
+  return pathCacheMisses;
+}
+
+void FileSystem::invalidatePathCache(const char* path) {
+
+  // drops the directory and everything cached below it
+
+  std::lock_guard<std::mutex> lock(pathCacheMutex);
+  int len = strlen(path);
+
+  for(auto it = pathCache.begin(); it != pathCache.end();) {
+    const std::string& key = it->first;
+    bool below = key.compare(0, len, path) == 0 && ((int)key.size() == len || key[len] == '/');
+    if(below) it = pathCache.erase(it);
+    else it++;
+  }
 
 }
 
 int FileSystem::totalBlocks() {
+  std::lock_guard<std::mutex> lock(allocatorMutex);
   return getHeaderBlock()->totalBlocks;
 }
 
 int FileSystem::usedBlocks() {
-  return getHeaderBlock()->usedBlocks;
+  // blocks sitting in allocation caches or waiting for a commit to be freed are
+  // marked used but belong to nobody
+  std::lock_guard<std::mutex> lock(allocatorMutex);
+  return getHeaderBlock()->usedBlocks - cachedBlocks() - freedBlocks();
 }
 
 int FileSystem::freeBlocks() {
+  std::lock_guard<std::mutex> lock(allocatorMutex);
   HeaderBlock* header = getHeaderBlock();
-  return header->totalBlocks - header->usedBlocks;
+  return header->totalBlocks - header->usedBlocks + cachedBlocks() + freedBlocks();
 }
 
 FileSystem::~FileSystem() {
-  if(memory == NULL) return;
-  delete[] memory;
+  release();
 }
 
-Directory FileSystem::locateParentDirectory(const char* path) {
+Directory FileSystem::locateParentDirectory(const char* path, PathSeparator* ps) {
 
-  bool ok = ps.set(path);
+  if(failed) {
+    printc("ERROR: Volume failed, reopen it to continue from the last commit\n", COLOR_RED);
+    return Directory();
+  }
+
+  bool ok = ps->set(path);
   if(!ok) {
     printfc("Invalid path %s\n", COLOR_RED, path);
     return Directory();
   }
 
   Directory dir = openRootDirectory();
+  if(!ps->hasNext()) return dir;
 
-  while(ps.hasNext()) {
+  {
+    std::lock_guard<std::mutex> lock(pathCacheMutex);
+    auto it = pathCache.find(ps->parent());
 
-    char* n = ps.next();
+    if(it != pathCache.end()) {
+      pathCacheHits++;
+      return Directory(this, getDirectoryBlock(it->second));
+    }
+
+    pathCacheMisses++;
+  }
+
+  std::string prefix;
+
+  while(ps->hasNext()) {
+
+    char* n = ps->next();
+
+    std::shared_lock<std::shared_mutex> parent(directoryLock(blockIndex(dir.block)));
     Directory child = dir.openDirectory(n);
+    parent.unlock();
 
     if(child.isValid()) {
       dir = child;
@@ -367,6 +1058,13 @@ Directory FileSystem::locateParentDirectory(const char* path) {
       return Directory();
     }
 
+    prefix += '/';
+    prefix += n;
+
+    std::lock_guard<std::mutex> lock(pathCacheMutex);
+    if(pathCache.size() >= pathCacheCapacity) pathCache.clear();
+    pathCache[prefix] = blockIndex(dir.block);
+
   }
 
   return dir;
@@ -377,722 +1075,4735 @@ Directory FileSystem::openRootDirectory() {
   return Directory(this, getDirectoryBlock(0));
 }
 
-int FileSystem::allocateBlock() {
+std::shared_mutex& FileSystem::directoryLock(int root) {
+  return directoryLocks[(uint)root % lockStripes];
+}
+
+uint64& FileSystem::directoryVersion(int root) {
+  return directoryVersions[(uint)root % lockStripes];
+}
+
+std::shared_mutex& FileSystem::fileLock(int directory, const char* name) {
+  uint hash = hashName(name, 'F') ^ ((uint)directory * 2654435761u);
+  return fileLocks[hash % lockStripes];
+}
+
+bool FileSystem::mount() {
 
   HeaderBlock* header = getHeaderBlock();
 
-  int i = header->firstEmptyBlock;
-  
-  if(i == -1) {
-    printc("FATAL ERROR: CANNOT ALLOCATE NEW BLOCK\n", COLOR_RED);
-    exit(1);
-  }
+  if(header->magic != FS_MAGIC) return false;
+  if(header->version < FS_OLDEST_VERSION || header->version > FS_VERSION) return false;
+  if(header->totalBlocks > (capacity - headerSize) / BLOCK_SIZE) return false;
+  if(pool != NULL && !loadResident(true)) return false;
 
-  header->usedBlocks++;
+  initDirtyTracking();
+  replayJournal();
+  initAllocator();
 
-  EmptyBlock* block = getEmptyBlock(i);
-  header->firstEmptyBlock = block->nextBlock;
+  slotBlocksFound = false;
 
-  EmptyBlock* firstEmptyblock = getEmptyBlock(header->firstEmptyBlock);
-  if(firstEmptyblock != NULL) firstEmptyblock->previousBlock = -1;
+  if(getHeaderBlock()->version < FS_VERSION) return upgrade();
 
-  return i;
+  return true;
 
 }
 
-void FileSystem::deallocateBlock(int i) {
+bool FileSystem::upgrade() {
 
-  HeaderBlock* header = getHeaderBlock();
-  header->usedBlocks--;
+  // entries of version 6 have 32-bit file sizes and leaves hold more of them,
+  // so every directory is rebuilt in place around its root block, entries
+  // before version 9 only get their flags cleared, and version 9 needs no
+  // more than the new version number
 
-  EmptyBlock* emptyBlock = getEmptyBlock(i);
-  emptyBlock->previousBlock = -1;
-  emptyBlock->nextBlock = header->firstEmptyBlock;
+  printc("Upgrading image format\n", COLOR_YELLOW);
 
-  EmptyBlock* secondEmptyBlock = getEmptyBlock(header->firstEmptyBlock);
-  if(secondEmptyBlock != NULL) secondEmptyBlock->previousBlock = i;
+  uint version = getHeaderBlock()->version;
 
-  header->firstEmptyBlock = i;
+  std::vector<int> directories;
+  if(version < 9) directories.push_back(0);
 
-}
+  while(!directories.empty()) {
+    int root = directories.back();
+    directories.pop_back();
+    if(version >= 7) upgradeEntries(root, &directories);
+    else if(!upgradeDirectory(root, &directories)) {
+      printc("Cannot upgrade image, volume is full\n", COLOR_RED);
+      return false;
+    }
+    // clearing flags again after a crash does no harm, so that upgrade commits
+    // as it goes, a rebuilt directory would be read as an old one
+    if(version >= 7) limitTransaction();
+  }
 
-HeaderBlock* FileSystem::getHeaderBlock() {
-  return (HeaderBlock*)memory;
-}
+  HeaderBlock* header = getHeaderBlock();
+  if(version < 8) header->checksumBlock = 0;
+  header->version = FS_VERSION;
+  markDirty(header, headerSize);
 
-DirectoryBlock* FileSystem::getDirectoryBlock(int i) {
-  return (DirectoryBlock*)blockAt(i);
-}
+  return fd == -1 || commit();
 
-FileBlock* FileSystem::getFileBlock(int i) {
-  return (FileBlock*)blockAt(i);
 }
 
-EmptyBlock* FileSystem::getEmptyBlock(int i) {
-  return (EmptyBlock*)blockAt(i);
-}
+bool FileSystem::upgradeDirectory(int root, std::vector<int>* directories) {
 
-char* FileSystem::blockAt(int i) {
-  if(i == -1) return NULL;
-  return memory + headerSize + i * BLOCK_SIZE;
-}
+  std::vector<FileInfo> entries;
+  std::vector<int> nodes;
+  std::vector<int> blocks;
 
-int FileSystem::blockIndex(void* p) {
-  if(p == NULL) return -1;
-  return ((char*)p - memory - headerSize) / BLOCK_SIZE;
-}
+  // the old tree is read in key order before any of its blocks is reused
 
-// #endregion
+  nodes.push_back(root);
 
-// #region Directory
+  while(!nodes.empty()) {
 
-Directory::Directory() {
-  fs = NULL;
-  block = NULL;
-}
+    PinScope pins;
 
-Directory::Directory(FileSystem* fs, DirectoryBlock* block) {
-  this->fs = fs;
-  this->block = block;
-}
+    int n = nodes.back();
+    nodes.pop_back();
 
-bool Directory::isValid() {
-  return fs != NULL;
-}
+    if(n != root) blocks.push_back(n);
+
+    DirectoryIndexBlock* node = getDirectoryIndexBlock(n);
+
+    if(node->depth > 0) {
+      for(int i = node->keyCount - 1; i >= 0; i--) nodes.push_back(node->keys[i].childBlock);
+      continue;
+    }
+
+    DirectoryBlockV6* leaf = (DirectoryBlockV6*)node;
+
+    for(uint i = 0; i < leaf->fileCount; i++) {
+
+      FileInfoV6* old = &leaf->files[i];
+      FileInfo entry;
+
+      memcpy(entry.fileName, old->fileName, sizeof(entry.fileName));
+      entry.fileType = old->fileType;
+      entry.flags = 0;
+      entry.fileSize = old->fileSize;
+      entry.dateCreated = old->dateCreated;
+      entry.dateModified = old->dateModified;
+      entry.firstBlock = old->firstBlock;
+      entry.lastBlock = old->lastBlock;
+
+      entries.push_back(entry);
+      if(entry.fileType == 'D') directories->push_back(entry.firstBlock);
+
+    }
 
-bool Directory::fileExist(const char* name) {
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
   }
-  return getFileInfo(name, 'F', NULL, NULL) != NULL;
-}
 
-File Directory::openFile(const char* name, FileOpenMode mode) {
+  PinScope pins;
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return File();
+  DirectoryBlock* block = getDirectoryBlock(root);
+  block->previousBlock = -1;
+  block->nextBlock = -1;
+  block->depth = 0;
+  block->fileCount = 0;
+  markDirty(block);
+
+  for(int n : blocks) deallocateBlock(n);
+
+  Directory dir(this, block);
+
+  for(FileInfo& entry : entries) {
+    PinScope pins;
+    FileInfo* added = dir.addFileInfo(entry.fileName, entry.fileType);
+    if(added == NULL) return false;
+    *added = entry;
+    markDirty(added, sizeof(FileInfo));
   }
 
-  FileInfo* fileInfo = getFileInfo(name, 'F', NULL, NULL);
+  return true;
 
-  if(fileInfo == NULL) {
+}
 
-    if(mode == READ) {
-      printfc("Cannot open file %s because it does not exist\n", COLOR_RED, name);
-      return File();
+void FileSystem::upgradeEntries(int root, std::vector<int>* directories) {
+
+  std::vector<int> nodes;
+  nodes.push_back(root);
+
+  while(!nodes.empty()) {
+
+    PinScope pins;
+
+    int n = nodes.back();
+    nodes.pop_back();
+
+    DirectoryIndexBlock* node = getDirectoryIndexBlock(n);
+
+    if(node->depth > 0) {
+      for(uint i = 0; i < node->keyCount; i++) nodes.push_back(node->keys[i].childBlock);
+      continue;
     }
 
-    fileInfo = addFileInfo(name, 'F');
+    DirectoryBlock* leaf = (DirectoryBlock*)node;
 
-    fileInfo->fileSize = 0;
-    fileInfo->dateCreated = getCurrentTime();
-    fileInfo->dateModified = fileInfo->dateCreated;
+    for(uint i = 0; i < leaf->fileCount; i++) {
+      leaf->files[i].flags = 0;
+      if(leaf->files[i].fileType == 'D') directories->push_back(leaf->files[i].firstBlock);
+    }
 
-    fileInfo->firstBlock = -1;
-    fileInfo->lastBlock = -1;
+    markDirty(leaf);
 
   }
 
-  return File(fs, fileInfo, mode);
-
 }
 
-bool Directory::directoryExist(const char* name) {
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
+void FileSystem::release() {
+
+  delete[] dirtyBlocks;
+  delete[] pendingBlocks;
+  delete[] journaledBlocks;
+  delete[] flushBlocks;
+  delete[] freeSummary;
+  releaseDirectoryHashes();
+  resetAllocationCaches();
+  resetChunkCache();
+  pathCache.clear();
+  inlineBlocks.clear();
+  dirtyBlocks = NULL;
+  pendingBlocks = NULL;
+  journaledBlocks = NULL;
+  flushBlocks = NULL;
+  freeSummary = NULL;
+
+  delete io;
+  io = NULL;
+  queuedWrites.clear();
+
+  if(fd != -1) ::close(fd);
+  fd = -1;
+
+  if(pool != NULL) {
+    delete pool;
+    delete[] memory;
+  }else if(memory != NULL) {
+    munmap(memory, reserved);
   }
-  return getFileInfo(name, 'D', NULL, NULL) != NULL;
+
+  memory = NULL;
+  pool = NULL;
+  residentBlocks = 0;
+  reserved = 0;
+  mapped = false;
+  failed = false;
+
 }
 
-bool Directory::createDirectory(const char* name) {
+bool FileSystem::reserve(uint64 capacity) {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
-  }
+  // the whole address range the volume may grow into is reserved up front
+  // so block pointers stay valid when the volume grows
 
-  FileInfo* fileInfo = getFileInfo(name, 'D', NULL, NULL);
-  if(fileInfo != NULL) {
-    printfc("Cannot create directory %s because it already exist\n", COLOR_RED, name);
+  uint64 page = sysconf(_SC_PAGESIZE);
+  uint64 size = max((uint64)maxCapacity, (uint64)capacity);
+
+  reserved = (size + page - 1) / page * page;
+
+  void* p = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if(p == MAP_FAILED) {
+    reserved = 0;
     return false;
   }
 
-  fileInfo = addFileInfo(name, 'D');
+  memory = (char*)p;
+  return true;
 
-  int n = fs->allocateBlock();
-  DirectoryBlock* dir = fs->getDirectoryBlock(n);
+}
 
-  dir->parentDirectory = fs->blockIndex(this->block);
-  dir->previousBlock = -1;
-  dir->nextBlock = -1;
-  dir->fileCount = 0;
+bool FileSystem::openPool() {
 
-  fileInfo->dateCreated = getCurrentTime();
-  fileInfo->dateModified = fileInfo->dateCreated;
+  // nothing is mapped, the reservation only sizes dirty tracking and growth
+  reserved = max((uint64)maxCapacity, (uint64)capacity);
+
+  memory = new char[headerSize];
+  memset(memory, 0, headerSize);
+
+  pool = new BufferPool(this, max((int)(poolSize / BLOCK_SIZE), 64));
+  io = new IoEngine(fd);
+
+  if(pool->frameCount() == 0) {
+    printc("Cannot allocate buffer pool\n", COLOR_RED);
+    return false;
+  }
 
-  fileInfo->firstBlock = n;
   return true;
 
 }
 
-Directory Directory::openDirectory(const char* name) {
+bool FileSystem::loadResident(bool read) {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return Directory();
-  }
+  // the root directory, the journal and the bitmap stay in memory behind the header,
+  // laid out as in the image so they are written back like any mapped range
 
-  FileInfo* fileInfo = getFileInfo(name, 'D', NULL, NULL);
-  if(fileInfo == NULL) {
-    printfc("Cannot open directory %s because it does not exist\n", COLOR_RED, name);
-    return Directory();
+  HeaderBlock* header = getHeaderBlock();
+
+  int blocks = header->bitmapBlock + header->bitmapBlocks;
+  if(blocks <= 0 || blocks > (int)header->totalBlocks) return false;
+
+  uint64 size = headerSize + (uint64)blocks * BLOCK_SIZE;
+  char* resident = new char[size];
+
+  memcpy(resident, memory, headerSize);
+  memset(resident + headerSize, 0, size - headerSize);
+
+  for(uint64 offset = headerSize; read && offset < size;) {
+    ssize_t n = pread(fd, resident + offset, size - offset, offset);
+    if(n <= 0) {
+      delete[] resident;
+      return false;
+    }
+    offset += n;
   }
 
-  return Directory(fs, fs->getDirectoryBlock(fileInfo->firstBlock)); 
+  delete[] memory;
+  memory = resident;
+  residentBlocks = blocks;
+
+  return true;
 
 }
 
-DirectoryIterator Directory::iterator(const char* path) {
-  return DirectoryIterator(fs, block, path);
+bool FileSystem::isResident(void* p) {
+  return pool == NULL || ((char*)p >= memory && (char*)p < memory + headerSize + (uint64)residentBlocks * BLOCK_SIZE);
 }
 
-bool Directory::deleteFile(const char* name) {
+bool FileSystem::evictBlock(int i, char* data) {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
-  }
+  // metadata waiting for the journal or a checkpoint has to stay in memory,
+  // data blocks are written in place
 
-  DirectoryBlock* block;
-  int index;
-  FileInfo* fileInfo = getFileInfo(name, 'F', &block, &index);
+  int w = i / 64;
+  uint64 bit = 1ULL << (i % 64);
 
-  if(fileInfo == NULL) {
-    printfc("Cannot delete file %s because it does not even exist\n", COLOR_RED, name);
-    return false;
-  }
+  // a failed volume writes nothing more, its changes since the last commit are dropped
+  if(__atomic_load_n(&failed, __ATOMIC_RELAXED)) return true;
 
-  FileBlock* fb = fs->getFileBlock(fileInfo->firstBlock);
-  while(fb != NULL) {
-    FileBlock* t = fb;
-    fb = fs->getFileBlock(fb->nextBlock);
-    fs->deallocateBlock(fs->blockIndex(t));
-  }
+  uint64 pending = __atomic_load_n(&pendingBlocks[w], __ATOMIC_RELAXED) | __atomic_load_n(&journaledBlocks[w], __ATOMIC_RELAXED);
+  if(pending & bit) return false;
+
+  // a block may also be waiting in a transaction being flushed
+  uint64 dirty = __atomic_load_n(&dirtyBlocks[w], __ATOMIC_RELAXED) | __atomic_load_n(&flushBlocks[w], __ATOMIC_RELAXED);
+  if(!(dirty & bit)) return true;
 
-  removeFileInfo(block, index);
+  if(pwrite(fd, data, BLOCK_SIZE, headerSize + (uint64)i * BLOCK_SIZE) != BLOCK_SIZE) return false;
 
+  __atomic_fetch_and(&dirtyBlocks[w], ~bit, __ATOMIC_RELAXED);
   return true;
 
 }
 
-bool Directory::renameFile(const char* name, const char* newName) {
+bool FileSystem::grow() {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
-  }
+  HeaderBlock* header = getHeaderBlock();
 
-  if(strlen(newName) > 31) {
-    printfc("Cannot rename, maximum length of name is 31 character (%s)\n", COLOR_RED, newName);
-    return false;
+  uint64 current = headerSize + (uint64)header->totalBlocks * BLOCK_SIZE;
+  uint64 coverage = headerSize + (uint64)header->bitmapBlocks * BLOCK_SIZE * 8 * BLOCK_SIZE;
+  uint64 limit = min(min((uint64)maxCapacity, reserved), coverage);
+
+  if(current + BLOCK_SIZE > limit) return false;
+
+  uint64 target = min(current * 2, limit);
+
+  // other operations go on using the volume while it grows, only pages past the
+  // ones already mapped are mapped or opened up, the live ones are never replaced
+  uint64 page = sysconf(_SC_PAGESIZE);
+  uint64 mappedEnd = (capacity + page - 1) / page * page;
+
+  if(pool != NULL) {
+    if(ftruncate(fd, target) != 0) return false;
+  }else if(mapped) {
+    if(ftruncate(fd, target) != 0) return false;
+    if(target > mappedEnd && mmap(memory + mappedEnd, target - mappedEnd, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, mappedEnd) == MAP_FAILED) return false;
+  }else{
+    if(target > mappedEnd && mprotect(memory + mappedEnd, target - mappedEnd, PROT_READ | PROT_WRITE) != 0) return false;
   }
 
-  DirectoryBlock* block;
-  int index;
-  FileInfo* fileInfo = getFileInfo(name, 'F', &block, &index);
+  printfc("Growing volume to %.1f MB\n", COLOR_BLUE, MB(target));
 
-  if(fileInfo == NULL) {
-    printfc("Cannot rename file %s because it does not exist\n", COLOR_RED, name);
-    return false;
+  uint oldBlocks = header->totalBlocks;
+
+  capacity = target;
+  header->totalBlocks = (capacity - headerSize) / BLOCK_SIZE;
+  markDirty(header, headerSize);
+
+  // the tail of the old last bitmap word now covers real blocks
+  int tail = oldBlocks % 64;
+  int w = oldBlocks / 64;
+  int bitmapBlock = w / (BLOCK_SIZE / 8);
+
+  if(tail != 0 && (uint64)bitmapBlock * BLOCK_SIZE * 8 < header->highWaterMark) {
+    *bitmapWord(w) &= ~(~0ULL << tail);
+    markDirty(bitmapWord(w), sizeof(uint64));
   }
 
-  bool exist = fileExist(newName);
-  if(exist) {
-    printfc("Cannot rename file %s to %s because file with new name already exist\n", COLOR_RED, name, newName);
-    return false;
+  tail = header->totalBlocks % 64;
+  w = header->totalBlocks / 64;
+  bitmapBlock = w / (BLOCK_SIZE / 8);
+
+  if(tail != 0 && (uint64)bitmapBlock * BLOCK_SIZE * 8 < header->highWaterMark) {
+    *bitmapWord(w) |= ~0ULL << tail;
+    markDirty(bitmapWord(w), sizeof(uint64));
   }
 
-  FileInfo temp = *fileInfo;
-  strcpy(temp.fileName, newName);
-  temp.dateModified = getCurrentTime();
+  initAllocator();
+  allocationHint = oldBlocks;
 
-  removeFileInfo(block, index);
-  fileInfo = addFileInfo(newName, 'F');
-  *fileInfo = temp;
+  return true;
+
+}
+
+void FileSystem::setMaxCapacity(uint64 maxCapacity) {
+  this->maxCapacity = maxCapacity;
+}
+
+void FileSystem::releaseDirectoryHash(int root) {
+
+  std::lock_guard<std::mutex> lock(directoryHashMutex);
+
+  auto it = directoryHashes.find(root);
+  if(it == directoryHashes.end()) return;
+
+  delete it->second;
+  directoryHashes.erase(it);
+
+}
+
+void FileSystem::releaseDirectoryHashes() {
+  std::lock_guard<std::mutex> lock(directoryHashMutex);
+  for(auto& it : directoryHashes) delete it.second;
+  directoryHashes.clear();
+}
+
+bool FileSystem::isBackingFile(const char* file) {
+
+  struct stat a, b;
+  if(fstat(fd, &a) != 0 || stat(file, &b) != 0) return false;
+
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+
+}
+
+void FileSystem::initDirtyTracking() {
+
+  int words = dirtyWords();
+
+  dirtyBlocks = new uint64[words];
+  pendingBlocks = new uint64[words];
+  journaledBlocks = new uint64[words];
+  flushBlocks = new uint64[words];
+
+  clearDirty();
+
+}
+
+void FileSystem::markDirty(void* p, int len) {
+
+  if(p == NULL) return;
+
+  int first;
+  int last;
+
+  if(isResident(p)) {
+
+    uint64 start = (char*)p - memory;
+    uint64 end = start + len;
+
+    // writers in different directories mark blocks sharing a word concurrently
+
+    if(start < headerSize) {
+      __atomic_store_n(&headerDirty, true, __ATOMIC_RELAXED);
+      __atomic_store_n(&headerPending, true, __ATOMIC_RELAXED);
+      if(end <= headerSize) return;
+      start = headerSize;
+    }
+
+    first = (start - headerSize) / BLOCK_SIZE;
+    last = (end - 1 - headerSize) / BLOCK_SIZE;
+
+  }else{
+    // a frame of the buffer pool holds a single block, a block handed out by
+    // a failed pool has none and is never written
+    first = last = blockIndex(p);
+    if(first == -1) return;
+  }
+
+  for(int i = first; i <= last; i++) {
+    __atomic_fetch_or(&dirtyBlocks[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+    uint64 was = __atomic_fetch_or(&pendingBlocks[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+    if(!(was & (1ULL << (i % 64)))) __atomic_add_fetch(&pendingCount, 1, __ATOMIC_RELAXED);
+  }
+
+}
+
+void FileSystem::markDataDirty(void* p, int64 len) {
+
+  int first;
+  int last;
+
+  if(isResident(p)) {
+    uint64 start = (char*)p - memory;
+    uint64 end = start + len;
+    first = (start - headerSize) / BLOCK_SIZE;
+    last = (end - 1 - headerSize) / BLOCK_SIZE;
+  }else{
+    first = last = blockIndex(p);
+    if(first == -1) return;
+  }
+
+  for(int i = first; i <= last; i++) {
+    __atomic_fetch_or(&dirtyBlocks[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+  }
+
+}
+
+void FileSystem::clearDirty() {
+  int words = dirtyWords();
+  memset(dirtyBlocks, 0, words * sizeof(uint64));
+  memset(pendingBlocks, 0, words * sizeof(uint64));
+  memset(journaledBlocks, 0, words * sizeof(uint64));
+  memset(flushBlocks, 0, words * sizeof(uint64));
+  __atomic_store_n(&pendingCount, 0, __ATOMIC_RELAXED);
+  headerDirty = false;
+  headerPending = false;
+}
+
+int FileSystem::dirtyWords() {
+  int blocks = (reserved - headerSize) / BLOCK_SIZE;
+  return (blocks + 63) / 64;
+}
+
+void FileSystem::initAllocator() {
+
+  HeaderBlock* header = getHeaderBlock();
+
+  int words = (header->totalBlocks + 63) / 64;
+  int summaryWords = (words + 63) / 64;
+
+  delete[] freeSummary;
+  freeSummary = new uint64[summaryWords];
+  memset(freeSummary, 0, summaryWords * sizeof(uint64));
+
+  for(int w = 0; w < words; w++) {
+    if(bitmapBits(w) != ~0ULL) freeSummary[w / 64] |= 1ULL << (w % 64);
+  }
+
+  allocationHint = 0;
+
+}
+
+int FileSystem::allocateBlock() {
+
+  int count;
+  return allocateBlocks(1, &count, -1);
+
+}
+
+int FileSystem::allocateBlocks(int wanted, int* count, int goal) {
+
+  // small requests are served from the calling thread's run, refilled a batch at a time;
+  // large ones and threads finding their slot busy go to the bitmap directly
+
+  AllocationCache* cache = lockAllocationCache();
+
+  if(cache == NULL || wanted >= AllocationCache::batch) {
+    if(cache != NULL) unlockAllocationCache(cache);
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    return takeBlocks(wanted, count, goal);
+  }
+
+  if(cache->next == cache->end) {
+
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+
+    int n;
+    int start = takeBlocks(AllocationCache::batch, &n, goal);
+
+    if(start == -1) {
+      unlockAllocationCache(cache);
+      *count = 0;
+      return -1;
+    }
+
+    cache->next = start;
+    cache->end = start + n;
+    __atomic_store_n(&cache->held, cache->held + n, __ATOMIC_RELAXED);
+
+  }
+
+  int start = cache->next;
+  *count = min(wanted, cache->end - start);
+
+  cache->next += *count;
+  __atomic_store_n(&cache->held, cache->held - *count, __ATOMIC_RELAXED);
+
+  unlockAllocationCache(cache);
+  return start;
+
+}
+
+void FileSystem::deallocateBlock(int i) {
+  deallocateBlocks(i, 1);
+}
+
+void FileSystem::deallocateBlocks(int i, int count) {
+
+  if(count <= 0) return;
+
+  // the committed image may still point at the blocks, so they only become free
+  // with the transaction that frees them, see releaseBlocks
+  if(fd != -1) __atomic_add_fetch(&deferredBlocks, count, __ATOMIC_RELAXED);
+
+  AllocationCache* cache = lockAllocationCache();
+
+  if(cache != NULL && cache->freedCount < AllocationCache::capacity) {
+    cache->freedStart[cache->freedCount] = i;
+    cache->freedBlocks[cache->freedCount] = count;
+    cache->freedCount++;
+    __atomic_store_n(&cache->held, cache->held + count, __ATOMIC_RELAXED);
+    unlockAllocationCache(cache);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(allocatorMutex);
+
+  if(cache != NULL) {
+    for(int k = 0; k < cache->freedCount; k++) releaseBlocks(cache->freedStart[k], cache->freedBlocks[k]);
+    cache->freedCount = 0;
+    __atomic_store_n(&cache->held, cache->end - cache->next, __ATOMIC_RELAXED);
+    unlockAllocationCache(cache);
+  }
+
+  releaseBlocks(i, count);
+
+}
+
+void FileSystem::releaseBlocks(int i, int count) {
+
+  // called with the allocator lock held, a volume without an image has nothing
+  // to keep consistent and frees at once
+
+  if(fd == -1) {
+    setBlocksUsed(i, count, false);
+    return;
+  }
+
+  freedRuns.push_back({ i, count });
+
+}
+
+void FileSystem::applyFreedBlocks() {
+
+  // called with the allocator lock held while the volume is locked exclusively,
+  // the bitmap shows every freed block as free until holdReleasedBlocks(true)
+
+  holdReleasedBlocks(false);
+
+  for(BlockRun& run : freedRuns) {
+    setBlocksUsed(run.start, run.count, false);
+    releasingRuns.push_back(run);
+  }
+
+  freedRuns.clear();
+  __atomic_store_n(&deferredBlocks, 0, __ATOMIC_RELAXED);
+
+}
+
+void FileSystem::holdReleasedBlocks(bool hold) {
+
+  // sets or clears the bits of released blocks without logging the change or
+  // counting them, so the allocator passes them over
+
+  for(BlockRun& run : releasingRuns) {
+    for(int i = run.start; i < run.start + run.count; i++) {
+      int w = i / 64;
+      uint64* word = bitmapWord(w);
+      if(hold) *word |= 1ULL << (i % 64);
+      else *word &= ~(1ULL << (i % 64));
+      if(*word == ~0ULL) freeSummary[w / 64] &= ~(1ULL << (w % 64));
+      else freeSummary[w / 64] |= 1ULL << (w % 64);
+    }
+  }
+
+}
+
+int FileSystem::freedBlocks() {
+
+  // blocks freed since the last transaction, still marked used in the bitmap
+
+  int blocks = 0;
+  for(BlockRun& run : freedRuns) blocks += run.count;
+
+  return blocks;
+
+}
+
+int FileSystem::takeBlocks(int wanted, int* count, int goal) {
+
+  int start = findRun(wanted, count, goal);
+
+  // free blocks may be sitting in the caches of idle threads
+  if(start == -1 && drainAllocationCaches(false)) start = findRun(wanted, count, goal);
+
+  if(start == -1) {
+
+    *count = 0;
+    if(!grow()) return -1;
+
+    // everything past the old end is free
+    start = allocationHint;
+    *count = freeRunLength(start, wanted);
+
+  }
+
+  setBlocksUsed(start, *count, true);
+  allocationHint = start + *count;
+
+  return start;
+
+}
+
+int FileSystem::findRun(int wanted, int* count, int goal) {
+
+  HeaderBlock* header = getHeaderBlock();
+  int blocks = header->totalBlocks;
+
+  if(goal < 0 || goal >= blocks) goal = allocationHint;
+
+  int bestStart = -1;
+  int bestCount = 0;
+
+  // first fit from the goal to the end of the volume, then from the start,
+  // settling for the longest run seen when no run is long enough
+  for(int pass = 0; pass < 2 && bestCount < wanted; pass++) {
+
+    int i = pass == 0 ? goal : 0;
+    int end = pass == 0 ? blocks : goal;
+
+    while(i < end) {
+
+      int start = findFreeBlock(i);
+      if(start == -1 || start >= end) break;
+
+      int run = freeRunLength(start, wanted);
+
+      if(run > bestCount) {
+        bestStart = start;
+        bestCount = run;
+        if(run >= wanted) break;
+      }
+
+      i = start + run;
+
+    }
+
+  }
+
+  *count = bestCount;
+  return bestStart;
+
+}
+
+AllocationCache* FileSystem::lockAllocationCache() {
+
+  static std::atomic<int> threads(0);
+  static thread_local int slot = threads++;
+
+  AllocationCache* cache = &allocationCaches[slot % allocationCacheCount];
+  if(__atomic_exchange_n(&cache->busy, true, __ATOMIC_ACQUIRE)) return NULL;
+
+  return cache;
+
+}
+
+void FileSystem::unlockAllocationCache(AllocationCache* cache) {
+  __atomic_store_n(&cache->busy, false, __ATOMIC_RELEASE);
+}
+
+bool FileSystem::drainAllocationCaches(bool wait) {
+
+  // returns cached blocks to the bitmap under the allocator lock held by the caller,
+  // caches in use are skipped unless waiting, which only happens while the volume
+  // is locked exclusively and no thread can be holding its cache
+
+  bool drained = false;
+
+  for(int c = 0; c < allocationCacheCount; c++) {
+
+    AllocationCache* cache = &allocationCaches[c];
+
+    bool locked = !__atomic_exchange_n(&cache->busy, true, __ATOMIC_ACQUIRE);
+    while(!locked && wait) locked = !__atomic_exchange_n(&cache->busy, true, __ATOMIC_ACQUIRE);
+
+    if(!locked) continue;
+
+    if(cache->next != cache->end) {
+      setBlocksUsed(cache->next, cache->end - cache->next, false);
+      drained = true;
+    }
+
+    for(int k = 0; k < cache->freedCount; k++) {
+      releaseBlocks(cache->freedStart[k], cache->freedBlocks[k]);
+      drained = drained || fd == -1;
+    }
+
+    cache->next = 0;
+    cache->end = 0;
+    cache->freedCount = 0;
+    __atomic_store_n(&cache->held, 0, __ATOMIC_RELAXED);
+
+    unlockAllocationCache(cache);
+
+  }
+
+  return drained;
+
+}
+
+void FileSystem::resetAllocationCaches() {
+
+  for(int c = 0; c < allocationCacheCount; c++) {
+    AllocationCache* cache = &allocationCaches[c];
+    cache->busy = false;
+    cache->next = 0;
+    cache->end = 0;
+    cache->held = 0;
+    cache->freedCount = 0;
+  }
+
+  freedRuns.clear();
+  releasingRuns.clear();
+  deferredBlocks = 0;
+
+}
+
+int FileSystem::cachedBlocks() {
+
+  int blocks = 0;
+  for(int c = 0; c < allocationCacheCount; c++) blocks += __atomic_load_n(&allocationCaches[c].held, __ATOMIC_RELAXED);
+
+  return blocks;
+
+}
+
+int FileSystem::findFreeBlock(int from) {
+
+  int words = (getHeaderBlock()->totalBlocks + 63) / 64;
+  int summaryWords = (words + 63) / 64;
+
+  int w = from / 64;
+  uint64 free = ~bitmapBits(w) & (~0ULL << (from % 64));
+  if(free != 0) return w * 64 + __builtin_ctzll(free);
+
+  w++;
+
+  while(w < words) {
+
+    int s = w / 64;
+    uint64 summary = freeSummary[s] & (~0ULL << (w % 64));
+
+    while(summary == 0) {
+      s++;
+      if(s >= summaryWords) return -1;
+      summary = freeSummary[s];
+    }
+
+    w = s * 64 + __builtin_ctzll(summary);
+    if(w >= words) return -1;
+
+    free = ~bitmapBits(w);
+    if(free != 0) return w * 64 + __builtin_ctzll(free);
+
+    w++;
+
+  }
+
+  return -1;
+
+}
+
+int FileSystem::freeRunLength(int start, int limit) {
+
+  int blocks = getHeaderBlock()->totalBlocks;
+  int run = 0;
+  int i = start;
+
+  while(run < limit && i < blocks) {
+
+    int offset = i % 64;
+    uint64 used = bitmapBits(i / 64) >> offset;
+
+    if(used != 0) {
+      run += __builtin_ctzll(used);
+      break;
+    }
+
+    run += 64 - offset;
+    i += 64 - offset;
+
+  }
+
+  run = min(run, limit);
+  return min(run, blocks - start);
+
+}
+
+void FileSystem::setBlocksUsed(int i, int count, bool used) {
+
+  HeaderBlock* header = getHeaderBlock();
+
+  int end = i + count;
+
+  if(used) raiseHighWaterMark(end);
+
+  while(i < end) {
+
+    int w = i / 64;
+    int offset = i % 64;
+    int n = min(64 - offset, end - i);
+
+    uint64 mask = n == 64 ? ~0ULL : ((1ULL << n) - 1) << offset;
+    uint64* word = bitmapWord(w);
+
+    if(used) *word |= mask;
+    else *word &= ~mask;
+
+    if(*word == ~0ULL) freeSummary[w / 64] &= ~(1ULL << (w % 64));
+    else freeSummary[w / 64] |= 1ULL << (w % 64);
+
+    markDirty(word, sizeof(uint64));
+    i += n;
+
+  }
+
+  // read without the allocator lock by limitTransaction
+  __atomic_add_fetch(&header->usedBlocks, used ? count : -count, __ATOMIC_RELAXED);
+
+  markDirty(header, headerSize);
+
+}
+
+void FileSystem::raiseHighWaterMark(int end) {
+
+  static const int blocksPerBitmapBlock = BLOCK_SIZE * 8;
+
+  HeaderBlock* header = getHeaderBlock();
+  if(end <= (int)header->highWaterMark) return;
+
+  int first = (header->highWaterMark + blocksPerBitmapBlock - 1) / blocksPerBitmapBlock;
+  int last = (end + blocksPerBitmapBlock - 1) / blocksPerBitmapBlock;
+
+  for(int b = first; b < last; b++) {
+
+    char* block = blockAt(header->bitmapBlock + b);
+    memset(block, 0, BLOCK_SIZE);
+
+    // blocks past the end of the volume in the last bitmap word are never free
+    int tail = header->totalBlocks % 64;
+    int lastWord = header->totalBlocks / 64;
+    if(tail != 0 && lastWord / (BLOCK_SIZE / 8) == b) *bitmapWord(lastWord) = ~0ULL << tail;
+
+    markDirty(block);
+
+  }
+
+  header->highWaterMark = end;
+  markDirty(header, headerSize);
+
+}
+
+uint64 FileSystem::bitmapBits(int w) {
+
+  static const int blocksPerBitmapBlock = BLOCK_SIZE * 8;
+
+  HeaderBlock* header = getHeaderBlock();
+  int initialized = (header->highWaterMark + blocksPerBitmapBlock - 1) / blocksPerBitmapBlock;
+
+  if(w / (BLOCK_SIZE / 8) < initialized) return *bitmapWord(w);
+
+  int tail = header->totalBlocks % 64;
+  if(tail != 0 && w == (int)header->totalBlocks / 64) return ~0ULL << tail;
+
+  return 0;
+
+}
+
+uint64* FileSystem::bitmapWord(int w) {
+  static const int wordsPerBlock = BLOCK_SIZE / sizeof(uint64);
+  return (uint64*)blockAt(getHeaderBlock()->bitmapBlock + w / wordsPerBlock) + w % wordsPerBlock;
+}
+
+bool FileSystem::findExtent(FileInfo* info, int logicalBlock, Extent* out) {
+
+  ExtentBlock* node = getExtentBlock(info->firstBlock);
+
+  while(node != NULL) {
+
+    int left = 0;
+    int right = node->extentCount - 1;
+    int found = -1;
+
+    while(left <= right) {
+      int middle = (left + right) / 2;
+      if(node->extents[middle].logicalBlock <= logicalBlock) {
+        found = middle;
+        left = middle + 1;
+      }else{
+        right = middle - 1;
+      }
+    }
+
+    if(found == -1) return false;
+
+    Extent* extent = &node->extents[found];
+
+    if(node->depth == 0) {
+      if(logicalBlock >= extent->logicalBlock + extent->blockCount) return false;
+      *out = *extent;
+      return true;
+    }
+
+    node = getExtentBlock(extent->startBlock);
+
+  }
+
+  return false;
+
+}
+
+bool FileSystem::appendExtent(FileInfo* info, Extent extent) {
+
+  ExtentBlock* root = getExtentBlock(info->firstBlock);
+
+  if(root == NULL) {
+
+    int n = allocateBlock();
+    if(n == -1) return false;
+
+    root = getExtentBlock(n);
+
+    root->depth = 0;
+    root->extentCount = 1;
+    root->extents[0] = extent;
+
+    info->firstBlock = n;
+    info->lastBlock = n;
+
+    markDirty(root);
+    return true;
+
+  }
+
+  ExtentBlock* leaf = getExtentBlock(info->lastBlock);
+
+  if(leaf->extentCount < ExtentBlock::capacity) {
+    leaf->extents[leaf->extentCount++] = extent;
+    markDirty(leaf);
+    return true;
+  }
+
+  // the right edge is full up to some level, find the lowest node that can
+  // take one more child and hang a new chain of nodes below it
+
+  ExtentBlock* node = root;
+  ExtentBlock* parent = NULL;
+
+  while(node->depth > 0) {
+    if(node->extentCount < ExtentBlock::capacity) parent = node;
+    node = getExtentBlock(node->extents[node->extentCount - 1].startBlock);
+  }
+
+  // allocate every node up front so a full volume leaves the tree untouched
+
+  int needed = parent == NULL ? root->depth + 2 : parent->depth;
+  int nodes[16];
+
+  for(int i = 0; i < needed; i++) {
+    nodes[i] = allocateBlock();
+    if(nodes[i] != -1) continue;
+    for(int k = 0; k < i; k++) deallocateBlock(nodes[k]);
+    return false;
+  }
+
+  int next = 0;
+
+  if(parent == NULL) {
+
+    int n = nodes[next++];
+    ExtentBlock* child = getExtentBlock(n);
+    memcpy(child, root, BLOCK_SIZE);
+
+    root->depth++;
+    root->extentCount = 1;
+    root->extents[0].logicalBlock = child->extents[0].logicalBlock;
+    root->extents[0].startBlock = n;
+    root->extents[0].blockCount = 0;
+
+    if(child->depth == 0) info->lastBlock = n;
+
+    markDirty(child);
+    markDirty(root);
+
+    parent = root;
+
+  }
+
+  while(parent->depth > 0) {
+
+    int n = nodes[next++];
+    ExtentBlock* child = getExtentBlock(n);
+
+    child->depth = parent->depth - 1;
+    child->extentCount = 0;
+
+    Extent* entry = &parent->extents[parent->extentCount++];
+    entry->logicalBlock = extent.logicalBlock;
+    entry->startBlock = n;
+    entry->blockCount = 0;
+
+    markDirty(parent);
+    parent = child;
+
+  }
+
+  parent->extents[parent->extentCount++] = extent;
+  markDirty(parent);
+
+  info->lastBlock = blockIndex(parent);
+
+  return true;
+
+}
+
+void FileSystem::truncateExtents(ExtentBlock* node, int keep) {
+
+  int kept = node->extentCount;
+
+  while(kept > 0 && node->extents[kept - 1].logicalBlock >= keep) {
+
+    kept--;
+    Extent* extent = &node->extents[kept];
+
+    if(node->depth == 0) deallocateBlocks(extent->startBlock, extent->blockCount);
+    else releaseExtents(getExtentBlock(extent->startBlock));
+
+  }
+
+  if(kept != node->extentCount) {
+    node->extentCount = kept;
+    markDirty(node);
+  }
+
+  if(kept == 0) return;
+
+  // only the last remaining extent can reach past the new end
+  Extent* extent = &node->extents[kept - 1];
+
+  if(node->depth > 0) {
+    truncateExtents(getExtentBlock(extent->startBlock), keep);
+    return;
+  }
+
+  int blocks = keep - extent->logicalBlock;
+
+  if(blocks < extent->blockCount) {
+    deallocateBlocks(extent->startBlock + blocks, extent->blockCount - blocks);
+    extent->blockCount = blocks;
+    markDirty(node);
+  }
+
+}
+
+void FileSystem::releaseExtents(ExtentBlock* node) {
+
+  for(int i = 0; i < node->extentCount; i++) {
+    Extent* extent = &node->extents[i];
+    if(node->depth == 0) deallocateBlocks(extent->startBlock, extent->blockCount);
+    else releaseExtents(getExtentBlock(extent->startBlock));
+  }
+
+  deallocateBlock(blockIndex(node));
+
+}
+
+void FileSystem::truncateFile(FileInfo* info, uint64 size) {
+
+  // an inline file keeps its slot until it is emptied
+  if(info->flags & FILE_INLINE) {
+    if(size > 0) return;
+    releaseSlot(info->firstBlock, info->lastBlock);
+    info->flags &= ~FILE_INLINE;
+    info->firstBlock = -1;
+    info->lastBlock = -1;
+    return;
+  }
+
+  int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if(info->flags & FILE_COMPRESSED) keep = truncateChunks(info, size);
+
+  ExtentBlock* node = getExtentBlock(info->firstBlock);
+  if(node == NULL) return;
+
+  if(keep == 0) {
+    releaseExtents(node);
+    info->firstBlock = -1;
+    info->lastBlock = -1;
+    return;
+  }
+
+  truncateExtents(node, keep);
+
+  while(node->depth > 0) {
+    node = getExtentBlock(node->extents[node->extentCount - 1].startBlock);
+  }
+
+  info->lastBlock = blockIndex(node);
+
+}
+
+ChunkEntry* FileSystem::chunkEntry(FileInfo* info, int chunk) {
+
+  int mapBlock = chunk / ChunkMapBlock::capacity;
+
+  Extent extent;
+  if(!findExtent(info, mapBlock, &extent)) return NULL;
+
+  ChunkMapBlock* map = (ChunkMapBlock*)blockAt(extent.startBlock + (mapBlock - extent.logicalBlock));
+  return &map->chunks[chunk % ChunkMapBlock::capacity];
+
+}
+
+int FileSystem::chunkBlocks(ChunkEntry* entry) {
+  uint stored = entry->compressedSize != 0 ? entry->compressedSize : entry->size;
+  return (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+int FileSystem::loadChunk(ChunkEntry* entry, char* data, char* packed) {
+
+  // returns the size of the chunk, or -1 when it is damaged
+
+  int stored = entry->compressedSize != 0 ? entry->compressedSize : entry->size;
+  char* image = entry->compressedSize != 0 ? packed : data;
+  int blocks = chunkBlocks(entry);
+
+  // blocks of a disk-backed volume are fetched a contiguous run at a time
+  for(int i = 0; pool != NULL && i < blocks;) {
+    int run = 1;
+    while(i + run < blocks && entry->blocks[i + run] == entry->blocks[i] + run) run++;
+    pool->fetch(entry->blocks[i], run);
+    i += run;
+  }
+
+  for(int i = 0; i < blocks; i++) {
+    char* p = blockAt(entry->blocks[i]);
+    if(verifyBlocks(p, BLOCK_SIZE) < BLOCK_SIZE) return -1;
+    memcpy(image + i * BLOCK_SIZE, p, min(BLOCK_SIZE, stored - i * BLOCK_SIZE));
+  }
+
+  if(entry->compressedSize == 0) return entry->size;
+
+  int size = decompressChunk(packed, stored, data, CHUNK_SIZE);
+  return size == (int)entry->size ? size : -1;
+
+}
+
+bool FileSystem::storeChunk(ChunkEntry* entry, char* data, int size, char* packed) {
+
+  // a chunk is only kept compressed when that saves at least one block
+
+  int rawBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int compressedSize = compressChunk(data, size, packed, (rawBlocks - 1) * BLOCK_SIZE);
+
+  char* image = compressedSize != 0 ? packed : data;
+  int stored = compressedSize != 0 ? compressedSize : size;
+
+  int needed = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int have = chunkBlocks(entry);
+
+  // the image always goes to new blocks and the entry is switched over to them,
+  // so the committed image keeps the old blocks and the size that goes with them,
+  // and a full volume leaves the chunk as it was
+
+  int blocks[ChunkEntry::capacity];
+  memset(blocks, 0, sizeof(blocks));
+
+  for(int taken = 0; taken < needed;) {
+
+    int goal = taken > 0 ? blocks[taken - 1] + 1 : have > 0 ? entry->blocks[have - 1] + 1 : -1;
+
+    int count;
+    int n = allocateBlocks(needed - taken, &count, goal);
+
+    if(n == -1) {
+      for(int i = 0; i < taken; i++) deallocateBlock(blocks[i]);
+      return false;
+    }
+
+    for(int i = 0; i < count; i++) blocks[taken++] = n + i;
+
+  }
+
+  // the old blocks are freed a contiguous run at a time
+  for(int i = 0; i < have;) {
+    int run = 1;
+    while(i + run < have && entry->blocks[i + run] == entry->blocks[i] + run) run++;
+    deallocateBlocks(entry->blocks[i], run);
+    i += run;
+  }
+
+  for(int i = 0; i < needed; i++) {
+
+    char* p = blockAt(blocks[i]);
+    int n = min(BLOCK_SIZE, stored - i * BLOCK_SIZE);
+
+    memcpy(p, image + i * BLOCK_SIZE, n);
+    memset(p + n, 0, BLOCK_SIZE - n);
+
+    markDataDirty(p, BLOCK_SIZE);
+    updateChecksums(p, BLOCK_SIZE);
+
+  }
+
+  memcpy(entry->blocks, blocks, sizeof(blocks));
+  entry->size = size;
+  entry->compressedSize = compressedSize;
+  markDirty(entry, sizeof(ChunkEntry));
+
+  return true;
+
+}
+
+int64 FileSystem::chunkKey(ChunkEntry* entry) {
+  int block = blockIndex(entry);
+  if(block == -1) return -1;
+
+  int slot = ((char*)entry - blockAt(block)) / sizeof(ChunkEntry);
+  return (int64)block * ChunkMapBlock::capacity + slot;
+}
+
+CachedChunk* FileSystem::cacheChunk(ChunkEntry* entry, bool read) {
+
+  // called with the chunk cache locked, every chunk entry is only read or changed
+  // under that lock, returns NULL when the chunk is damaged or the chunk leaving
+  // the cache cannot be stored, a chunk that is not read starts out empty
+
+  int64 key = chunkKey(entry);
+  if(key == -1) return NULL;
+
+  CachedChunk* victim = &chunkCache[0];
+
+  for(int c = 0; c < chunkCacheSize; c++) {
+    if(chunkCache[c].key == key) {
+      chunkCache[c].used = ++chunkCacheTick;
+      return &chunkCache[c];
+    }
+    if(chunkCache[c].used < victim->used) victim = &chunkCache[c];
+  }
+
+  if(victim->dirty && !writeChunk(victim)) return NULL;
+
+  if(victim->data == NULL) victim->data = new char[CHUNK_SIZE];
+  if(chunkPacked == NULL) chunkPacked = new char[CHUNK_SIZE];
+
+  victim->key = -1;
+  victim->used = 0;
+
+  int size = read ? loadChunk(entry, victim->data, chunkPacked) : 0;
+  if(size == -1) return NULL;
+
+  victim->key = key;
+  victim->size = size;
+  victim->used = ++chunkCacheTick;
+
+  return victim;
+
+}
+
+bool FileSystem::writeChunk(CachedChunk* chunk) {
+
+  ChunkMapBlock* map = (ChunkMapBlock*)blockAt(chunk->key / ChunkMapBlock::capacity);
+  ChunkEntry* entry = &map->chunks[chunk->key % ChunkMapBlock::capacity];
+
+  if(!storeChunk(entry, chunk->data, chunk->size, chunkPacked)) {
+    printc("ERROR: Cannot store a compressed chunk, volume is full\n", COLOR_RED);
+    return false;
+  }
+
+  chunk->dirty = false;
+  return true;
+
+}
+
+bool FileSystem::flushChunks() {
+
+  std::lock_guard<std::mutex> lock(chunkCacheMutex);
+  PinScope pins;
+
+  bool ok = true;
+  for(int c = 0; c < chunkCacheSize; c++) {
+    if(chunkCache[c].dirty) ok = writeChunk(&chunkCache[c]) && ok;
+  }
+
+  return ok;
+
+}
+
+void FileSystem::dropChunk(ChunkEntry* entry) {
+
+  // called with the chunk cache locked when the chunk goes away
+
+  int64 key = chunkKey(entry);
+
+  for(int c = 0; c < chunkCacheSize; c++) {
+    if(chunkCache[c].key != key) continue;
+    chunkCache[c].key = -1;
+    chunkCache[c].dirty = false;
+    chunkCache[c].used = 0;
+  }
+
+}
+
+void FileSystem::resetChunkCache() {
+
+  for(int c = 0; c < chunkCacheSize; c++) {
+    delete[] chunkCache[c].data;
+    chunkCache[c].data = NULL;
+    chunkCache[c].key = -1;
+    chunkCache[c].dirty = false;
+    chunkCache[c].used = 0;
+  }
+
+  delete[] chunkPacked;
+  chunkPacked = NULL;
+
+}
+
+int FileSystem::truncateChunks(FileInfo* info, uint64 size) {
+
+  // chunks past the end give their blocks back and a chunk cut in the middle
+  // is cut in the cache, returns how many blocks of the chunk map are kept
+
+  int chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  int used = (info->fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  std::lock_guard<std::mutex> lock(chunkCacheMutex);
+
+  int keep = (chunks + ChunkMapBlock::capacity - 1) / ChunkMapBlock::capacity;
+
+  for(int k = chunks; k < used; k++) {
+
+    PinScope pins;
+
+    ChunkEntry* entry = chunkEntry(info, k);
+    if(entry == NULL) continue;
+
+    dropChunk(entry);
+
+    int blocks = chunkBlocks(entry);
+    for(int i = 0; i < blocks; i++) deallocateBlock(entry->blocks[i]);
+
+    // entries of map blocks that go away are not worth logging
+    if(k / ChunkMapBlock::capacity < keep) {
+      memset(entry, 0, sizeof(ChunkEntry));
+      markDirty(entry, sizeof(ChunkEntry));
+    }
+
+  }
+
+  int tail = size % CHUNK_SIZE;
+
+  if(tail != 0 && size < info->fileSize) {
+
+    PinScope pins;
+    ChunkEntry* entry = chunkEntry(info, chunks - 1);
+
+    CachedChunk* cached = entry != NULL ? cacheChunk(entry, true) : NULL;
+
+    if(cached == NULL) printfc("ERROR: Cannot shorten the last chunk of file %s\n", COLOR_RED, info->fileName);
+    else if(cached->size > tail) {
+      cached->size = tail;
+      cached->dirty = true;
+    }
+
+  }
+
+  return keep;
+
+}
+
+char* FileSystem::inlineData(FileInfo* info) {
+  return ((InlineBlock*)blockAt(info->firstBlock))->slots[info->lastBlock];
+}
+
+bool FileSystem::allocateSlot(FileInfo* info) {
+
+  // slots are handed out from the lowest block known to have one free, slot
+  // blocks are metadata and go through the journal like directories
+
+  std::lock_guard<std::mutex> lock(inlineMutex);
+
+  const uint full = (1u << InlineBlock::slotCount) - 1;
+
+  int n;
+
+  if(!inlineBlocks.empty()) n = *inlineBlocks.begin();
+  else {
+    n = allocateBlock();
+    if(n == -1) return false;
+    ((InlineBlock*)blockAt(n))->usedSlots = 0;
+    inlineBlocks.insert(n);
+  }
+
+  InlineBlock* block = (InlineBlock*)blockAt(n);
+
+  int slot = __builtin_ctz(~block->usedSlots);
+  block->usedSlots |= 1u << slot;
+  markDirty(block, sizeof(uint));
+
+  if(block->usedSlots == full) inlineBlocks.erase(n);
+
+  info->flags |= FILE_INLINE;
+  info->firstBlock = n;
+  info->lastBlock = slot;
+
+  return true;
+
+}
+
+void FileSystem::releaseSlot(int block, int slot) {
+
+  std::lock_guard<std::mutex> lock(inlineMutex);
+
+  InlineBlock* p = (InlineBlock*)blockAt(block);
+  p->usedSlots &= ~(1u << slot);
+  markDirty(p, sizeof(uint));
+
+  if(p->usedSlots != 0) {
+    inlineBlocks.insert(block);
+    return;
+  }
+
+  inlineBlocks.erase(block);
+  deallocateBlock(block);
+
+}
+
+void FileSystem::findSlotBlocks() {
+
+  // the free slots are not kept on disk, every slot block is reached through
+  // the inline files in it and kept when it still has room, once after mounting
+  // and with the volume locked so no directory changes on the way
+
+  if(__atomic_load_n(&slotBlocksFound, __ATOMIC_ACQUIRE)) return;
+
+  std::unique_lock<std::shared_mutex> volume(volumeMutex);
+  if(slotBlocksFound) return;
+
+  const uint full = (1u << InlineBlock::slotCount) - 1;
+
+  std::set<int> blocks;
+  std::vector<int> nodes;
+  nodes.push_back(0);
+
+  while(!nodes.empty()) {
+
+    PinScope pins;
+
+    int n = nodes.back();
+    nodes.pop_back();
+
+    DirectoryIndexBlock* node = getDirectoryIndexBlock(n);
+
+    if(node->depth > 0) {
+      for(uint i = 0; i < node->keyCount; i++) nodes.push_back(node->keys[i].childBlock);
+      continue;
+    }
+
+    DirectoryBlock* leaf = (DirectoryBlock*)node;
+
+    for(uint i = 0; i < leaf->fileCount; i++) {
+      FileInfo* entry = &leaf->files[i];
+      if(entry->fileType == 'D') nodes.push_back(entry->firstBlock);
+      else if(entry->flags & FILE_INLINE) blocks.insert(entry->firstBlock);
+    }
+
+  }
+
+  std::lock_guard<std::mutex> lock(inlineMutex);
+
+  for(int n : blocks) {
+    PinScope pins;
+    if(((InlineBlock*)blockAt(n))->usedSlots != full) inlineBlocks.insert(n);
+  }
+
+  __atomic_store_n(&slotBlocksFound, true, __ATOMIC_RELEASE);
+
+}
+
+uint* FileSystem::checksumAt(int i) {
+
+  HeaderBlock* header = getHeaderBlock();
+  if(header->checksumBlock == 0 || (uint64)i >= (uint64)header->bitmapBlocks * BLOCK_SIZE * 8) return NULL;
+
+  const int perBlock = BLOCK_SIZE / sizeof(uint);
+  return (uint*)blockAt(header->checksumBlock + i / perBlock) + i % perBlock;
+
+}
+
+int64 FileSystem::verifyBlocks(char* p, int64 len) {
+
+  // every block touched by the range is checked as a whole, the length
+  // up to the first damaged block is returned
+
+  int first = blockIndex(p);
+  if(first == -1) return 0;
+
+  char* start = blockAt(first);
+  int count = (p - start + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  for(int i = 0; i < count; i++) {
+    uint* sum = checksumAt(first + i);
+    if(sum != NULL && *sum != crc32c(start + (uint64)i * BLOCK_SIZE, BLOCK_SIZE)) return max(start + (int64)i * BLOCK_SIZE - p, (int64)0);
+  }
+
+  return len;
+
+}
+
+void FileSystem::updateChecksums(char* p, int64 len) {
+
+  int first = blockIndex(p);
+  if(first == -1) return;
+
+  char* start = blockAt(first);
+  int count = (p - start + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  for(int i = 0; i < count; i++) {
+    uint* sum = checksumAt(first + i);
+    if(sum == NULL) continue;
+    *sum = crc32c(start + (uint64)i * BLOCK_SIZE, BLOCK_SIZE);
+    markDataDirty(sum, sizeof(uint));
+  }
+
+}
+
+HeaderBlock* FileSystem::getHeaderBlock() {
+  return (HeaderBlock*)memory;
+}
+
+DirectoryIndexBlock* FileSystem::getDirectoryIndexBlock(int i) {
+  return (DirectoryIndexBlock*)blockAt(i);
+}
+
+DirectoryBlock* FileSystem::getDirectoryBlock(int i) {
+  return (DirectoryBlock*)blockAt(i);
+}
+
+FileBlock* FileSystem::getFileBlock(int i) {
+  return (FileBlock*)blockAt(i);
+}
+
+JournalBlock* FileSystem::getJournalBlock(int i) {
+  return (JournalBlock*)blockAt(i);
+}
+
+ExtentBlock* FileSystem::getExtentBlock(int i) {
+  return (ExtentBlock*)blockAt(i);
+}
+
+char* FileSystem::blockAt(int i) {
+  if(i == -1) return NULL;
+  if(pool != NULL && i >= residentBlocks) return pool->pin(i);
+  return memory + headerSize + (uint64)i * BLOCK_SIZE;
+}
+
+int FileSystem::blockIndex(void* p) {
+  if(p == NULL) return -1;
+  if(!isResident(p)) return pool->blockOf(p);
+  return ((char*)p - memory - headerSize) / BLOCK_SIZE;
+}
+
+// #endregion
+
+// #region BufferPool
+
+// frames pinned by this thread, released in reverse order as pin scopes end,
+// a block handed out by a failed pool has no frame and is freed instead
+struct PinnedFrame {
+  BufferPool* pool;
+  int frame;
+  char* scratch;
+};
+
+static thread_local std::vector<PinnedFrame> pinnedFrames;
+
+BufferPool::BufferPool(FileSystem* fs, int frames) {
+
+  this->fs = fs;
+
+  chunkFrames = frames;
+  chunkCount = 0;
+  baseChunks = 1;
+  hand = 0;
+  window = min(256, max(frames / 4, 1));
+
+  // the owner checks frameCount, a pool without a chunk cannot be used
+  addChunk();
+
+}
+
+char* BufferPool::pin(int block) {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while(true) {
+
+    auto it = table.find(block);
+
+    if(it != table.end()) {
+
+      BufferFrame* frame = frameAt(it->second);
+
+      // another thread is reading the block in
+      if(frame->loading) {
+        loaded.wait(lock);
+        continue;
+      }
+
+      frame->pins++;
+      frame->referenced = true;
+      pinnedFrames.push_back({ this, it->second, NULL });
+
+      return dataAt(it->second);
+
+    }
+
+    // only frames that are all loading leave nothing to evict
+    int f = evict();
+    if(f == -1) {
+      loaded.wait(lock);
+      continue;
+    }
+
+    // every frame is pinned and the volume has failed, the caller gets zeros
+    // of its own and its operation is refused when it ends
+    if(f == -2) {
+      char* scratch = new char[BLOCK_SIZE]();
+      pinnedFrames.push_back({ this, -1, scratch });
+      return scratch;
+    }
+
+    BufferFrame* frame = frameAt(f);
+
+    frame->block = block;
+    frame->pins++;
+    frame->referenced = true;
+    frame->loading = true;
+    table[block] = f;
+
+    // the read happens outside the lock, threads wanting the same block wait for it
+    lock.unlock();
+
+    char* data = dataAt(f);
+    uint64 offset = FileSystem::headerSize + (uint64)block * BLOCK_SIZE;
+
+    for(int done = 0; done < BLOCK_SIZE;) {
+      ssize_t n = pread(fs->fd, data + done, BLOCK_SIZE - done, offset + done);
+      if(n <= 0) {
+        printfc("ERROR: Cannot read block %d\n", COLOR_RED, block);
+        memset(data, 0, BLOCK_SIZE);
+        fs->fail();
+        break;
+      }
+      done += n;
+    }
+
+    lock.lock();
+
+    frame->loading = false;
+    loaded.notify_all();
+    pinnedFrames.push_back({ this, f, NULL });
+
+    return data;
+
+  }
+
+}
+
+int BufferPool::blockOf(void* p) {
+
+  // the frame is pinned by the caller, so its block cannot change
+  int f = frameOf(p);
+  if(f == -1) return -1;
+
+  return frameAt(f)->block;
+
+}
+
+void BufferPool::fetch(int block, int count) {
+
+  // reads every missing block of the range in one batch, the frames are left
+  // unpinned for the caller to pin one at a time
+
+  std::vector<IoRequest> requests;
+  std::vector<int> fetched;
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for(int i = block; i < block + count; i++) {
+
+    if(table.find(i) != table.end()) continue;
+
+    int f = evict();
+    if(f < 0) break;
+
+    BufferFrame* frame = frameAt(f);
+
+    frame->block = i;
+    frame->referenced = true;
+    frame->loading = true;
+    table[i] = f;
+
+    requests.push_back({ dataAt(f), FileSystem::headerSize + (uint64)i * BLOCK_SIZE, BLOCK_SIZE, false });
+    fetched.push_back(f);
+
+  }
+
+  if(requests.empty()) return;
+
+  lock.unlock();
+
+  if(!fs->io->submit(requests.data(), requests.size())) {
+    printfc("ERROR: Cannot read blocks %d to %d\n", COLOR_RED, block, block + count - 1);
+    for(IoRequest& request : requests) memset(request.buffer, 0, BLOCK_SIZE);
+    fs->fail();
+  }
+
+  lock.lock();
+
+  for(int f : fetched) frameAt(f)->loading = false;
+  loaded.notify_all();
+
+}
+
+char* BufferPool::hold(int block) {
+
+  // pins a resident block outside of any scope, blocks not in the pool are not read
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = table.find(block);
+  if(it == table.end() || frameAt(it->second)->loading) return NULL;
+
+  frameAt(it->second)->pins++;
+  return dataAt(it->second);
+
+}
+
+void BufferPool::release(char* data) {
+
+  int f = frameOf(data);
+  if(f == -1) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  frameAt(f)->pins--;
+
+}
+
+void BufferPool::clear() {
+
+  // only called while no other operation runs, the blocks are no longer needed
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for(int f = 0; f < chunkCount * chunkFrames; f++) {
+    BufferFrame* frame = frameAt(f);
+    if(frame->pins > 0) continue;
+    if(frame->block != -1) table.erase(frame->block);
+    frame->block = -1;
+  }
+
+}
+
+void BufferPool::unpinTo(size_t mark) {
+
+  while(pinnedFrames.size() > mark) {
+
+    BufferPool* pool = pinnedFrames.back().pool;
+    std::lock_guard<std::mutex> lock(pool->mutex);
+
+    while(pinnedFrames.size() > mark && pinnedFrames.back().pool == pool) {
+      PinnedFrame& pinned = pinnedFrames.back();
+      if(pinned.frame == -1) delete[] pinned.scratch;
+      else pool->frameAt(pinned.frame)->pins--;
+      pinnedFrames.pop_back();
+    }
+
+  }
+
+}
+
+int BufferPool::readAhead() {
+  return window;
+}
+
+BufferPool::~BufferPool() {
+  for(int c = 0; c < chunkCount; c++) {
+    munmap(chunks[c], (uint64)chunkFrames * BLOCK_SIZE);
+    delete[] frames[c];
+  }
+}
+
+int BufferPool::frameOf(void* p) {
+
+  // chunks are only ever added, the count is published after the chunk is ready
+  int count = __atomic_load_n(&chunkCount, __ATOMIC_ACQUIRE);
+  uint64 size = (uint64)chunkFrames * BLOCK_SIZE;
+
+  for(int c = 0; c < count; c++) {
+    if((char*)p >= chunks[c] && (char*)p < chunks[c] + size) {
+      return c * chunkFrames + ((char*)p - chunks[c]) / BLOCK_SIZE;
+    }
+  }
+
+  return -1;
+
+}
+
+BufferFrame* BufferPool::frameAt(int f) {
+  return &frames[f / chunkFrames][f % chunkFrames];
+}
+
+char* BufferPool::dataAt(int f) {
+  return chunks[f / chunkFrames] + (uint64)(f % chunkFrames) * BLOCK_SIZE;
+}
+
+int BufferPool::evict() {
+
+  // CLOCK: a referenced frame gets one more round, the first unpinned frame
+  // found unreferenced is reused once its block can leave memory
+
+  int total = chunkCount * chunkFrames;
+
+  for(int n = 0; n < 2 * total; n++) {
+
+    int f = hand;
+    hand = (hand + 1) % total;
+
+    BufferFrame* frame = frameAt(f);
+
+    if(frame->block == -1) return f;
+    if(frame->pins > 0 || frame->loading) continue;
+
+    if(frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+
+    if(!fs->evictBlock(frame->block, dataAt(f))) continue;
+
+    table.erase(frame->block);
+    frame->block = -1;
+
+    return f;
+
+  }
+
+  // everything is pinned or has to stay until the next checkpoint, the next
+  // operation checkpoints once it sees the pool has grown
+  if(addChunk()) {
+    hand = (chunkCount - 1) * chunkFrames;
+    return hand;
+  }
+
+  // a frame being read in is pinned once it is there, or becomes free again
+  bool loading = false;
+  for(int f = 0; f < total && !loading; f++) loading = frameAt(f)->loading;
+  if(loading) return -1;
+
+  // the volume fails rather than break the journal order, after that nothing is
+  // written anymore and every unpinned frame can be reused as it is
+  if(!fs->failed) {
+    printc("ERROR: Buffer pool exhausted\n", COLOR_RED);
+    fs->fail();
+  }
+
+  for(int n = 0; n < total; n++) {
+
+    int f = hand;
+    hand = (hand + 1) % total;
+
+    BufferFrame* frame = frameAt(f);
+    if(frame->pins > 0) continue;
+
+    if(frame->block != -1) table.erase(frame->block);
+    frame->block = -1;
+
+    return f;
+
+  }
+
+  // pinned frames are never taken from their owners, waiting for an unpin
+  // could deadlock on the thread itself
+  return -2;
+
+}
+
+bool BufferPool::overgrown() {
+  return __atomic_load_n(&chunkCount, __ATOMIC_ACQUIRE) > __atomic_load_n(&baseChunks, __ATOMIC_RELAXED);
+}
+
+int BufferPool::frameCount() {
+  return __atomic_load_n(&chunkCount, __ATOMIC_ACQUIRE) * chunkFrames;
+}
+
+void BufferPool::trim() {
+
+  // called after a checkpoint while no operation runs, chunks added under
+  // pressure are given back unless a view still holds one of their frames
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  while(chunkCount > 1) {
+
+    int c = chunkCount - 1;
+    bool busy = false;
+
+    for(int k = 0; k < chunkFrames && !busy; k++) busy = frames[c][k].pins > 0 || frames[c][k].loading;
+    if(busy) break;
+
+    for(int k = 0; k < chunkFrames; k++) {
+      if(frames[c][k].block != -1) table.erase(frames[c][k].block);
+    }
+
+    __atomic_store_n(&chunkCount, c, __ATOMIC_RELEASE);
+    munmap(chunks[c], (uint64)chunkFrames * BLOCK_SIZE);
+    delete[] frames[c];
+
+  }
+
+  hand = 0;
+  __atomic_store_n(&baseChunks, chunkCount, __ATOMIC_RELAXED);
+
+}
+
+bool BufferPool::addChunk() {
+
+  if(chunkCount == maxChunks) return false;
+
+  // frames kept past a checkpoint hold blocks of the journal or of the
+  // transaction being built, which has to fit in the journal as well, more
+  // frames than twice the journal could never be committed
+  if(chunkCount > 0) {
+    int journal = fs->getHeaderBlock()->journalBlocks;
+    if(chunkCount >= baseChunks + (2 * journal + chunkFrames - 1) / chunkFrames + 1) return false;
+  }
+
+  uint64 size = (uint64)chunkFrames * BLOCK_SIZE;
+
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED) return false;
+
+  chunks[chunkCount] = (char*)p;
+  frames[chunkCount] = new BufferFrame[chunkFrames];
+
+  for(int k = 0; k < chunkFrames; k++) {
+    frames[chunkCount][k].block = -1;
+    frames[chunkCount][k].pins = 0;
+    frames[chunkCount][k].referenced = false;
+    frames[chunkCount][k].loading = false;
+  }
+
+  __atomic_store_n(&chunkCount, chunkCount + 1, __ATOMIC_RELEASE);
+  return true;
+
+}
+
+PinScope::PinScope() {
+  mark = pinnedFrames.size();
+}
+
+PinScope::~PinScope() {
+  if(pinnedFrames.size() > mark) BufferPool::unpinTo(mark);
+}
+
+// #endregion
+
+// #region IoEngine
+
+bool transfer(int fd, IoRequest* request, int done) {
+
+  while(done < request->len) {
+
+    ssize_t n;
+    if(request->write) n = pwrite(fd, request->buffer + done, request->len - done, request->offset + done);
+    else n = pread(fd, request->buffer + done, request->len - done, request->offset + done);
+
+    if(n <= 0) return false;
+    done += n;
+
+  }
+
+  return true;
+
+}
+
+IoEngine::IoEngine(int fd, bool useRing) {
+
+  this->fd = fd;
+
+  ring = -1;
+  submissionRing = NULL;
+  completionRing = NULL;
+  entries = NULL;
+  stopping = false;
+
+  if(useRing && openRing()) return;
+
+  // without io_uring a few threads keep that many requests in flight
+  for(int i = 0; i < 8; i++) workers.emplace_back(&IoEngine::work, this);
+
+}
+
+bool IoEngine::submit(IoRequest* requests, int count) {
+  if(count == 0) return true;
+  if(__atomic_load_n(&ring, __ATOMIC_ACQUIRE) != -1) return submitRing(requests, count);
+  return submitTasks(requests, count);
+}
+
+bool IoEngine::usesRing() {
+  return __atomic_load_n(&ring, __ATOMIC_ACQUIRE) != -1;
+}
+
+void IoEngine::closeRing() {
+
+  if(ring == -1) return;
+
+#ifdef FS_IO_URING
+  munmap(entries, depth * sizeof(io_uring_sqe));
+#endif
+  if(completionRing != submissionRing) munmap(completionRing, completionRingSize);
+  munmap(submissionRing, submissionRingSize);
+  ::close(ring);
+
+  __atomic_store_n(&ring, -1, __ATOMIC_RELEASE);
+
+}
+
+IoEngine::~IoEngine() {
+
+  closeRing();
+
+  {
+    std::lock_guard<std::mutex> lock(taskMutex);
+    stopping = true;
+    taskQueued.notify_all();
+  }
+
+  for(std::thread& worker : workers) worker.join();
+
+}
+
+bool IoEngine::openRing() {
+
+#ifdef FS_IO_URING
+
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring = syscall(__NR_io_uring_setup, depth, &params);
+
+  if(ring < 0) {
+    ring = -1;
+    return false;
+  }
+
+  submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(uint);
+  completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  // newer kernels map both rings at once
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(single) submissionRingSize = completionRingSize = max(submissionRingSize, completionRingSize);
+
+  void* p = mmap(NULL, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  void* q = single ? p : mmap(NULL, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+  void* e = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+
+  if(p == MAP_FAILED || q == MAP_FAILED || e == MAP_FAILED) {
+    if(e != MAP_FAILED) munmap(e, params.sq_entries * sizeof(io_uring_sqe));
+    if(q != MAP_FAILED && q != p) munmap(q, completionRingSize);
+    if(p != MAP_FAILED) munmap(p, submissionRingSize);
+    ::close(ring);
+    ring = -1;
+    return false;
+  }
+
+  submissionRing = (char*)p;
+  completionRing = (char*)q;
+  entries = e;
+
+  submissionHead = (uint*)(submissionRing + params.sq_off.head);
+  submissionTail = (uint*)(submissionRing + params.sq_off.tail);
+  submissionMask = (uint*)(submissionRing + params.sq_off.ring_mask);
+  submissionArray = (uint*)(submissionRing + params.sq_off.array);
+
+  completionHead = (uint*)(completionRing + params.cq_off.head);
+  completionTail = (uint*)(completionRing + params.cq_off.tail);
+  completionMask = (uint*)(completionRing + params.cq_off.ring_mask);
+  completions = completionRing + params.cq_off.cqes;
+
+  return true;
+
+#else
+  return false;
+#endif
+
+}
+
+#ifdef FS_IO_URING
+
+bool IoEngine::enterRing(IoRequest* requests, int count, iovec* vectors, int* next, int* inflight) {
+
+  // queues requests until the ring is full and waits for at least one completion
+
+  io_uring_sqe* sqes = (io_uring_sqe*)entries;
+  uint tail = *submissionTail;
+
+  while(*next < count && *inflight < depth) {
+
+    int i = *next;
+    uint index = tail & *submissionMask;
+    io_uring_sqe* sqe = &sqes[index];
+
+    vectors[i].iov_base = requests[i].buffer;
+    vectors[i].iov_len = requests[i].len;
+
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = requests[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = requests[i].offset;
+    sqe->addr = (uint64)&vectors[i];
+    sqe->len = 1;
+    sqe->user_data = i;
+
+    submissionArray[index] = index;
+
+    tail++;
+    (*next)++;
+    (*inflight)++;
+
+  }
+
+  __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);
+
+  uint unsubmitted = tail - __atomic_load_n(submissionHead, __ATOMIC_ACQUIRE);
+  int n = syscall(__NR_io_uring_enter, ring, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+  if(n >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY) return true;
+
+  // entries the kernel has not taken are withdrawn, requests in flight still
+  // point into the caller's buffers and have to be waited for
+  uint taken = __atomic_load_n(submissionHead, __ATOMIC_ACQUIRE);
+  __atomic_store_n(submissionTail, taken, __ATOMIC_RELEASE);
+  *inflight -= tail - taken;
+
+  return false;
+
+}
+
+#endif
+
+bool IoEngine::submitRing(IoRequest* requests, int count) {
+
+#ifdef FS_IO_URING
+
+  // one batch goes through the ring at a time, keeping up to depth requests in flight
+
+  std::unique_lock<std::mutex> lock(ringMutex);
+
+  // the ring may have been given up while this batch waited for it
+  if(ring == -1) {
+    lock.unlock();
+    return submitTasks(requests, count);
+  }
+
+  io_uring_cqe* cqes = (io_uring_cqe*)completions;
+
+  std::vector<iovec> vectors(count);
+  std::vector<char> completed(count, false);
+
+  bool ok = true;
+  bool broken = false;
+  int next = 0;
+  int inflight = 0;
+  int done = 0;
+
+  while(done < count) {
+
+    if(broken) {
+      // without completions nothing is left to wait for
+      if(syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) break;
+    }else{
+      broken = !enterRing(requests, count, vectors.data(), &next, &inflight);
+    }
+
+    uint head = *completionHead;
+    uint end = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+
+    while(head != end) {
+
+      io_uring_cqe* cqe = &cqes[head & *completionMask];
+      IoRequest* request = &requests[cqe->user_data];
+
+      // short transfers are finished synchronously
+      if(cqe->res < 0) ok = false;
+      else if(cqe->res < request->len) ok = transfer(fd, request, cqe->res) && ok;
+
+      completed[cqe->user_data] = true;
+
+      head++;
+      inflight--;
+      done++;
+
+    }
+
+    __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+
+    if(broken && inflight == 0) break;
+
+  }
+
+  if(!broken) return ok;
+
+  // the ring is given up for good and the rest of the batch and every later one
+  // goes through worker threads
+
+  printc("io_uring failed, falling back to worker threads\n", COLOR_YELLOW);
+
+  closeRing();
+
+  {
+    std::lock_guard<std::mutex> tasksLock(taskMutex);
+    for(int i = 0; i < 8; i++) workers.emplace_back(&IoEngine::work, this);
+  }
+
+  lock.unlock();
+
+  std::vector<IoRequest> rest;
+  for(int i = 0; i < count; i++) {
+    if(!completed[i]) rest.push_back(requests[i]);
+  }
+
+  return submitTasks(rest.data(), rest.size()) && ok;
+
+#else
+  return submitTasks(requests, count);
+#endif
+
+}
+
+bool IoEngine::submitTasks(IoRequest* requests, int count) {
+
+  std::unique_lock<std::mutex> lock(taskMutex);
+
+  int remaining = count;
+  bool ok = true;
+
+  for(int i = 0; i < count; i++) tasks.push_back({ &requests[i], &remaining, &ok });
+  taskQueued.notify_all();
+
+  while(remaining > 0) taskDone.wait(lock);
+
+  return ok;
+
+}
+
+void IoEngine::work() {
+
+  std::unique_lock<std::mutex> lock(taskMutex);
+
+  while(true) {
+
+    while(tasks.empty() && !stopping) taskQueued.wait(lock);
+    if(tasks.empty()) return;
+
+    Task task = tasks.front();
+    tasks.pop_front();
+
+    lock.unlock();
+    bool ok = transfer(fd, task.request, 0);
+    lock.lock();
+
+    if(!ok) *task.ok = false;
+    if(--*task.remaining == 0) taskDone.notify_all();
+
+  }
+
+}
+
+// #endregion
+
+// #region Executor
+
+#ifdef FS_COROUTINES
+
+Executor::Executor(int threadCount) {
+
+  stopping = false;
+  inFlight = 0;
+
+  event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(event == -1) { printc("FATAL ERROR: Cannot create executor event\n", COLOR_RED); exit(1); }
+
+  for(int i = 0; i < threadCount; i++) threads.emplace_back(&Executor::work, this);
+
+}
+
+void Executor::submit(std::function<void()> work, std::coroutine_handle<> handle) {
+  std::lock_guard<std::mutex> lock(mutex);
+  jobs.push_back(Job { std::move(work), handle });
+  inFlight++;
+  jobQueued.notify_one();
+}
+
+int Executor::fd() {
+  return event;
+}
+
+int Executor::poll() {
+
+  uint64 count;
+  while(read(event, &count, sizeof(count)) > 0);
+
+  std::deque<std::coroutine_handle<>> ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.swap(finished);
+    inFlight -= ready.size();
+  }
+
+  // resumed coroutines may submit further operations
+  for(std::coroutine_handle<> handle : ready) handle.resume();
+
+  return ready.size();
+
+}
+
+void Executor::run() {
+
+  while(pending() > 0) {
+    if(poll() > 0) continue;
+    pollfd p = { event, POLLIN, 0 };
+    ::poll(&p, 1, -1);
+  }
+
+}
+
+int Executor::pending() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return inFlight;
+}
+
+Executor::~Executor() {
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    jobQueued.notify_all();
+  }
+
+  for(std::thread& thread : threads) thread.join();
+  ::close(event);
+
+}
+
+void Executor::work() {
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while(true) {
+
+    while(jobs.empty() && !stopping) jobQueued.wait(lock);
+    if(jobs.empty()) return;
+
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+
+    lock.unlock();
+    job.work();
+    lock.lock();
+
+    finished.push_back(job.handle);
+
+    uint64 one = 1;
+    if(write(event, &one, sizeof(one)) < 0) {}
+
+  }
+
+}
+
+#endif
+
+// #endregion
+
+// #region Journal
+
+uint64 checksum(const void* data, uint64 len, uint64 seed) {
+
+  const unsigned char* p = (const unsigned char*)data;
+  uint64 hash = seed ^ 0xCBF29CE484222325ULL;
+
+  for(uint64 i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
+
+}
+
+bool FileSystem::commit() {
+
+  if(fd == -1 || failed) return false;
+
+  std::unique_lock<std::mutex> lock(journalMutex);
+  uint64 transaction = runningTransaction;
+
+  // whoever finds no commit in flight becomes the leader and writes every
+  // transaction that closed so far, later callers just wait for its fsync
+  while(durableTransaction < transaction) {
+
+    if(committing) {
+      journalCommitted.wait(lock);
+      continue;
+    }
+
+    committing = true;
+    uint64 closed = runningTransaction++;
+    lock.unlock();
+
+    bool ok = writeTransaction();
+
+    lock.lock();
+    committing = false;
+    if(ok) durableTransaction = closed;
+    journalCommitted.notify_all();
+
+    if(!ok) return false;
+
+  }
+
+  return true;
+
+}
+
+void FileSystem::fail() {
+  __atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+}
+
+bool FileSystem::intact() {
+  // an operation the volume failed under may have worked on blocks of zeros
+  return !__atomic_load_n(&failed, __ATOMIC_RELAXED);
+}
+
+void FileSystem::limitTransaction() {
+
+  // called before an operation that changes the volume takes the volume lock,
+  // the transaction is committed while it still fits in the journal with room
+  // to spare for the operation and the transaction after it
+
+  if(fd == -1) return;
+
+  // frames added to the pool hold metadata that only a checkpoint lets go of
+  if(pool != NULL && pool->overgrown()) {
+    checkpoint();
+    return;
+  }
+
+  HeaderBlock* header = getHeaderBlock();
+
+  int limit = header->journalBlocks / 4;
+  if(__atomic_load_n(&pendingCount, __ATOMIC_RELAXED) >= limit) {
+    commit();
+    return;
+  }
+
+  // freed blocks come back only with a commit, which is due once they outnumber
+  // the blocks still free
+  int deferred = __atomic_load_n(&deferredBlocks, __ATOMIC_RELAXED);
+  if(deferred == 0) return;
+
+  std::unique_lock<std::mutex> lock(allocatorMutex);
+  int available = header->totalBlocks - __atomic_load_n(&header->usedBlocks, __ATOMIC_RELAXED);
+  lock.unlock();
+
+  if(available < deferred) commit();
+
+}
+
+bool FileSystem::checkpoint() {
+
+  acquireJournal();
+
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+  bool ok = writeCheckpoint();
+  lock.unlock();
+
+  releaseJournal();
+  return ok;
+
+}
+
+void FileSystem::acquireJournal() {
+
+  // the journal has one writer at a time, it is claimed before the volume lock
+
+  std::unique_lock<std::mutex> lock(journalMutex);
+  while(committing) journalCommitted.wait(lock);
+  committing = true;
+
+}
+
+void FileSystem::releaseJournal() {
+  std::lock_guard<std::mutex> lock(journalMutex);
+  committing = false;
+  journalCommitted.notify_all();
+}
+
+bool FileSystem::writeCheckpoint() {
+
+  if(fd == -1 || failed) return false;
+
+  // everything is journaled first so a crash while writing in place can be replayed
+  int end;
+  bool ok = logTransaction(&end) && flushTransaction(end);
+
+  ok = ok && writeBack() && resetJournal();
+  if(!ok) printc("Checkpoint failed\n", COLOR_RED);
+
+  if(ok && pool != NULL) pool->trim();
+
+  return ok;
+
+}
+
+bool FileSystem::writeTransaction() {
+
+  // only taking the snapshot excludes other operations, they go on while it is written
+
+  std::unique_lock<std::shared_mutex> lock(volumeMutex);
+
+  int end;
+  if(!logTransaction(&end)) return false;
+
+  lock.unlock();
+  if(!flushTransaction(end)) return false;
+
+  if(journalHead <= getHeaderBlock()->journalBlocks / 2) return true;
+
+  lock.lock();
+  return writeCheckpoint();
+
+}
+
+bool FileSystem::logTransaction(int* end) {
+
+  // a transaction that does not fit behind the ones already in the journal gets
+  // the whole journal once their images are written home, nothing is ever
+  // written in place before it is logged
+
+  if(prepareTransaction(end)) return true;
+  if(drainJournal() && prepareTransaction(end)) return true;
+
+  printc("ERROR: Transaction does not fit in the journal\n", COLOR_RED);
+  fail();
+
+  return false;
+
+}
+
+bool FileSystem::prepareTransaction(int* end) {
+
+  PinScope pins;
+
+  flushChunks();
+
+  // blocks held by allocation caches would be lost if a crash replayed this
+  // transaction, and blocks freed since the last one are given back in it
+  std::unique_lock<std::mutex> allocator(allocatorMutex);
+  drainAllocationCaches(true);
+  applyFreedBlocks();
+  allocator.unlock();
+
+  HeaderBlock* header = getHeaderBlock();
+  int words = dirtyWords();
+
+  // blocks with an image in the journal keep being journaled until the next
+  // checkpoint, otherwise replay would roll them back to the older image
+  int logged = headerPending ? 1 : 0;
+  for(int w = 0; w < words; w++) {
+    logged += __builtin_popcountll(pendingBlocks[w] | (dirtyBlocks[w] & journaledBlocks[w]));
+  }
+
+  int descriptors = (logged + JournalBlock::capacity - 1) / JournalBlock::capacity;
+  int needed = logged + descriptors;
+
+  if(needed > header->journalBlocks - journalHead) {
+    allocator.lock();
+    holdReleasedBlocks(true);
+    return false;
+  }
+
+  __atomic_store_n(&pendingCount, 0, __ATOMIC_RELAXED);
+
+  // data blocks are written in place by flushTransaction
+  for(int w = 0; w < words; w++) {
+    flushBlocks[w] = dirtyBlocks[w] & ~pendingBlocks[w] & ~journaledBlocks[w];
+    dirtyBlocks[w] &= ~flushBlocks[w];
+  }
+
+  int p = journalHead;
+
+  JournalBlock* descriptor = NULL;
+  char* images = NULL;
+
+  int w = 0;
+  uint64 bits = 0;
+  bool logHeader = headerPending;
+
+  headerPending = false;
+
+  for(int n = 0; n < logged; n++) {
+
+    if(descriptor == NULL) {
+      descriptor = getJournalBlock(header->journalBlock + p);
+      descriptor->magic = JOURNAL_MAGIC;
+      descriptor->flags = 0;
+      descriptor->sequence = journalSequence;
+      descriptor->count = 0;
+      images = (char*)descriptor + BLOCK_SIZE;
+      p++;
+    }
+
+    int i = -1;
+
+    if(logHeader) {
+      logHeader = false;
+      memcpy(images, header, headerSize);
+    }else{
+      while(bits == 0) {
+        bits = pendingBlocks[w] | (dirtyBlocks[w] & journaledBlocks[w]);
+        pendingBlocks[w] = 0;
+        journaledBlocks[w] |= bits;
+        w++;
+      }
+      i = (w - 1) * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      memcpy(images, blockAt(i), BLOCK_SIZE);
+    }
+
+    descriptor->blocks[descriptor->count++] = i;
+    images += BLOCK_SIZE;
+    p++;
+
+    if(descriptor->count == JournalBlock::capacity || n == logged - 1) {
+      if(n == logged - 1) descriptor->flags = JOURNAL_COMMIT;
+      descriptor->checksum = 0;
+      descriptor->checksum = checksum(descriptor, (uint64)(1 + descriptor->count) * BLOCK_SIZE, descriptor->sequence);
+      descriptor = NULL;
+    }
+
+  }
+
+  if(logged > 0) journalSequence++;
+
+  allocator.lock();
+  holdReleasedBlocks(true);
+
+  *end = p;
+  return true;
+
+}
+
+bool FileSystem::flushTransaction(int end) {
+
+  HeaderBlock* header = getHeaderBlock();
+  int words = dirtyWords();
+
+  bool ok = true;
+
+  uint64 runStart = 0;
+  uint64 runEnd = 0;
+
+  for(int w = 0; w < words; w++) {
+
+    uint64 bits = flushBlocks[w];
+
+    while(bits != 0) {
+
+      int i = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+
+      uint64 blockStart = headerSize + (uint64)i * BLOCK_SIZE;
+
+      if(runEnd != 0 && blockStart == runEnd) {
+        runEnd += BLOCK_SIZE;
+        continue;
+      }
+
+      if(runEnd != 0) ok = writeRange(runStart, runEnd - runStart) && ok;
+
+      runStart = blockStart;
+      runEnd = blockStart + BLOCK_SIZE;
+
+    }
+
+  }
+
+  // data is on disk before the commit record that points at it
+  if(runEnd != 0) ok = writeRange(runStart, runEnd - runStart) && syncImage() && ok;
+
+  if(end > journalHead) {
+    uint64 offset = (char*)getJournalBlock(header->journalBlock + journalHead) - memory;
+    ok = writeRange(offset, (uint64)(end - journalHead) * BLOCK_SIZE) && ok;
+  }
+
+  ok = syncImage() && ok;
+
+  for(int w = 0; w < words; w++) {
+    // blocks that did not reach the disk go with the next transaction
+    if(!ok && flushBlocks[w] != 0) __atomic_fetch_or(&dirtyBlocks[w], flushBlocks[w], __ATOMIC_RELAXED);
+    __atomic_store_n(&flushBlocks[w], 0, __ATOMIC_RELAXED);
+  }
+
+  if(!ok) {
+    // journaled blocks stay dirty and are logged again under the same sequence
+    if(end > journalHead) journalSequence--;
+    __atomic_store_n(&headerPending, true, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  journalHead = end;
+
+  // the frees are durable and the blocks can be used again
+  std::lock_guard<std::mutex> lock(allocatorMutex);
+  holdReleasedBlocks(false);
+  releasingRuns.clear();
+
+  return true;
+
+}
+
+bool FileSystem::writeBack() {
+
+  int words = dirtyWords();
+  int blocks = getHeaderBlock()->totalBlocks;
+
+  bool ok = true;
+
+  uint64 runStart = 0;
+  uint64 runEnd = 0;
+
+  if(headerDirty) runEnd = headerSize;
+
+  for(int w = 0; w < words; w++) {
+
+    uint64 bits = dirtyBlocks[w];
+
+    while(bits != 0) {
+
+      int i = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+
+      if(i >= blocks) break;
+
+      uint64 blockStart = headerSize + (uint64)i * BLOCK_SIZE;
+
+      if(runEnd != 0 && blockStart == runEnd) {
+        runEnd += BLOCK_SIZE;
+        continue;
+      }
+
+      if(runEnd != 0) ok = writeRange(runStart, runEnd - runStart) && ok;
+
+      runStart = blockStart;
+      runEnd = blockStart + BLOCK_SIZE;
+
+    }
+
+  }
+
+  if(runEnd != 0) ok = writeRange(runStart, runEnd - runStart) && ok;
+  ok = syncImage() && ok;
+
+  if(ok) clearDirty();
+  return ok;
+
+}
+
+bool FileSystem::drainJournal() {
+
+  // the images in the journal are copied to their homes, which is what a replay
+  // would do, leaving the blocks in memory with their later changes alone
+
+  HeaderBlock* header = getHeaderBlock();
+
+  // the kernel writes a mapped image back on its own anyway
+  if(mapped) return writeBack() && resetJournal();
+
+  HeaderBlock committed;
+  bool ok = pread(fd, &committed, headerSize, 0) == headerSize;
+
+  for(int p = 0; ok && p < journalHead;) {
+
+    JournalBlock* descriptor = getJournalBlock(header->journalBlock + p);
+    char* images = (char*)descriptor + BLOCK_SIZE;
+
+    for(int n = 0; n < descriptor->count; n++) {
+      int i = descriptor->blocks[n];
+      if(i == -1) memcpy(&committed, images, headerSize);
+      else ok = pwrite(fd, images, BLOCK_SIZE, headerSize + (uint64)i * BLOCK_SIZE) == BLOCK_SIZE && ok;
+      images += BLOCK_SIZE;
+    }
+
+    p += 1 + descriptor->count;
+
+  }
+
+  // the header goes last, until then a crash replays the same images again
+  committed.journalSequence = journalSequence;
+
+  ok = ok && fdatasync(fd) == 0;
+  ok = ok && pwrite(fd, &committed, headerSize, 0) == headerSize && fdatasync(fd) == 0;
+
+  if(!ok) {
+    printc("ERROR: Cannot write the journal home\n", COLOR_RED);
+    return false;
+  }
+
+  // blocks that were journaled and are still dirty are written in place with
+  // the next transaction, as data
+  journalHead = 0;
+  memset(journaledBlocks, 0, dirtyWords() * sizeof(uint64));
+
+  return true;
+
+}
+
+bool FileSystem::resetJournal() {
+
+  HeaderBlock* header = getHeaderBlock();
+  header->journalSequence = journalSequence;
+
+  bool ok = writeRange(0, headerSize) && syncImage();
+  if(!ok) return false;
+
+  journalHead = 0;
+  memset(journaledBlocks, 0, dirtyWords() * sizeof(uint64));
+
+  return true;
+
+}
+
+void FileSystem::replayJournal() {
+
+  HeaderBlock* header = getHeaderBlock();
+
+  int journalBlock = header->journalBlock;
+  int journalBlocks = header->journalBlocks;
+  int blocks = header->totalBlocks;
+
+  uint64 sequence = header->journalSequence;
+  int head = 0;
+  int replayed = 0;
+
+  while(true) {
+
+    int p = head;
+    bool complete = false;
+
+    while(p < journalBlocks) {
+
+      JournalBlock* descriptor = getJournalBlock(journalBlock + p);
+
+      if(descriptor->magic != JOURNAL_MAGIC || descriptor->sequence != sequence) break;
+      if(descriptor->count <= 0 || descriptor->count > JournalBlock::capacity) break;
+      if(p + 1 + descriptor->count > journalBlocks) break;
+
+      uint64 sum = descriptor->checksum;
+      descriptor->checksum = 0;
+      uint64 expected = checksum(descriptor, (uint64)(1 + descriptor->count) * BLOCK_SIZE, sequence);
+      descriptor->checksum = sum;
+
+      if(sum != expected) break;
+
+      p += 1 + descriptor->count;
+
+      if(descriptor->flags & JOURNAL_COMMIT) {
+        complete = true;
+        break;
+      }
+
+    }
+
+    if(!complete) break;
+
+    while(head < p) {
+
+      JournalBlock* descriptor = getJournalBlock(journalBlock + head);
+      char* images = (char*)descriptor + BLOCK_SIZE;
+
+      for(int n = 0; n < descriptor->count; n++) {
+
+        int i = descriptor->blocks[n];
+        PinScope pins;
+
+        if(i == -1) {
+          memcpy(header, images, headerSize);
+          markDirty(header, headerSize);
+        }else if(i < blocks) {
+          char* block = blockAt(i);
+          memcpy(block, images, BLOCK_SIZE);
+          markDirty(block);
+        }
+
+        images += BLOCK_SIZE;
+
+      }
+
+      head += 1 + descriptor->count;
+
+    }
+
+    sequence++;
+    replayed++;
+
+  }
+
+  journalSequence = sequence;
+  journalHead = 0;
+
+  if(replayed == 0) return;
+
+  printfc("Replayed %d journal transactions\n", COLOR_YELLOW, replayed);
+
+  if(!writeBack() || !resetJournal()) printc("Cannot write replayed journal\n", COLOR_RED);
+
+}
+
+bool FileSystem::writeRange(uint64 offset, uint64 len) {
+
+  // writes of a disk-backed volume are queued and go out together once the image is synced
+
+  if(io != NULL) {
+
+    uint64 residentEnd = headerSize + (uint64)residentBlocks * BLOCK_SIZE;
+
+    if(offset < residentEnd) {
+      uint64 n = min(len, residentEnd - offset);
+      queuedWrites.push_back({ memory + offset, offset, (int)n, true });
+      offset += n;
+      len -= n;
+    }
+
+    // blocks in the pool are written from their frames, blocks that were evicted
+    // reached the disk when they left the pool
+    for(; len > 0; offset += BLOCK_SIZE, len -= BLOCK_SIZE) {
+      char* data = pool->hold((offset - headerSize) / BLOCK_SIZE);
+      if(data != NULL) queuedWrites.push_back({ data, offset, BLOCK_SIZE, true });
+    }
+
+    return true;
+
+  }
+
+  if(mapped) {
+    uint64 page = sysconf(_SC_PAGESIZE);
+    uint64 aligned = offset / page * page;
+    return msync(memory + aligned, offset + len - aligned, MS_SYNC) == 0;
+  }
+
+  while(len > 0) {
+    ssize_t n = pwrite(fd, memory + offset, len, offset);
+    if(n <= 0) return false;
+    offset += n;
+    len -= n;
+  }
+
+  return true;
+
+}
+
+bool FileSystem::syncImage() {
+
+  if(mapped) return true;
+
+  bool ok = true;
+
+  if(!queuedWrites.empty()) {
+    ok = io->submit(queuedWrites.data(), queuedWrites.size());
+    for(IoRequest& request : queuedWrites) pool->release(request.buffer);
+    queuedWrites.clear();
+  }
+
+  return fdatasync(fd) == 0 && ok;
+
+}
+
+// #endregion
+
+// #region Directory
+
+Directory::Directory() {
+  fs = NULL;
+  block = NULL;
+}
+
+Directory::Directory(FileSystem* fs, DirectoryBlock* block) {
+  this->fs = fs;
+  this->block = block;
+}
+
+bool Directory::isValid() {
+  return fs != NULL;
+}
+
+bool Directory::fileExist(const char* name) {
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+  return getFileInfo(name, 'F') != NULL;
+}
+
+File Directory::openFile(const char* name, FileOpenMode mode) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return File();
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'F');
+
+  if(fileInfo == NULL) {
+
+    if(mode == READ) {
+      printfc("Cannot open file %s because it does not exist\n", COLOR_RED, name);
+      return File();
+    }
+
+    fileInfo = addFileInfo(name, 'F');
+
+    if(fileInfo == NULL) {
+      printfc("Cannot create file %s because volume is full\n", COLOR_RED, name);
+      return File();
+    }
+
+    fileInfo->flags = fs->compression ? FILE_COMPRESSED : 0;
+    fileInfo->fileSize = 0;
+    fileInfo->dateCreated = getCurrentTime();
+    fileInfo->dateModified = fileInfo->dateCreated;
+
+    fileInfo->firstBlock = -1;
+    fileInfo->lastBlock = -1;
+
+    fs->markDirty(fileInfo, sizeof(FileInfo));
+
+  }
+
+  return File(fs, fs->blockIndex(block), fileInfo, mode);
+
+}
+
+bool Directory::directoryExist(const char* name) {
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+  return getFileInfo(name, 'D') != NULL;
+}
+
+bool Directory::createDirectory(const char* name) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'D');
+  if(fileInfo != NULL) {
+    printfc("Cannot create directory %s because it already exist\n", COLOR_RED, name);
+    return false;
+  }
+
+  int n = fs->allocateBlock();
+  if(n != -1) fileInfo = addFileInfo(name, 'D');
+
+  if(n == -1 || fileInfo == NULL) {
+    if(n != -1) fs->deallocateBlock(n);
+    printfc("Cannot create directory %s because volume is full\n", COLOR_RED, name);
+    return false;
+  }
+
+  DirectoryBlock* dir = fs->getDirectoryBlock(n);
+
+  dir->parentDirectory = fs->blockIndex(this->block);
+  dir->previousBlock = -1;
+  dir->nextBlock = -1;
+  dir->depth = 0;
+  dir->fileCount = 0;
+
+  fileInfo->dateCreated = getCurrentTime();
+  fileInfo->dateModified = fileInfo->dateCreated;
+
+  fileInfo->firstBlock = n;
+
+  fs->markDirty(dir);
+  fs->markDirty(fileInfo, sizeof(FileInfo));
+
+  return true;
+
+}
+
+Directory Directory::openDirectory(const char* name) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return Directory();
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'D');
+  if(fileInfo == NULL) {
+    printfc("Cannot open directory %s because it does not exist\n", COLOR_RED, name);
+    return Directory();
+  }
+
+  return Directory(fs, fs->getDirectoryBlock(fileInfo->firstBlock)); 
+
+}
+
+DirectoryIterator Directory::iterator(const char* path) {
+  return DirectoryIterator(fs, block, path);
+}
+
+bool Directory::deleteFile(const char* name) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'F');
+
+  if(fileInfo == NULL) {
+    printfc("Cannot delete file %s because it does not even exist\n", COLOR_RED, name);
+    return false;
+  }
+
+  fs->truncateFile(fileInfo, 0);
+  removeFileInfo(name, 'F');
+
+  return true;
+
+}
+
+bool Directory::renameFile(const char* name, const char* newName) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+
+  if(strlen(newName) > 31) {
+    printfc("Cannot rename, maximum length of name is 31 character (%s)\n", COLOR_RED, newName);
+    return false;
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'F');
+
+  if(fileInfo == NULL) {
+    printfc("Cannot rename file %s because it does not exist\n", COLOR_RED, name);
+    return false;
+  }
+
+  bool exist = fileExist(newName);
+  if(exist) {
+    printfc("Cannot rename file %s to %s because file with new name already exist\n", COLOR_RED, name, newName);
+    return false;
+  }
+
+  FileInfo temp = *fileInfo;
+  strcpy(temp.fileName, newName);
+  temp.dateModified = getCurrentTime();
+
+  fileInfo = addFileInfo(newName, 'F');
+  if(fileInfo == NULL) {
+    printfc("Cannot rename file %s because volume is full\n", COLOR_RED, name);
+    return false;
+  }
+
+  *fileInfo = temp;
+  fs->markDirty(fileInfo, sizeof(FileInfo));
+
+  removeFileInfo(name, 'F');
+
+  return true;
+
+}
+
+bool Directory::deleteDirectory(const char* name) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'D');
+
+  if(fileInfo == NULL) {
+    printfc("Cannot delete directory %s because it does not even exist\n", COLOR_RED, name);
+    return false;
+  }
+
+  DirectoryBlock* dirToDelete = fs->getDirectoryBlock(fileInfo->firstBlock);
+  if(dirToDelete->depth != 0 || dirToDelete->fileCount != 0) {
+    printfc("Cannot delete directory %s because it is not empty\n", COLOR_RED, name);
+    return false;
+  }
+
+  fs->releaseDirectoryHash(fileInfo->firstBlock);
+  fs->deallocateBlock(fileInfo->firstBlock);
+  removeFileInfo(name, 'D');
+
+  return true;
+
+}
+
+bool Directory::renameDirectory(const char* name, const char* newName) {
+
+  if(strlen(name) > 31) {
+    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
+    return false;
+  }
+
+  if(strlen(newName) > 31) {
+    printfc("Cannot rename, maximum length of name is 31 character (%s)\n", COLOR_RED, newName);
+    return false;
+  }
+
+  FileInfo* fileInfo = getFileInfo(name, 'D');
+
+  if(fileInfo == NULL) {
+    printfc("Cannot rename directory %s because it does not exist\n", COLOR_RED, name);
+    return false;
+  }
+
+  bool exist = directoryExist(newName);
+  if(exist) {
+    printfc("Cannot rename directory %s to %s because directory with new name already exist\n", COLOR_RED, name, newName);
+    return false;
+  }
+
+  FileInfo temp = *fileInfo;
+  strcpy(temp.fileName, newName);
+
+  fileInfo = addFileInfo(newName, 'D');
+  if(fileInfo == NULL) {
+    printfc("Cannot rename directory %s because volume is full\n", COLOR_RED, name);
+    return false;
+  }
+
+  *fileInfo = temp;
+  fs->markDirty(fileInfo, sizeof(FileInfo));
+
+  removeFileInfo(name, 'D');
+
+  return true;
+
+}
+
+int compareWithFileInfo(const char* name, char type, FileInfo* fileInfo) {
+
+  if(type != fileInfo->fileType) {
+    if(type == 'D') return -1;
+    return 1;
+  }
+
+  return strncmp(name, fileInfo->fileName, 31);
+
+}
+
+int compareWithKey(const char* name, char type, DirectoryKey* key) {
+
+  if(type != key->fileType) {
+    if(type == 'D') return -1;
+    return 1;
+  }
+
+  return strncmp(name, key->fileName, 31);
+
+}
+
+uint hashName(const char* name, char type) {
+
+  uint hash = 2166136261u;
+
+  hash = (hash ^ (unsigned char)type) * 16777619u;
+  for(int i = 0; i < 31 && name[i] != 0; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+  return hash;
+
+}
+
+DirectoryHash::DirectoryHash(FileSystem* fs) {
+
+  this->fs = fs;
+
+  capacity = 64;
+  count = 0;
+
+  entries = new Entry[capacity];
+  for(int i = 0; i < capacity; i++) entries[i].block = -1;
+
+}
+
+FileInfo* DirectoryHash::find(const char* name, char type) {
+
+  int i = locate(name, type, hashName(name, type));
+  if(i == -1) return NULL;
+
+  return &fs->getDirectoryBlock(entries[i].block)->files[__atomic_load_n(&entries[i].slot, __ATOMIC_RELAXED)];
+
+}
+
+void DirectoryHash::insert(FileInfo* fileInfo) {
+
+  if((count + 1) * 2 > capacity) resize(capacity * 2);
+
+  int mask = capacity - 1;
+  uint hash = hashName(fileInfo->fileName, fileInfo->fileType);
+
+  int i = hash & mask;
+  while(entries[i].block != -1) i = (i + 1) & mask;
+
+  entries[i].hash = hash;
+  entries[i].block = fs->blockIndex(fileInfo);
+  entries[i].slot = fileInfo - fs->getDirectoryBlock(entries[i].block)->files;
+
+  count++;
+
+}
+
+void DirectoryHash::remove(FileInfo* fileInfo) {
+
+  int i = locate(fileInfo->fileName, fileInfo->fileType, hashName(fileInfo->fileName, fileInfo->fileType));
+  if(i == -1) return;
+
+  int mask = capacity - 1;
+
+  entries[i].block = -1;
+  count--;
+
+  // shift back the rest of the probe run so lookups never stop at the hole
+
+  for(int j = (i + 1) & mask; entries[j].block != -1; j = (j + 1) & mask) {
+
+    int ideal = entries[j].hash & mask;
+
+    bool between = i <= j ? (ideal > i && ideal <= j) : (ideal > i || ideal <= j);
+    if(between) continue;
+
+    entries[i] = entries[j];
+    entries[j].block = -1;
+    i = j;
+
+  }
+
+}
+
+int DirectoryHash::locate(const char* name, char type, uint hash) {
+
+  int mask = capacity - 1;
+
+  for(int i = hash & mask; entries[i].block != -1; i = (i + 1) & mask) {
+
+    if(entries[i].hash != hash) continue;
+
+    DirectoryBlock* leaf = fs->getDirectoryBlock(entries[i].block);
+    int slot = __atomic_load_n(&entries[i].slot, __ATOMIC_RELAXED);
+
+    if(slot < (int)leaf->fileCount && compareWithFileInfo(name, type, &leaf->files[slot]) == 0) return i;
+
+    // the slot is a hint, entries shift inside their block on inserts and deletes;
+    // entries with equal hash and block are interchangeable, so any of them may be repaired
+
+    int left = 0;
+    int right = leaf->fileCount - 1;
+
+    while(left <= right) {
+
+      int middle = (left + right) / 2;
+      int compare = compareWithFileInfo(name, type, &leaf->files[middle]);
+
+      if(compare == 0) {
+        // readers repair hints concurrently, so the slot is only accessed atomically
+        __atomic_store_n(&entries[i].slot, middle, __ATOMIC_RELAXED);
+        return i;
+      }
+
+      if(compare < 0) right = middle - 1;
+      else left = middle + 1;
+
+    }
+
+  }
+
+  return -1;
+
+}
+
+void DirectoryHash::resize(int newCapacity) {
+
+  Entry* old = entries;
+  int oldCapacity = capacity;
+
+  capacity = newCapacity;
+  entries = new Entry[capacity];
+  for(int i = 0; i < capacity; i++) entries[i].block = -1;
+
+  int mask = capacity - 1;
+
+  for(int k = 0; k < oldCapacity; k++) {
+    if(old[k].block == -1) continue;
+    int i = old[k].hash & mask;
+    while(entries[i].block != -1) i = (i + 1) & mask;
+    entries[i] = old[k];
+  }
+
+  delete[] old;
+
+}
+
+DirectoryHash::~DirectoryHash() {
+  delete[] entries;
+}
+
+FileInfo* Directory::getFileInfo(const char* name, char type) {
+
+  // directories spanning more than one block are looked up through a hash index
+
+  DirectoryHash* hash = hashIndex(block->depth > 0);
+  if(hash != NULL) return hash->find(name, type);
+
+  DirectoryPath path;
+  DirectoryBlock* leaf = findLeaf(name, type, &path);
+
+  bool found;
+  int index = searchLeaf(leaf, name, type, &found);
+
+  if(!found) return NULL;
+  return &leaf->files[index];
+
+}
+
+FileInfo* Directory::addFileInfo(const char* name, char type) {
+
+  fs->directoryVersion(fs->blockIndex(block))++;
+
+  DirectoryPath path;
+  DirectoryBlock* leaf = findLeaf(name, type, &path);
+
+  // every full node on the way up splits, and a full root is first pushed down
+
+  int level = path.length - 1;
+  while(level >= 0 && isFull(fs->getDirectoryBlock(path.nodes[level]))) level--;
+
+  int needed = path.length - 1 - level;
+  if(level < 0) needed++;
+
+  int spare[DirectoryPath::capacity + 1];
+  int used = 0;
+
+  for(int i = 0; i < needed; i++) {
+    spare[i] = fs->allocateBlock();
+    if(spare[i] != -1) continue;
+    for(int k = 0; k < i; k++) fs->deallocateBlock(spare[k]);
+    return NULL;
+  }
+
+  bool found;
+  int index = searchLeaf(leaf, name, type, &found);
+
+  bool split = leaf->fileCount == DirectoryBlock::capacity;
+  int half = DirectoryBlock::capacity / 2;
+
+  // entries moving to another block are dropped from the hash index and added back
+  // afterwards, shifts inside a block only leave stale slot hints behind
+
+  bool pushLeaf = level < 0 && leaf == block;
+
+  DirectoryHash* hash = hashIndex(false);
+
+  if(hash != NULL) {
+    if(pushLeaf) unindexEntries(hash, leaf, 0);
+    else if(split) unindexEntries(hash, leaf, half);
+  }
+
+  if(level < 0) {
+
+    int n = spare[used++];
+    DirectoryBlock* child = fs->getDirectoryBlock(n);
+    memcpy(child, block, BLOCK_SIZE);
+
+    DirectoryIndexBlock* root = (DirectoryIndexBlock*)block;
+    root->previousBlock = -1;
+    root->nextBlock = -1;
+    root->depth = child->depth + 1;
+    root->keyCount = 1;
+
+    memset(&root->keys[0], 0, sizeof(DirectoryKey));
+    root->keys[0].childBlock = n;
+
+    if(child->depth == 0) leaf = child;
+
+    fs->markDirty(child);
+    fs->markDirty(root);
+
+    for(int i = path.length; i > 0; i--) {
+      path.nodes[i] = path.nodes[i - 1];
+      path.slots[i] = path.slots[i - 1];
+    }
+
+    path.nodes[1] = n;
+    path.slots[0] = 0;
+    path.length++;
+
+  }
+
+  DirectoryBlock* original = leaf;
+  DirectoryKey separator;
+
+  if(split) {
+
+    int n = spare[used++];
+    DirectoryBlock* right = fs->getDirectoryBlock(n);
+
+    right->parentDirectory = leaf->parentDirectory;
+    right->previousBlock = fs->blockIndex(leaf);
+    right->nextBlock = leaf->nextBlock;
+    right->depth = 0;
+    right->fileCount = leaf->fileCount - half;
+
+    memcpy(right->files, &leaf->files[half], right->fileCount * sizeof(FileInfo));
+    leaf->fileCount = half;
+
+    DirectoryBlock* next = fs->getDirectoryBlock(leaf->nextBlock);
+    if(next != NULL) {
+      next->previousBlock = n;
+      fs->markDirty(next);
+    }
+
+    leaf->nextBlock = n;
+    fs->markDirty(leaf);
+    fs->markDirty(right);
+
+    if(index > half) {
+      leaf = right;
+      index -= half;
+    }
+
+  }
+
+  memmove(&leaf->files[index + 1], &leaf->files[index], (leaf->fileCount - index) * sizeof(FileInfo));
+  leaf->fileCount++;
+
+  FileInfo* fileInfo = &leaf->files[index];
+  strcpy(fileInfo->fileName, name);
+  fileInfo->fileType = type;
+  fileInfo->flags = 0;
+
+  fs->markDirty(leaf);
+
+  if(hash != NULL) {
+    if(pushLeaf) indexEntries(hash, original, 0);
+    else if(!split || leaf == original) hash->insert(fileInfo);
+  }
+
+  if(split) {
+
+    DirectoryBlock* right = fs->getDirectoryBlock(spare[used - 1]);
+    if(hash != NULL) indexEntries(hash, right, 0);
+
+    memcpy(separator.fileName, right->files[0].fileName, sizeof(separator.fileName));
+    separator.fileType = right->files[0].fileType;
+    separator.childBlock = spare[used - 1];
+
+  }
+
+  // hang the new sibling into the parent, splitting index nodes as needed
+
+  level = path.length - 2;
+
+  while(split) {
+
+    DirectoryIndexBlock* node = fs->getDirectoryIndexBlock(path.nodes[level]);
+    int slot = path.slots[level] + 1;
+
+    split = node->keyCount == DirectoryIndexBlock::capacity;
+
+    DirectoryIndexBlock* target = node;
+
+    if(split) {
+
+      int n = spare[used++];
+      DirectoryIndexBlock* right = fs->getDirectoryIndexBlock(n);
+      int half = DirectoryIndexBlock::capacity / 2;
+
+      right->parentDirectory = node->parentDirectory;
+      right->previousBlock = -1;
+      right->nextBlock = -1;
+      right->depth = node->depth;
+      right->keyCount = node->keyCount - half;
+
+      memcpy(right->keys, &node->keys[half], right->keyCount * sizeof(DirectoryKey));
+      node->keyCount = half;
+
+      fs->markDirty(right);
+
+      if(slot > half) {
+        target = right;
+        slot -= half;
+      }
+
+    }
+
+    memmove(&target->keys[slot + 1], &target->keys[slot], (target->keyCount - slot) * sizeof(DirectoryKey));
+    target->keys[slot] = separator;
+    target->keyCount++;
+
+    fs->markDirty(node);
+    fs->markDirty(target);
+
+    if(split) {
+      DirectoryIndexBlock* right = fs->getDirectoryIndexBlock(spare[used - 1]);
+      separator = right->keys[0];
+      separator.childBlock = spare[used - 1];
+    }
+
+    level--;
+
+  }
+
+  return fileInfo;
+
+}
+
+void Directory::removeFileInfo(const char* name, char type) {
+
+  fs->directoryVersion(fs->blockIndex(block))++;
+
+  DirectoryPath path;
+  DirectoryBlock* leaf = findLeaf(name, type, &path);
+
+  bool found;
+  int index = searchLeaf(leaf, name, type, &found);
+  if(!found) return;
+
+  DirectoryHash* hash = hashIndex(false);
+  if(hash != NULL) hash->remove(&leaf->files[index]);
+
+  leaf->fileCount--;
+  memmove(&leaf->files[index], &leaf->files[index + 1], (leaf->fileCount - index) * sizeof(FileInfo));
+
+  fs->markDirty(leaf);
+
+  if(leaf->fileCount > 0 || path.length == 1) return;
+
+  // an empty leaf leaves the chain and its parent, and so does every index node it empties
+
+  DirectoryBlock* previous = fs->getDirectoryBlock(leaf->previousBlock);
+  DirectoryBlock* next = fs->getDirectoryBlock(leaf->nextBlock);
+
+  if(previous != NULL) {
+    previous->nextBlock = leaf->nextBlock;
+    fs->markDirty(previous);
+  }
+
+  if(next != NULL) {
+    next->previousBlock = leaf->previousBlock;
+    fs->markDirty(next);
+  }
+
+  fs->deallocateBlock(path.nodes[path.length - 1]);
+
+  for(int level = path.length - 2; level >= 0; level--) {
+
+    DirectoryIndexBlock* node = fs->getDirectoryIndexBlock(path.nodes[level]);
+    int slot = path.slots[level];
+
+    node->keyCount--;
+    memmove(&node->keys[slot], &node->keys[slot + 1], (node->keyCount - slot) * sizeof(DirectoryKey));
+
+    fs->markDirty(node);
+
+    if(node->keyCount > 0 || level == 0) break;
+    fs->deallocateBlock(path.nodes[level]);
+
+  }
+
+  // a root left with a single child takes over the child's contents
+
+  while(block->depth > 0) {
+
+    DirectoryIndexBlock* root = (DirectoryIndexBlock*)block;
+
+    if(root->keyCount == 0) {
+      block->depth = 0;
+      block->fileCount = 0;
+      fs->markDirty(block);
+      break;
+    }
+
+    if(root->keyCount > 1) break;
+
+    int n = root->keys[0].childBlock;
+    DirectoryBlock* child = fs->getDirectoryBlock(n);
+
+    if(hash != NULL && child->depth == 0) unindexEntries(hash, child, 0);
+    memcpy(block, child, BLOCK_SIZE);
+    if(hash != NULL && block->depth == 0) indexEntries(hash, block, 0);
+
+    fs->deallocateBlock(n);
+    fs->markDirty(block);
+
+  }
+
+}
+
+DirectoryBlock* Directory::findLeaf(const char* name, char type, DirectoryPath* path) {
+
+  DirectoryBlock* node = block;
+  path->length = 0;
+
+  while(true) {
+
+    path->nodes[path->length++] = fs->blockIndex(node);
+    if(node->depth == 0) return node;
+
+    DirectoryIndexBlock* index = (DirectoryIndexBlock*)node;
+    int slot = searchIndex(index, name, type);
+
+    path->slots[path->length - 1] = slot;
+    node = fs->getDirectoryBlock(index->keys[slot].childBlock);
+
+  }
+
+}
+
+int Directory::searchLeaf(DirectoryBlock* leaf, const char* name, char type, bool* found) {
+
+  int left = 0;
+  int right = leaf->fileCount;
+
+  while(left < right) {
+    int middle = (left + right) / 2;
+    if(compareWithFileInfo(name, type, &leaf->files[middle]) > 0) left = middle + 1;
+    else right = middle;
+  }
+
+  *found = left < (int)leaf->fileCount && compareWithFileInfo(name, type, &leaf->files[left]) == 0;
+  return left;
+
+}
+
+int Directory::searchIndex(DirectoryIndexBlock* node, const char* name, char type) {
+
+  // the first key only bounds the subtree from below, so it is never compared
+
+  int left = 1;
+  int right = node->keyCount;
+
+  while(left < right) {
+    int middle = (left + right) / 2;
+    if(compareWithKey(name, type, &node->keys[middle]) >= 0) left = middle + 1;
+    else right = middle;
+  }
+
+  return left - 1;
+
+}
+
+DirectoryHash* Directory::hashIndex(bool build) {
+
+  int root = fs->blockIndex(block);
+
+  // lookups run under the shared volume lock, so building a table needs its own lock
+  std::lock_guard<std::mutex> lock(fs->directoryHashMutex);
+
+  auto it = fs->directoryHashes.find(root);
+  if(it != fs->directoryHashes.end()) return it->second;
+
+  if(!build) return NULL;
+
+  DirectoryHash* hash = new DirectoryHash(fs);
+  fs->directoryHashes[root] = hash;
+
+  DirectoryBlock* leaf = block;
+  while(leaf->depth > 0) leaf = fs->getDirectoryBlock(((DirectoryIndexBlock*)leaf)->keys[0].childBlock);
+
+  // leaves are let go as soon as they are indexed, a directory may not fit in the buffer pool
+  for(int next = fs->blockIndex(leaf); next != -1;) {
+    PinScope pins;
+    leaf = fs->getDirectoryBlock(next);
+    indexEntries(hash, leaf, 0);
+    next = leaf->nextBlock;
+  }
+
+  return hash;
+
+}
+
+void Directory::indexEntries(DirectoryHash* hash, DirectoryBlock* leaf, int from) {
+  for(int i = from; i < (int)leaf->fileCount; i++) hash->insert(&leaf->files[i]);
+}
+
+void Directory::unindexEntries(DirectoryHash* hash, DirectoryBlock* leaf, int from) {
+  for(int i = from; i < (int)leaf->fileCount; i++) hash->remove(&leaf->files[i]);
+}
+
+bool Directory::isFull(DirectoryBlock* node) {
+  if(node->depth == 0) return node->fileCount == DirectoryBlock::capacity;
+  return ((DirectoryIndexBlock*)node)->keyCount == DirectoryIndexBlock::capacity;
+}
+
+// #endregion
+
+// #region File
+
+#define FILE_BLOCK_CAPACITY FileBlock::capacity
+
+File::File() {
+  _isOpen = false;
+}
+
+File::File(FileSystem* fs, int directory, FileInfo* entry, FileOpenMode mode) {
+
+  this->fs = fs;
+  this->directory = directory;
+  this->entryBlock = fs->blockIndex(entry);
+  this->entrySlot = entry - fs->getDirectoryBlock(entryBlock)->files;
+  this->version = fs->directoryVersion(directory);
+  this->mode = mode;
+
+  memcpy(fileName, entry->fileName, sizeof(fileName));
+
+  switch (mode) {
+    case READ:
+    case WRITE:
+      pos = 0;
+      break;
+    case APPEND:
+      pos = entry->fileSize;
+      break;
+  }
+
+  writtenEnd = 0;
+
+  _isOpen = true;
+
+}
+
+bool File::isOpen() {
+  return _isOpen;
+}
+
+char* File::name() {
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+  return fileName;
+}
+
+int64 File::size() {
+
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+
+  FileInfo info;
+  if(!load(&info)) return 0;
+
+  return info.fileSize;
+
+}
+
+void File::setPosition(int64 pos) {
+
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+
+  FileInfo info;
+  int64 size = load(&info) ? info.fileSize : 0;
+
+  if(pos < 0) pos = 0;
+  else if(pos > size) pos = size;
+  this->pos = pos;
+
+}
+
+int64 File::getPosition() {
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+  return pos;
+}
+
+int64 File::write(char* bytes, int64 len) {
+  iovec buffer = { bytes, (size_t)len };
+  return transfer(&buffer, 1, &pos, true);
+}
+
+int64 File::read(char* bytes, int64 len) {
+  iovec buffer = { bytes, (size_t)len };
+  return transfer(&buffer, 1, &pos, false);
+}
+
+int64 File::writev(const iovec* buffers, int count) {
+  return transfer(buffers, count, &pos, true);
+}
+
+int64 File::readv(const iovec* buffers, int count) {
+  return transfer(buffers, count, &pos, false);
+}
+
+int64 File::pwrite(char* bytes, int64 len, int64 offset) {
+  iovec buffer = { bytes, (size_t)len };
+  return transfer(&buffer, 1, &offset, true);
+}
+
+int64 File::pread(char* bytes, int64 len, int64 offset) {
+  iovec buffer = { bytes, (size_t)len };
+  return transfer(&buffer, 1, &offset, false);
+}
+
+FileView File::view(int64 offset, int64 len) {
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+  return FileView(this, offset, len);
+}
+
+bool writeFully(int fd, iovec* buffers, int count) {
+
+  while(count > 0) {
+
+    ssize_t n = writev(fd, buffers, count);
+    if(n <= 0) return false;
+
+    while(count > 0 && (size_t)n >= buffers->iov_len) {
+      n -= buffers->iov_len;
+      buffers++;
+      count--;
+    }
+
+    if(count > 0) {
+      buffers->iov_base = (char*)buffers->iov_base + n;
+      buffers->iov_len -= n;
+    }
+
+  }
+
+  return true;
+
+}
+
+int64 File::copyTo(int out) {
+
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+  std::shared_lock<std::shared_mutex> lock(fs->fileLock(directory, fileName));
+
+  FileInfo info;
+  if(!load(&info)) return -1;
+
+  Extent extent;
+  extent.blockCount = 0;
+
+  int64 size = info.fileSize;
+  int64 at = 0;
+  int64 fetched = 0;
+
+  if(info.flags & FILE_INLINE) {
+    iovec buffer = { fs->inlineData(&info), (size_t)size };
+    return writeFully(out, &buffer, 1) ? size : -1;
+  }
+
+  // compressed files are written out a decompressed chunk at a time
+  if(info.flags & FILE_COMPRESSED) {
+
+    std::vector<char> data(CHUNK_SIZE);
+
+    for(; at < size; at += CHUNK_SIZE) {
+
+      PinScope pins;
+
+      ChunkEntry* entry = fs->chunkEntry(&info, at / CHUNK_SIZE);
+      int64 run = min((int64)CHUNK_SIZE, size - at);
+
+      std::unique_lock<std::mutex> cache(fs->chunkCacheMutex);
+      CachedChunk* cached = entry != NULL ? fs->cacheChunk(entry, true) : NULL;
+
+      if(cached == NULL || cached->size < run) {
+        printfc("ERROR: Damaged chunk in file %s at %lld\n", COLOR_RED, fileName, (long long)at);
+        return -1;
+      }
+
+      memcpy(data.data(), cached->data, run);
+      cache.unlock();
+
+      iovec buffer = { data.data(), (size_t)run };
+      if(!writeFully(out, &buffer, 1)) return -1;
+
+    }
+
+    return fs->intact() ? size : -1;
+
+  }
+
+  // a mapped image shares the page cache with its file, so contiguous runs are
+  // copied by the kernel unless every block has to be verified on the way
+  bool kernelCopy = fs->mapped && fs->getHeaderBlock()->checksumBlock == 0;
+
+  const int batch = 64;
+  iovec buffers[batch];
+
+  while(at < size) {
+
+    PinScope pins;
+
+    if(fs->pool != NULL && at >= fetched) fetched = fetchAhead(&info, &extent, at, size - at);
+
+    int64 available;
+    char* p = dataAt(&info, &extent, at, &available);
+    if(p == NULL) return -1;
+
+    int64 run = min(available, size - at);
+
+    if(kernelCopy) {
+
+      loff_t offset = p - fs->memory;
+      ssize_t n = copy_file_range(fs->fd, &offset, out, NULL, run, 0);
+
+      if(n > 0) {
+        at += n;
+        continue;
+      }
+
+      // descriptors the kernel cannot copy into are written to instead
+      if(n == 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) return -1;
+      kernelCopy = false;
+
+    }
+
+    // runs of a disk-backed volume are single blocks, they are gathered into
+    // one write while their frames stay pinned
+
+    int count = 0;
+
+    while(true) {
+
+      int64 intact = fs->verifyBlocks(p, run);
+
+      if(intact > 0) {
+        buffers[count].iov_base = p;
+        buffers[count].iov_len = intact;
+        count++;
+        at += intact;
+      }
+
+      if(intact < run) {
+        printfc("ERROR: Checksum mismatch in file %s at %lld\n", COLOR_RED, fileName, (long long)at);
+        writeFully(out, buffers, count);
+        return -1;
+      }
+
+      if(count == batch || at >= size || (fs->pool != NULL && at >= fetched)) break;
+
+      p = dataAt(&info, &extent, at, &available);
+
+      if(p == NULL) {
+        writeFully(out, buffers, count);
+        return -1;
+      }
+
+      run = min(available, size - at);
+
+    }
+
+    if(!writeFully(out, buffers, count)) return -1;
+
+  }
+
+  return fs->intact() ? size : -1;
+
+}
+
+int64 File::transfer(const iovec* buffers, int count, int64* at, bool write) {
+
+  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+
+  int64 len = 0;
+  for(int i = 0; i < count; i++) len += buffers[i].iov_len;
+
+  if(!write || len <= writePiece) return transferPiece(buffers, count, at, write);
+
+  // the transaction may be committed between pieces, so however much is written
+  // at once, no transaction outgrows the journal
+
+  std::vector<iovec> piece;
+
+  int buffer = 0;
+  size_t bufferOffset = 0;
+  int64 done = 0;
+
+  while(done < len) {
+
+    int64 size = 0;
+    piece.clear();
+
+    while(size < writePiece && buffer < count) {
+      size_t n = min((int64)(buffers[buffer].iov_len - bufferOffset), writePiece - size);
+      if(n > 0) piece.push_back({ (char*)buffers[buffer].iov_base + bufferOffset, n });
+      size += n;
+      bufferOffset += n;
+      if(bufferOffset == buffers[buffer].iov_len) {
+        buffer++;
+        bufferOffset = 0;
+      }
+    }
+
+    int64 n = transferPiece(piece.data(), piece.size(), at, true);
+    done += n;
+
+    if(n < size) break;
+
+  }
+
+  return done;
+
+}
+
+int64 File::transferPiece(const iovec* buffers, int count, int64* at, bool write) {
+
+  int64 len = 0;
+  for(int i = 0; i < count; i++) len += buffers[i].iov_len;
+
+  if(write) fs->limitTransaction();
+
+  // the first write that may start an inline file looks for slot blocks with room
+  if(write && *at == 0 && len <= InlineBlock::slotSize) fs->findSlotBlocks();
+
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+
+  std::shared_mutex& fileLock = fs->fileLock(directory, fileName);
+  std::shared_lock<std::shared_mutex> shared(fileLock, std::defer_lock);
+  std::unique_lock<std::shared_mutex> exclusive(fileLock, std::defer_lock);
+
+  if(write) exclusive.lock();
+  else shared.lock();
+
+  FileInfo info;
+
+  if(!load(&info)) {
+    if(write && !fs->failed) printfc("ERROR: File %s no longer exists\n", COLOR_RED, fileName);
+    return 0;
+  }
+
+  FileInfo loaded = info;
+
+  if(write) {
+    // writing past the end would expose whatever the new blocks held before
+    if(*at > (int64)info.fileSize) return 0;
+  }
+  else {
+    int64 maxAllowed = info.fileSize - *at;
+    if(len > maxAllowed) len = maxAllowed;
+  }
+
+  // a small file goes into a slot on its first write and moves out to blocks
+  // once a write takes it past the slot
+
+  if(write && len > 0 && info.fileSize == 0 && info.firstBlock == -1 && *at + len <= InlineBlock::slotSize) fs->allocateSlot(&info);
+
+  if(write && (info.flags & FILE_INLINE) && *at + len > InlineBlock::slotSize && !promote(&info)) {
+    printc("ERROR: Volume is full\n", COLOR_RED);
+    return 0;
+  }
+
+  int64 done;
+
+  if(info.flags & FILE_INLINE) done = transferInline(&info, buffers, at, len, write);
+  else if(info.flags & FILE_COMPRESSED) done = transferChunks(&info, buffers, at, len, write);
+  else done = transferBlocks(&info, buffers, at, len, write);
+
+  if(!fs->intact()) return 0;
+  if(!write) return done;
+
+  if(*at > (int64)info.fileSize) info.fileSize = *at;
+  if(at != &pos) writtenEnd = max(writtenEnd, *at);
+
+  bool changed = info.fileSize != loaded.fileSize
+    || info.flags != loaded.flags
+    || info.firstBlock != loaded.firstBlock
+    || info.lastBlock != loaded.lastBlock;
+
+  if(changed) store(&info);
 
-  return true;
+  return done;
 
 }
 
-bool Directory::deleteDirectory(const char* name) {
+void copyBuffers(const iovec* buffers, int* buffer, size_t* bufferOffset, char* p, int64 len, bool write) {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
-  }
+  // one run of file data is spread over as many buffers as it covers
 
-  DirectoryBlock* block;
-  int index;
-  FileInfo* fileInfo = getFileInfo(name, 'D', &block, &index);
+  for(int64 copied = 0; copied < len;) {
 
-  if(fileInfo == NULL) {
-    printfc("Cannot delete directory %s because it does not even exist\n", COLOR_RED, name);
-    return false;
-  }
+    while(*bufferOffset == buffers[*buffer].iov_len) {
+      (*buffer)++;
+      *bufferOffset = 0;
+    }
 
-  DirectoryBlock* dirToDelete = fs->getDirectoryBlock(fileInfo->firstBlock);
-  if(dirToDelete->fileCount != 0) {
-    printfc("Cannot delete directory %s because it is not empty\n", COLOR_RED, name);
-    return false;
-  }
+    int64 n = min(len - copied, (int64)(buffers[*buffer].iov_len - *bufferOffset));
+    char* data = (char*)buffers[*buffer].iov_base + *bufferOffset;
 
-  fs->deallocateBlock(fileInfo->firstBlock);
-  removeFileInfo(block, index);
+    if(write) memcpy(p + copied, data, n);
+    else memcpy(data, p + copied, n);
 
-  return true;
+    copied += n;
+    *bufferOffset += n;
+
+  }
 
 }
 
-bool Directory::renameDirectory(const char* name, const char* newName) {
+int64 File::transferBlocks(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write) {
 
-  if(strlen(name) > 31) {
-    printfc("Maximum length of name is 31 character (%s)\n", COLOR_RED, name);
-    return false;
-  }
+  if(write) reserve(info, *at + len);
 
-  if(strlen(newName) > 31) {
-    printfc("Cannot rename, maximum length of name is 31 character (%s)\n", COLOR_RED, newName);
-    return false;
-  }
+  // the extent is kept per call so positional calls can share the handle
+  Extent extent;
+  extent.blockCount = 0;
 
-  DirectoryBlock* block;
-  int index;
-  FileInfo* fileInfo = getFileInfo(name, 'D', &block, &index);
+  int64 done = 0;
+  int64 fetched = *at;
 
-  if(fileInfo == NULL) {
-    printfc("Cannot rename directory %s because it does not exist\n", COLOR_RED, name);
-    return false;
-  }
+  int buffer = 0;
+  size_t bufferOffset = 0;
 
-  bool exist = directoryExist(newName);
-  if(exist) {
-    printfc("Cannot rename directory %s to %s because directory with new name already exist\n", COLOR_RED, name, newName);
-    return false;
-  }
+  while(done < len) {
 
-  FileInfo temp = *fileInfo;
-  strcpy(temp.fileName, newName);
+    PinScope pins;
 
-  removeFileInfo(block, index);
-  fileInfo = addFileInfo(newName, 'D');
-  *fileInfo = temp;
+    // blocks of a disk-backed volume are read ahead in batches
+    if(!write && fs->pool != NULL && *at >= fetched) fetched = fetchAhead(info, &extent, *at, len - done);
 
-  return true;
+    int64 available;
+    char* p = dataAt(info, &extent, *at, &available);
 
-}
+    if(p == NULL) {
+      if(write) printc("ERROR: Volume is full\n", COLOR_RED);
+      break;
+    }
 
-int compareFileInfo(FileInfo* a, FileInfo* b) {
+    int64 run = min(available, len - done);
+    bool damaged = false;
 
-  if(a->fileType != b->fileType) {
-    if(a->fileType == 'D') return -1;
-    return 1;
-  }
+    if(!write) {
+      int64 intact = fs->verifyBlocks(p, run);
+      damaged = intact < run;
+      run = intact;
+    }
 
-  return strncmp(a->fileName, b->fileName, 31);
+    copyBuffers(buffers, &buffer, &bufferOffset, p, run, write);
 
-}
+    if(write) {
+      fs->markDataDirty(p, run);
+      fs->updateChecksums(p, run);
+    }
 
-int compareWithFileInfo(const char* name, char type, FileInfo* fileInfo) {
+    *at += run;
+    done += run;
+
+    if(damaged) {
+      printfc("ERROR: Checksum mismatch in file %s at %lld\n", COLOR_RED, fileName, (long long)*at);
+      break;
+    }
 
-  if(type != fileInfo->fileType) {
-    if(type == 'D') return -1;
-    return 1;
   }
 
-  return strncmp(name, fileInfo->fileName, 31);
+  return done;
 
 }
 
-void swapFileInfo(FileInfo* a, FileInfo* b) {
-  FileInfo t = *a;
-  *a = *b;
-  *b = t;
-}
+int64 File::transferChunks(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write) {
 
-FileInfo* Directory::getFileInfo(const char* name, char type, DirectoryBlock** outBlock, int* outIndex) {
+  // chunks are worked on decompressed in the volume's chunk cache and only
+  // compressed again when they are written back
 
-  DirectoryBlock* block = this->block;
+  int64 done = 0;
 
-  while(block != NULL) {
+  int buffer = 0;
+  size_t bufferOffset = 0;
 
-    int fileCount = block->fileCount;
-    if(fileCount == 0) return NULL;
+  while(done < len) {
 
-    FileInfo* lastFile = &block->files[fileCount - 1];
-    int compare = compareWithFileInfo(name, type, lastFile);
+    PinScope pins;
 
-    if(compare <= 0) {
+    int chunk = *at / CHUNK_SIZE;
+    int offset = *at % CHUNK_SIZE;
+    int run = min((int64)(CHUNK_SIZE - offset), len - done);
 
-      if(compare == 0) {
-        if(outBlock != NULL && outIndex != NULL) {
-          *outBlock = block;
-          *outIndex = fileCount - 1;
-        }
-        return lastFile;
-      }
+    int64 chunkStart = (int64)chunk * CHUNK_SIZE;
+    bool exists = chunkStart < (int64)info->fileSize;
 
-      int left = 0;
-      int right = fileCount - 1;
+    ChunkEntry* entry = exists ? fs->chunkEntry(info, chunk) : addChunk(info, chunk);
+
+    if(entry == NULL) {
+      if(write) printc("ERROR: Volume is full\n", COLOR_RED);
+      break;
+    }
 
-      while(left <= right) {
+    std::lock_guard<std::mutex> cache(fs->chunkCacheMutex);
 
-        int middle = (left + right) / 2;
-        int compare = compareWithFileInfo(name, type, &block->files[middle]);
+    // a chunk written over as a whole is not read first
+    bool read = exists && (!write || offset > 0 || run < CHUNK_SIZE);
+    CachedChunk* cached = fs->cacheChunk(entry, read);
 
-        if(compare == 0) {
-          if(outBlock != NULL && outIndex != NULL) {
-            *outBlock = block;
-            *outIndex = middle;
-          }
-          return &block->files[middle];
-        }
+    int size = 0;
 
-        if(compare == -1) right = middle - 1;
-        else left = middle + 1;
+    if(cached != NULL && exists) {
+      size = cached->size;
+      if(read && size < min((int64)CHUNK_SIZE, (int64)info->fileSize - chunkStart)) cached = NULL;
+      size = min((int64)size, (int64)info->fileSize - chunkStart);
+    }
 
-      }
+    if(cached == NULL) {
+      printfc("ERROR: Damaged chunk in file %s at %lld\n", COLOR_RED, fileName, (long long)chunkStart);
+      break;
+    }
 
-      return NULL;
+    copyBuffers(buffers, &buffer, &bufferOffset, cached->data + offset, run, write);
 
+    if(write) {
+      cached->size = max(size, offset + run);
+      cached->dirty = true;
     }
 
-    block = fs->getDirectoryBlock(block->nextBlock);
+    *at += run;
+    done += run;
 
   }
 
-  return NULL;
+  return done;
 
 }
 
-FileInfo* Directory::addFileInfo(const char* name, char type) {
+int64 File::transferInline(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write) {
 
-  DirectoryBlock* block = this->block;
+  char* p = fs->inlineData(info) + *at;
 
-  while(block->nextBlock != -1) {
-    block = fs->getDirectoryBlock(block->nextBlock);
-  }
+  int buffer = 0;
+  size_t bufferOffset = 0;
 
-  if(block->fileCount == block->capacity) {
+  copyBuffers(buffers, &buffer, &bufferOffset, p, len, write);
+  if(write && len > 0) fs->markDirty(p, len);
 
-    int n = fs->allocateBlock();
-    DirectoryBlock* newBlock = fs->getDirectoryBlock(n);
+  *at += len;
+  return len;
 
-    block->nextBlock = n;
+}
 
-    newBlock->parentDirectory = block->parentDirectory;
-    newBlock->previousBlock = fs->blockIndex(block);
-    newBlock->nextBlock = -1;
-    newBlock->fileCount = 0;
+bool File::promote(FileInfo* info) {
 
-    block = newBlock;
+  // the data is written out through the file's own format, the slot is given
+  // back only once that worked
 
-  }
+  char data[InlineBlock::slotSize];
+  int64 size = info->fileSize;
+  memcpy(data, fs->inlineData(info), size);
 
-  FileInfo* fileInfo = &block->files[block->fileCount];
-  block->fileCount++;
+  FileInfo inlined = *info;
 
-  strcpy(fileInfo->fileName, name);
-  fileInfo->fileType = type;
-  
+  info->flags &= ~FILE_INLINE;
+  info->fileSize = 0;
+  info->firstBlock = -1;
+  info->lastBlock = -1;
 
-  FileInfo* previousFileInfo = NULL;
+  iovec buffer = { data, (size_t)size };
+  int64 at = 0;
 
-  int fileInfoIndex = block->fileCount - 1;
-  int previousFileInfoIndex;
+  int64 done;
+  if(info->flags & FILE_COMPRESSED) done = transferChunks(info, &buffer, &at, size, true);
+  else done = transferBlocks(info, &buffer, &at, size, true);
 
-  while(true) {
+  info->fileSize = done;
 
-    if(fileInfoIndex != 0) {
+  if(done < size) {
+    fs->truncateFile(info, 0);
+    *info = inlined;
+    return false;
+  }
 
-      previousFileInfoIndex = fileInfoIndex - 1;
-      previousFileInfo = &block->files[previousFileInfoIndex];
+  fs->releaseSlot(inlined.firstBlock, inlined.lastBlock);
+  return true;
 
-    }else{
+}
 
-      block = fs->getDirectoryBlock(block->previousBlock);
-      if(block == NULL) break;
+#ifdef FS_COROUTINES
 
-      previousFileInfoIndex = block->fileCount - 1;
-      previousFileInfo = &block->files[previousFileInfoIndex];
+FileOperation<int64> File::writeAsync(char* bytes, int64 len) {
+  return FileOperation<int64>(fs->executor, [this, bytes, len]() { return write(bytes, len); });
+}
 
-    }
-    
-    int compare = compareFileInfo(previousFileInfo, fileInfo);
-    
-    if(compare == -1) break;
+FileOperation<int64> File::readAsync(char* bytes, int64 len) {
+  return FileOperation<int64>(fs->executor, [this, bytes, len]() { return read(bytes, len); });
+}
 
-    swapFileInfo(previousFileInfo, fileInfo);
+#endif
 
-    fileInfo = previousFileInfo;
-    fileInfoIndex = previousFileInfoIndex;
+void File::close() {
 
-  };
+  if(!_isOpen) return;
 
-  return fileInfo;
+  if(mode == WRITE || mode == APPEND) {
 
-}
+    fs->limitTransaction();
 
-void Directory::removeFileInfo(DirectoryBlock* block, int index) {
+    std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+    std::unique_lock<std::shared_mutex> lock(fs->fileLock(directory, fileName));
+    PinScope pins;
 
-  while(block != NULL) {
+    FileInfo info;
 
-    for(int i = index; i < block->fileCount - 1; i++) {
-      block->files[i] = block->files[i + 1];
-    }
+    if(load(&info)) {
 
-    DirectoryBlock* nextBlock = fs->getDirectoryBlock(block->nextBlock);
+      // positional writes past the position are kept
+      int64 end = max(pos, writtenEnd);
 
-    if(nextBlock != NULL) {
-      block->files[block->fileCount - 1] = nextBlock->files[0];
-      index = 0;
-    }else {
-      block->fileCount--;
-      if(block->fileCount == 0) {
+      fs->truncateFile(&info, end);
 
-        DirectoryBlock* previousBlock = fs->getDirectoryBlock(block->previousBlock);
+      info.fileSize = end;
+      info.dateModified = getCurrentTime();
 
-        if(previousBlock != NULL) {
-          fs->deallocateBlock(fs->blockIndex(block));
-          previousBlock->nextBlock = -1;
-        }
+      store(&info);
 
-      }
-    }
+      // chunks written through the handle are compressed before it goes
+      if(info.flags & FILE_COMPRESSED) fs->flushChunks();
 
-    block = nextBlock;
+    }
 
   }
 
+  _isOpen = false;
+
 }
 
-// #endregion
+FileInfo* File::resolve() {
 
-// #region File
+  // entries move inside their directory when neighbours are added or removed,
+  // and moved entries leave stale copies behind, so the entry is looked up again
+  // whenever the directory changed
 
-#define FILE_BLOCK_CAPACITY FileBlock::capacity
+  // readers sharing the handle resolve it concurrently, the place is published
+  // before the version that vouches for it
+
+  uint64 current = fs->directoryVersion(directory);
+
+  if(__atomic_load_n(&version, __ATOMIC_ACQUIRE) == current) {
+    int block = __atomic_load_n(&entryBlock, __ATOMIC_RELAXED);
+    if(block != -1) return &fs->getDirectoryBlock(block)->files[__atomic_load_n(&entrySlot, __ATOMIC_RELAXED)];
+  }
+
+  Directory dir(fs, fs->getDirectoryBlock(directory));
+  FileInfo* entry = dir.getFileInfo(fileName, 'F');
+
+  int block = fs->blockIndex(entry);
+  __atomic_store_n(&entryBlock, block, __ATOMIC_RELAXED);
+  if(entry != NULL) __atomic_store_n(&entrySlot, (int)(entry - fs->getDirectoryBlock(block)->files), __ATOMIC_RELAXED);
+  __atomic_store_n(&version, current, __ATOMIC_RELEASE);
+
+  return entry;
 
-File::File() {
-  _isOpen = false;
 }
 
-File::File(FileSystem* fs, FileInfo* info, FileOpenMode mode) {
+bool File::load(FileInfo* info) {
 
-  this->fs = fs;
-  this->info = info;
-  this->mode = mode;
+  if(fs->failed) return false;
 
-  switch (mode) {
-    case READ:
-    case WRITE:
-      pos = 0;
-      break;
-    case APPEND:
-      pos = info->fileSize;
-      break;
-  }
+  std::shared_lock<std::shared_mutex> lock(fs->directoryLock(directory));
 
-  cachedFileBlock = fs->getFileBlock(info->firstBlock);
-  cachedBlockStartPos = 0;
-  cachedBlockEndPos = FILE_BLOCK_CAPACITY - 1;
+  FileInfo* entry = resolve();
+  if(entry == NULL) return false;
 
-  _isOpen = true;
+  *info = *entry;
+  return true;
 
 }
 
-bool File::isOpen() {
-  return _isOpen;
-}
+void File::store(FileInfo* info) {
 
-char* File::name() {
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
-  return info->fileName;
-}
+  std::unique_lock<std::shared_mutex> lock(fs->directoryLock(directory));
 
-int File::size() {
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
-  return info->fileSize;
-}
+  FileInfo* entry = resolve();
+  if(entry == NULL) return;
 
-void File::setPosition(int pos) {
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
-  if(pos < 0) pos = 0;
-  else if(pos > info->fileSize) pos = info->fileSize;
-  this->pos = pos;
-}
+  *entry = *info;
+  fs->markDirty(entry, sizeof(FileInfo));
 
-int File::getPosition() {
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
-  return pos;
 }
 
-void File::write(char* bytes, int len) {
+char* File::dataAt(FileInfo* info, Extent* extent, int64 pos, int64* available) {
 
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+  int logicalBlock = pos / FILE_BLOCK_CAPACITY;
 
-  int written = 0;
-  int remain = len;
+  bool cached = extent->blockCount > 0
+    && logicalBlock >= extent->logicalBlock
+    && logicalBlock < extent->logicalBlock + extent->blockCount;
 
-  while(remain != 0) {
+  while(!cached) {
 
-    int blockPos;
-    FileBlock* block = blockAt(pos, &blockPos);
+    cached = fs->findExtent(info, logicalBlock, extent);
+    if(cached) break;
 
-    int toWrite = min(FILE_BLOCK_CAPACITY - blockPos, remain);
-    char* p = &block->fileData[blockPos];
-    memcpy(p, bytes + written, toWrite);
+    // a damaged extent tree ends the read instead of the program
+    if(mode == READ) {
+      printfc("ERROR: Block of file %s at %lld does not exist\n", COLOR_RED, fileName, (long long)pos);
+      return NULL;
+    }
 
-    pos += toWrite;
-    written += toWrite;
-    remain -= toWrite;
+    if(!extend(info, 1)) return NULL;
 
   }
 
-}
-
-int File::read(char* bytes, int len) {
-
-  if(!_isOpen) { printc("ERROR: File is closed\n", COLOR_RED); exit(1); }
+  int64 start = (int64)extent->logicalBlock * FILE_BLOCK_CAPACITY;
+  int64 end = start + (int64)extent->blockCount * FILE_BLOCK_CAPACITY;
 
-  int maxAllowed = info->fileSize - pos;
-  if(len > maxAllowed) len = maxAllowed;
+  int block = extent->startBlock + (logicalBlock - extent->logicalBlock);
+  int offset = pos % FILE_BLOCK_CAPACITY;
 
-  int read = 0;
-  int remain = len;
+  // an extent is contiguous in memory unless its blocks come from the buffer pool
+  if(fs->pool != NULL) *available = FILE_BLOCK_CAPACITY - offset;
+  else *available = end - pos;
 
-  while(remain != 0) {
+  return fs->blockAt(block) + offset;
 
-    int blockPos;
-    FileBlock* block = blockAt(pos, &blockPos);
+}
 
-    int toRead = min(FILE_BLOCK_CAPACITY - blockPos, remain);
-    char* p = &block->fileData[blockPos];
-    memcpy(bytes + read, p, toRead);
+int64 File::fetchAhead(FileInfo* info, Extent* extent, int64 pos, int64 len) {
 
-    pos += toRead;
-    read += toRead;
-    remain -= toRead;
+  int logicalBlock = pos / FILE_BLOCK_CAPACITY;
 
-  }
+  bool cached = extent->blockCount > 0
+    && logicalBlock >= extent->logicalBlock
+    && logicalBlock < extent->logicalBlock + extent->blockCount;
 
-  return read;
+  if(!cached && !fs->findExtent(info, logicalBlock, extent)) return pos;
 
-}
+  int last = (pos + len - 1) / FILE_BLOCK_CAPACITY;
+  int end = min(extent->logicalBlock + extent->blockCount, last + 1);
+  int count = min(end - logicalBlock, fs->pool->readAhead());
 
-void File::close() {
+  fs->pool->fetch(extent->startBlock + (logicalBlock - extent->logicalBlock), count);
 
-  if(!_isOpen) return;
+  return (int64)(logicalBlock + count) * FILE_BLOCK_CAPACITY;
 
-  if(mode == WRITE || mode == APPEND) {
+}
 
-    int blockPos;
-    FileBlock* block = blockAt(pos, &blockPos);
+int File::allocatedBlocks(FileInfo* info) {
 
-    FileBlock* nb = fs->getFileBlock(block->nextBlock);
-    while(nb != NULL) {
-      int t = fs->blockIndex(nb);
-      nb = fs->getFileBlock(nb->nextBlock);
-      fs->deallocateBlock(t);
-    }
+  ExtentBlock* leaf = fs->getExtentBlock(info->lastBlock);
+  if(leaf == NULL || leaf->extentCount == 0) return 0;
 
-    if(blockPos == 0) {
-      int t = fs->blockIndex(block);
-      block = fs->getFileBlock(block->previousBlock);
-      fs->deallocateBlock(t);
-    }
+  Extent* last = &leaf->extents[leaf->extentCount - 1];
+  return last->logicalBlock + last->blockCount;
 
-    if(block == NULL) info->firstBlock = -1;
-    else block->nextBlock = -1;
+}
 
-    info->lastBlock = fs->blockIndex(block);
-    info->fileSize = pos;
-    info->dateModified = getCurrentTime();
+bool File::reserve(FileInfo* info, int64 size) {
 
-  }
+  int blocks = (size + FILE_BLOCK_CAPACITY - 1) / FILE_BLOCK_CAPACITY;
+  int allocated = allocatedBlocks(info);
 
-  _isOpen = false;
+  return blocks <= allocated || extend(info, blocks - allocated);
 
 }
 
-FileBlock* File::blockAt(int pos, int* blockPos) {
+ChunkEntry* File::addChunk(FileInfo* info, int chunk) {
 
-  FileBlock* block = cachedFileBlock;
-  FileBlock* last = block != NULL ? fs->getFileBlock(block->previousBlock) : NULL;
+  // the chunk map of a compressed file grows by zeroed blocks
 
-  int blockStartPos = cachedBlockStartPos;
-  int blockEndPos = cachedBlockEndPos;
+  int mapBlock = chunk / ChunkMapBlock::capacity;
+  int allocated = allocatedBlocks(info);
 
-  while(true) {
+  if(mapBlock >= allocated) {
 
-    if(block == NULL) {
+    if(!extend(info, mapBlock + 1 - allocated)) return NULL;
 
-      if(mode == READ) {
-        printfc("FATAL ERROR: FILE READ BLOCK AT %d DOES NOT EXIST\n", COLOR_RED, pos);
-        exit(1);
-      }
+    for(int i = allocated; i <= mapBlock; i++) {
+      Extent extent;
+      fs->findExtent(info, i, &extent);
+      char* p = fs->blockAt(extent.startBlock + (i - extent.logicalBlock));
+      memset(p, 0, BLOCK_SIZE);
+      fs->markDirty(p, BLOCK_SIZE);
+    }
+
+  }
 
-      int n = fs->allocateBlock();
-      FileBlock* newBlock = fs->getFileBlock(n);
+  return fs->chunkEntry(info, chunk);
 
-      if(last == NULL) info->firstBlock = n;
-      else last->nextBlock = n;
+}
 
-      newBlock->previousBlock = fs->blockIndex(last);
-      newBlock->nextBlock = -1;
+bool File::extend(FileInfo* info, int blocks) {
 
-      info->lastBlock = n;
-      info->fileSize = pos;
+  while(blocks > 0) {
 
-      block = newBlock;
-      
-    }
+    ExtentBlock* leaf = fs->getExtentBlock(info->lastBlock);
+    Extent* last = NULL;
 
-    if(pos >= blockStartPos && pos <= blockEndPos) break;
-    
-    if(pos < blockStartPos) {
+    if(leaf != NULL && leaf->extentCount > 0) last = &leaf->extents[leaf->extentCount - 1];
 
-      blockStartPos -= FILE_BLOCK_CAPACITY;
-      blockEndPos -= FILE_BLOCK_CAPACITY;
+    int goal = last != NULL ? last->startBlock + last->blockCount : -1;
 
-      block = last;
+    int count;
+    int n = fs->allocateBlocks(blocks, &count, goal);
 
-      if(block == NULL) {
-        printc("FATAL ERROR: POS < BLOCK_START_POS && BLOCK == NULL\n", COLOR_RED);
-        exit(1);
-      }
+    if(n == -1) return false;
 
-      last = fs->getFileBlock(block->previousBlock);
+    blocks -= count;
 
-    }else if(pos > blockEndPos) {
-      
-      blockStartPos += FILE_BLOCK_CAPACITY;
-      blockEndPos += FILE_BLOCK_CAPACITY;
+    if(last != NULL && n == goal) {
+      last->blockCount += count;
+      fs->markDirty(leaf);
+      continue;
+    }
 
-      last = block;
-      block = fs->getFileBlock(block->nextBlock);
+    Extent extent;
+    extent.logicalBlock = last != NULL ? last->logicalBlock + last->blockCount : 0;
+    extent.startBlock = n;
+    extent.blockCount = count;
 
+    if(!fs->appendExtent(info, extent)) {
+      fs->deallocateBlocks(n, count);
+      return false;
     }
 
   }
 
-  cachedFileBlock = block;
-  cachedBlockStartPos = blockStartPos;
-  cachedBlockEndPos = blockEndPos;
-
-  *blockPos = pos - blockStartPos;
-  return block;
+  return true;
 
 }
 
@@ -1104,19 +5815,28 @@ DirectoryIterator::DirectoryIterator() {
   _hasItems = false;
 }
 
-DirectoryIterator::DirectoryIterator(FileSystem* fs, DirectoryBlock* block, const char* path) {
+DirectoryIterator::DirectoryIterator(FileSystem* fs, DirectoryBlock* root, const char* path) {
   
   this->fs = fs;
-  this->block = block;
+  this->directory = fs->blockIndex(root);
   this->path.set(path);
 
-  if(block->fileCount == 0) {
+  DirectoryBlock* leaf = root;
+
+  while(leaf->depth > 0) {
+    leaf = fs->getDirectoryBlock(((DirectoryIndexBlock*)leaf)->keys[0].childBlock);
+  }
+
+  this->block = fs->blockIndex(leaf);
+
+  if(leaf->fileCount == 0) {
     _hasItems = false;
     return;
   }
 
-  fileInfo = &block->files[0];
+  current = leaf->files[0];
   index = 0;
+  version = fs->directoryVersion(directory);
   _hasItems = true;
 
 }
@@ -1126,23 +5846,23 @@ char* DirectoryIterator::directoryPath() {
 }
 
 char* DirectoryIterator::name() {
-  return fileInfo->fileName;
+  return current.fileName;
 }
 
 char DirectoryIterator::type() {
-  return fileInfo->fileType;
+  return current.fileType;
 }
 
-int DirectoryIterator::fileSize() {
-  return fileInfo->fileSize;
+uint64 DirectoryIterator::fileSize() {
+  return current.fileSize;
 }
 
 uint64 DirectoryIterator::dateCreated() {
-  return fileInfo->dateCreated;
+  return current.dateCreated;
 }
 
 uint64 DirectoryIterator::dateModified() {
-  return fileInfo->dateModified;
+  return current.dateModified;
 }
 
 bool DirectoryIterator::hasItems() {
@@ -1153,25 +5873,193 @@ void DirectoryIterator::nextItem() {
 
   if(!_hasItems) return;
 
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+  std::shared_lock<std::shared_mutex> lock(fs->directoryLock(directory));
+
+  // the directory may have changed since the last step, then the current
+  // entry is looked up again and the walk resumes after it
+
+  DirectoryBlock* leaf = fs->getDirectoryBlock(block);
+
+  if(version != fs->directoryVersion(directory)) {
+
+    version = fs->directoryVersion(directory);
+
+    Directory dir(fs, fs->getDirectoryBlock(directory));
+    DirectoryPath path;
+
+    bool found;
+    leaf = dir.findLeaf(current.fileName, current.fileType, &path);
+    index = dir.searchLeaf(leaf, current.fileName, current.fileType, &found);
+
+    if(!found) index--;
+
+  }
+
   index++;
-  if(index == block->fileCount) {
 
-    block = fs->getDirectoryBlock(block->nextBlock);
-    if(block == NULL) {
+  while(index >= (int)leaf->fileCount) {
+
+    leaf = fs->getDirectoryBlock(leaf->nextBlock);
+    if(leaf == NULL) {
       _hasItems = false;
       return;
     }
 
-    if(block->fileCount == 0) {
+    index = 0;
+
+  }
+
+  block = fs->blockIndex(leaf);
+  current = leaf->files[index];
+
+}
+
+FileView::FileView(File* file, int64 offset, int64 len) {
+
+  this->file = file;
+  this->pos = max(offset, (int64)0);
+  this->end = pos + max(len, (int64)0);
+
+  held = NULL;
+  load();
+
+}
+
+FileView::FileView(FileView&& other) : chunk(std::move(other.chunk)) {
+
+  file = other.file;
+  pos = other.pos;
+  end = other.end;
+  span = other.span;
+  spanLength = other.spanLength;
+  held = other.held;
+  _hasItems = other._hasItems;
+
+  other.held = NULL;
+  other._hasItems = false;
+
+}
+
+const char* FileView::data() {
+  return span;
+}
+
+int64 FileView::length() {
+  return spanLength;
+}
+
+bool FileView::hasItems() {
+  return _hasItems;
+}
+
+void FileView::nextItem() {
+
+  if(!_hasItems) return;
+
+  pos += spanLength;
+  load();
+
+}
+
+FileView::~FileView() {
+  release();
+}
+
+void FileView::load() {
+
+  release();
+
+  FileSystem* fs = file->fs;
+
+  std::shared_lock<std::shared_mutex> volume(fs->volumeMutex);
+  PinScope pins;
+  std::shared_lock<std::shared_mutex> lock(fs->fileLock(file->directory, file->fileName));
+
+  FileInfo info;
+  if(!file->load(&info) || pos >= min(end, (int64)info.fileSize)) {
+    _hasItems = false;
+    return;
+  }
+
+  if(info.flags & FILE_INLINE) {
+
+    char* p = fs->inlineData(&info) + pos;
+    if(fs->pool != NULL && !fs->isResident(p)) held = fs->pool->hold(fs->blockIndex(p));
+
+    span = p;
+    spanLength = min(end, (int64)info.fileSize) - pos;
+    _hasItems = true;
+    return;
+
+  }
+
+  if(info.flags & FILE_COMPRESSED) {
+
+    // spans of a compressed file point into the chunk decompressed last
+
+    if(chunk.empty()) chunk.resize(CHUNK_SIZE);
+
+    int64 chunkStart = pos / CHUNK_SIZE * CHUNK_SIZE;
+    int64 stop = min(end, (int64)info.fileSize);
+
+    ChunkEntry* entry = fs->chunkEntry(&info, pos / CHUNK_SIZE);
+
+    std::unique_lock<std::mutex> cache(fs->chunkCacheMutex);
+    CachedChunk* cached = entry != NULL ? fs->cacheChunk(entry, true) : NULL;
+    int size = cached != NULL ? cached->size : -1;
+    if(cached != NULL) memcpy(chunk.data(), cached->data, size);
+    cache.unlock();
+
+    if(size < min((int64)CHUNK_SIZE, stop - chunkStart)) {
+      printfc("ERROR: Damaged chunk in file %s at %lld\n", COLOR_RED, file->fileName, (long long)chunkStart);
       _hasItems = false;
       return;
     }
 
-    index = 0;
+    span = chunk.data() + (pos - chunkStart);
+    spanLength = min(chunkStart + CHUNK_SIZE, stop) - pos;
+    _hasItems = true;
+    return;
+
+  }
+
+  Extent extent;
+  extent.blockCount = 0;
+
+  int64 available;
+  char* p = file->dataAt(&info, &extent, pos, &available);
+
+  if(p == NULL) {
+    _hasItems = false;
+    return;
+  }
+
+  // a block of the pool stays held past the scope until the view moves on
+  if(fs->pool != NULL && !fs->isResident(p)) held = fs->pool->hold(fs->blockIndex(p));
 
+  span = p;
+  spanLength = min(available, min(end, (int64)info.fileSize) - pos);
+  _hasItems = true;
+
+  // a span ends before a damaged block and the view stops when it reaches one
+  spanLength = fs->verifyBlocks(p, spanLength);
+
+  if(spanLength == 0) {
+    printfc("ERROR: Checksum mismatch in file %s at %lld\n", COLOR_RED, file->fileName, (long long)pos);
+    release();
+    _hasItems = false;
   }
 
-  fileInfo = &block->files[index];
+}
+
+void FileView::release() {
+
+  if(held == NULL) return;
+
+  file->fs->pool->release(held);
+  held = NULL;
 
 }
 
@@ -2,14 +2,61 @@
 #pragma once
 
 #include <inttypes.h>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <unordered_map>
+#include <set>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <sys/uio.h>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <functional>
+#define FS_COROUTINES
+#endif
 
 #define KB(x) ((float)(x)/1024.0)
 #define MB(x) ((float)(x)/(1024.0*1024.0))
+#define GB(x) ((float)(x)/(1024.0*1024.0*1024.0))
 
 #define BLOCK_SIZE 4096
 
+#define FS_MAGIC 0x31534653
+#define FS_VERSION 10
+
+// older images are upgraded when they are opened, version 6 has 32-bit file
+// sizes, version 7 has no block checksums, version 8 no file flags and
+// version 9 no inline files
+#define FS_OLDEST_VERSION 6
+
+#define DEFAULT_MAX_CAPACITY (1024u * 1024 * 1024)
+#define DEFAULT_POOL_SIZE (64u * 1024 * 1024)
+
+// files created with compression on keep their data in chunks of this many bytes
+#define CHUNK_SIZE (64 * 1024)
+
+#define FILE_COMPRESSED 1
+#define FILE_INLINE 2
+
+#define JOURNAL_MAGIC 0x4C4E524A
+#define JOURNAL_COMMIT 1
+
 typedef uint32_t uint;
 typedef uint64_t uint64;
+typedef int64_t int64;
+
+// CRC32C, chained by passing the previous result
+uint crc32c(const void* data, uint64 len, uint crc = 0);
+
+// LZ4 block codec of compressed files, compressChunk returns 0 when the result would
+// not fit in capacity and decompressChunk returns -1 for damaged input
+int compressChunk(const char* in, int len, char* out, int capacity);
+int decompressChunk(const char* in, int len, char* out, int capacity);
 
 class Path {
 
@@ -46,6 +93,7 @@ class PathSeparator {
   bool hasNext();
   char* next();
   char* name();
+  char* parent();
 
   ~PathSeparator();
 
@@ -55,11 +103,13 @@ struct FileInfo {
 
   char fileName[32];
   char fileType;
+  char flags;
 
-  uint fileSize;
+  uint64 fileSize;
   uint64 dateCreated;
   uint64 dateModified;
 
+  // extent tree root and rightmost leaf of a file, first DirectoryBlock of a directory
   int firstBlock;
   int lastBlock;
 
@@ -67,44 +117,248 @@ struct FileInfo {
 
 struct FileBlock {
 
-  int previousBlock;
-  int nextBlock;
-
-  static const int capacity = BLOCK_SIZE - 8;
+  static const int capacity = BLOCK_SIZE;
   char fileData[capacity];
 
 };
 
-struct EmptyBlock {
-  int previousBlock;
-  int nextBlock;
+struct Extent {
+
+  int logicalBlock;
+
+  // in a leaf the extent covers blockCount data blocks from startBlock,
+  // in an index node startBlock is the child node and blockCount is unused
+  int startBlock;
+  int blockCount;
+
+};
+
+struct ExtentBlock {
+
+  int depth;
+  int extentCount;
+
+  static const int capacity = (BLOCK_SIZE - 8) / sizeof(Extent);
+  Extent extents[capacity];
+
+};
+
+// where a chunk of a compressed file is kept, the extents of a compressed file
+// hold an array of these instead of the data itself
+struct ChunkEntry {
+
+  // bytes of file data in the chunk, 0 while the chunk is unused
+  uint size;
+
+  // length of the compressed image, 0 when the chunk is stored as it is
+  uint compressedSize;
+
+  static const int capacity = CHUNK_SIZE / BLOCK_SIZE;
+  int blocks[capacity];
+
+};
+
+// small files share blocks of fixed slots, the entry of an inline file holds
+// the block in firstBlock and the slot in lastBlock
+struct InlineBlock {
+
+  uint usedSlots;
+
+  static const int slotCount = 16;
+  static const int slotSize = (BLOCK_SIZE - sizeof(uint)) / slotCount;
+  char slots[slotCount][slotSize];
+
+};
+
+struct ChunkMapBlock {
+
+  static const int capacity = BLOCK_SIZE / sizeof(ChunkEntry);
+  ChunkEntry chunks[capacity];
+
 };
 
 struct HeaderBlock {
 
+  uint magic;
+  uint version;
+
   uint totalBlocks;
   uint usedBlocks;
 
-  int firstEmptyBlock;
+  int bitmapBlock;
+  int bitmapBlocks;
+  uint highWaterMark;
+
+  int journalBlock;
+  int journalBlocks;
+
+  // table with the CRC32C of every block the bitmap covers, 0 without checksums
+  int checksumBlock;
+
+  uint64 journalSequence;
 
 };
 
+struct JournalBlock {
+
+  uint magic;
+  uint flags;
+  uint64 sequence;
+  uint64 checksum;
+
+  int count;
+
+  // block index of every logged image that follows, -1 stands for the header
+  static const int capacity = (BLOCK_SIZE - 28) / sizeof(int);
+  int blocks[capacity];
+
+};
+
+// a directory is a B+tree rooted at its first block, the root stays in place
+// and the leaves form a sorted chain of DirectoryBlocks
+
 struct DirectoryBlock {
 
   int parentDirectory;
   int previousBlock;
   int nextBlock;
 
+  // 0 for a leaf, height above the leaves for a DirectoryIndexBlock
+  int depth;
+
   uint fileCount;
 
-  static const int capacity = (BLOCK_SIZE - 8) / sizeof(FileInfo);
+  static const int capacity = (BLOCK_SIZE - 24) / sizeof(FileInfo);
   FileInfo files[capacity];
 
 };
 
+struct FileInfoV6 {
+
+  char fileName[32];
+  char fileType;
+
+  uint fileSize;
+  uint64 dateCreated;
+  uint64 dateModified;
+
+  int firstBlock;
+  int lastBlock;
+
+};
+
+// leaf layout of version 6 images, index blocks did not change
+struct DirectoryBlockV6 {
+
+  int parentDirectory;
+  int previousBlock;
+  int nextBlock;
+  int depth;
+
+  uint fileCount;
+
+  static const int capacity = (BLOCK_SIZE - 24) / sizeof(FileInfoV6);
+  FileInfoV6 files[capacity];
+
+};
+
+struct DirectoryKey {
+
+  // smallest entry in the subtree of childBlock
+  char fileName[32];
+  char fileType;
+
+  int childBlock;
+
+};
+
+struct DirectoryIndexBlock {
+
+  int parentDirectory;
+  int previousBlock;
+  int nextBlock;
+  int depth;
+
+  uint keyCount;
+
+  static const int capacity = (BLOCK_SIZE - 20) / sizeof(DirectoryKey);
+  DirectoryKey keys[capacity];
+
+};
+
+struct DirectoryPath {
+
+  // block and child slot at every level from the root down to a leaf
+  static const int capacity = 16;
+  int nodes[capacity];
+  int slots[capacity];
+  int length;
+
+};
+
+struct alignas(64) AllocationCache {
+
+  // a run of free blocks set aside for one thread and the blocks it freed lately,
+  // both stay marked used in the bitmap until the cache drains, freed blocks are
+  // never handed out again before the transaction freeing them is durable
+  static const int batch = 64;
+  static const int capacity = 32;
+
+  bool busy;
+  int next;
+  int end;
+  int held;
+
+  int freedCount;
+  int freedStart[capacity];
+  int freedBlocks[capacity];
+
+};
+
+struct BlockRun {
+  int start;
+  int count;
+};
+
+struct CachedChunk {
+
+  // chunk map entry of the chunk as block * ChunkMapBlock::capacity + slot, -1 while free
+  int64 key;
+  int size;
+  bool dirty;
+  uint64 used;
+  char* data;
+
+};
+
+struct BufferFrame {
+
+  // block held by the frame, -1 while the frame is free
+  int block;
+  int pins;
+
+  // set on every pin and cleared as the clock hand passes
+  bool referenced;
+  bool loading;
+
+};
+
+struct IoRequest {
+
+  char* buffer;
+  uint64 offset;
+  int len;
+  bool write;
+
+};
+
 class FileSystem;
 class Directory;
+class DirectoryHash;
+class BufferPool;
+class IoEngine;
 class File;
+class FileView;
 class DirectoryIterator;
 class PathSeparator;
 
@@ -112,28 +366,305 @@ enum FileOpenMode {
   WRITE, READ, APPEND
 };
 
+#ifdef FS_COROUTINES
+
+template<typename T>
+struct TaskResult {
+  T value;
+  void return_value(T value) { this->value = std::move(value); }
+  T result() { return std::move(value); }
+};
+
+template<>
+struct TaskResult<void> {
+  void return_void() {}
+  void result() {}
+};
+
+// coroutine that starts when awaited and resumes the awaiting coroutine once it returns,
+// a detached task starts right away and frees itself when done
+template<typename T = void>
+class Task {
+
+  public:
+
+  struct promise_type : TaskResult<T> {
+
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+        promise_type& promise = handle.promise();
+        std::coroutine_handle<> next = promise.continuation ? promise.continuation : std::noop_coroutine();
+        if(promise.detached) handle.destroy();
+        return next;
+      }
+      void await_resume() noexcept {}
+    };
+
+    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_always initial_suspend() { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+
+  };
+
+  Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+  Task(const Task&) = delete;
+  ~Task() { if(handle) handle.destroy(); }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() { return handle.promise().result(); }
+
+  void detach() {
+    std::coroutine_handle<promise_type> h = handle;
+    handle = nullptr;
+    h.promise().detached = true;
+    h.resume();
+  }
+
+  private:
+
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+  std::coroutine_handle<promise_type> handle;
+
+};
+
+// runs the blocking part of awaited file operations on its threads, the awaiting
+// coroutines are resumed by whichever thread polls the executor
+class Executor {
+
+  private:
+
+  struct Job {
+    std::function<void()> work;
+    std::coroutine_handle<> handle;
+  };
+
+  std::vector<std::thread> threads;
+  std::deque<Job> jobs;
+  std::deque<std::coroutine_handle<>> finished;
+  std::mutex mutex;
+  std::condition_variable jobQueued;
+  bool stopping;
+  int inFlight;
+  int event;
+
+  public:
+
+  Executor(int threadCount = 8);
+
+  void submit(std::function<void()> work, std::coroutine_handle<> handle);
+
+  // readable while finished operations wait to be resumed, for polling next to other descriptors
+  int fd();
+
+  // resumes the coroutines of finished operations and returns how many were resumed
+  int poll();
+
+  // polls until no operation is left in flight
+  void run();
+
+  int pending();
+
+  ~Executor();
+
+  private:
+  void work();
+
+};
+
+// awaitable file operation, performed inline when no executor is attached to the volume
+template<typename T>
+class FileOperation {
+
+  private:
+  Executor* executor;
+  std::function<T()> operation;
+  T result;
+
+  public:
+
+  FileOperation(Executor* executor, std::function<T()> operation) : executor(executor), operation(std::move(operation)), result() {}
+
+  bool await_ready() {
+    if(executor != NULL) return false;
+    result = operation();
+    return true;
+  }
+  void await_suspend(std::coroutine_handle<> handle) {
+    executor->submit([this]() { result = operation(); }, handle);
+  }
+  T await_resume() { return std::move(result); }
+
+};
+
+#endif
+
 class FileSystem {
 
   friend Directory;
+  friend DirectoryHash;
+  friend BufferPool;
   friend File;
+  friend FileView;
   friend DirectoryIterator;
 
   private:
   static const int headerSize = sizeof(HeaderBlock);
 
-  uint32_t capacity;
+  uint64 capacity;
+  uint64 maxCapacity;
   char* memory;
 
-  PathSeparator ps;
+  // address space reserved for the volume to grow into
+  uint64 reserved;
+
+  // backing image of a memory-mapped volume, -1 when the image lives in heap memory
+  int fd;
+  bool mapped;
+
+  // a disk-backed volume keeps only the header and the blocks below residentBlocks
+  // in memory, every other block is read into the buffer pool on demand
+  BufferPool* pool;
+  uint64 poolSize;
+
+  // volumes formatted afterwards keep block checksums
+  bool checksums;
+
+  // files created afterwards are compressed
+  bool compression;
+
+  int residentBlocks;
+
+  // block I/O of a disk-backed volume, writes are queued until the image is synced
+  IoEngine* io;
+  std::vector<IoRequest> queuedWrites;
+
+  // dirty tracking covers the whole reservation so it never moves when the volume grows
+  uint64* dirtyBlocks;
+  uint64* pendingBlocks;
+  uint64* journaledBlocks;
+  uint64* flushBlocks;
+
+  // blocks marked pending since the last transaction was prepared
+  int pendingCount;
+
+  // set when a block cannot be read or kept in memory, every later operation and
+  // commit is refused so the image stays as it was at the last commit
+  bool failed;
+  bool headerDirty;
+  bool headerPending;
+
+  int journalHead;
+  uint64 journalSequence;
+
+  std::mutex journalMutex;
+  std::condition_variable journalCommitted;
+  bool committing;
+  uint64 runningTransaction;
+  uint64 durableTransaction;
+
+  // bit per bitmap word that still has a free block
+  uint64* freeSummary;
+  int allocationHint;
+
+  // held only while blocks are taken from or returned to the bitmap
+  std::mutex allocatorMutex;
+
+  // blocks freed since the last transaction, and blocks the transaction being
+  // written gives back, which stay marked used in memory until it is durable
+  std::vector<BlockRun> freedRuns;
+  std::vector<BlockRun> releasingRuns;
+  int deferredBlocks;
+
+  // decompressed chunks of compressed files, compressed again when they leave the
+  // cache, when a file written to is closed and before every transaction
+  static const int chunkCacheSize = 8;
+  CachedChunk chunkCache[chunkCacheSize];
+  char* chunkPacked;
+  uint64 chunkCacheTick;
+  std::mutex chunkCacheMutex;
+
+  // blocks of inline files with a free slot, looked for again by the first write
+  // after mounting that may go into a slot
+  std::set<int> inlineBlocks;
+  std::mutex inlineMutex;
+  bool slotBlocksFound;
+
+  // threads allocate from their own cache slot without taking the allocator lock
+  static const int allocationCacheCount = 64;
+  AllocationCache allocationCaches[allocationCacheCount];
+
+  // name lookup tables of large directories by root block, built on first lookup
+  std::unordered_map<int, DirectoryHash*> directoryHashes;
+  std::mutex directoryHashMutex;
+
+  // directory block of every recently resolved path prefix
+  static const int pathCacheCapacity = 4096;
+  std::unordered_map<std::string, int> pathCache;
+  uint64 pathCacheHits;
+  uint64 pathCacheMisses;
+  std::mutex pathCacheMutex;
+
+  // shared by every operation, exclusive for format, commit snapshots, checkpoints
+  // and changes to the directory tree
+  std::shared_mutex volumeMutex;
+
+  // directories are locked by their root block and files by directory and name,
+  // both through fixed tables of stripes
+  static const int lockStripes = 256;
+  std::shared_mutex directoryLocks[lockStripes];
+  std::shared_mutex fileLocks[lockStripes];
+
+  // bumped whenever entries move inside a directory of the stripe, a remembered
+  // place of an entry is only trusted while the version is unchanged
+  uint64 directoryVersions[lockStripes];
+
+  #ifdef FS_COROUTINES
+  Executor* executor;
+  #endif
   
   public:
 
   FileSystem();
 
-  void create(uint32_t capacity);
+  void create(uint64 capacity);
   bool load(const char* file);
   void save(const char* file);
 
+  // the kernel writes pages of a mapped image back whenever it likes, changed
+  // metadata can reach the image before its journal transaction and a crash may
+  // leave the volume inconsistent, only disk-backed volumes are crash safe
+  bool map(const char* file);
+  bool createMapped(const char* file, uint64 capacity);
+
+  bool openDisk(const char* file);
+  bool createDisk(const char* file, uint64 capacity);
+
+  // memory given to the buffer pool of disk-backed volumes opened afterwards
+  void setPoolSize(uint64 poolSize);
+
+  // whether volumes formatted afterwards checksum every data block
+  void setChecksums(bool checksums);
+
+  // whether files created afterwards store their data compressed
+  void setCompression(bool compression);
+
+  // upper bound for growing a full volume, the address space for it is reserved
+  // when a volume is created or mapped
+  void setMaxCapacity(uint64 maxCapacity);
+
+  bool commit();
+  bool checkpoint();
+
   void format();
 
   bool directoryExist(const char* path);
@@ -144,6 +675,13 @@ class FileSystem {
   bool fileExist(const char* path);
   File openFile(const char* path, FileOpenMode mode);
 
+  #ifdef FS_COROUTINES
+  // async operations of the volume and its files run on the executor, which must
+  // outlive every operation in flight
+  void setExecutor(Executor* executor);
+  FileOperation<File> openFileAsync(const char* path, FileOpenMode mode);
+  #endif
+
   bool renameDirectory(const char* path, const char* name);
   bool deleteDirectory(const char* path);
   bool renameFile(const char* path, const char* name);
@@ -153,21 +691,120 @@ class FileSystem {
   int usedBlocks();
   int freeBlocks();
 
+  uint64 pathCacheHitCount();
+  uint64 pathCacheMissCount();
+
   ~FileSystem();
 
   private:
 
-  Directory locateParentDirectory(const char* path);
+  Directory locateParentDirectory(const char* path, PathSeparator* ps);
+  void invalidatePathCache(const char* path);
+
+  std::shared_mutex& directoryLock(int root);
+  uint64& directoryVersion(int root);
+  std::shared_mutex& fileLock(int directory, const char* name);
 
   Directory openRootDirectory();
 
+  bool mount();
+  bool upgrade();
+  bool upgradeDirectory(int root, std::vector<int>* directories);
+  void upgradeEntries(int root, std::vector<int>* directories);
+  void release();
+  void releaseDirectoryHash(int root);
+  void releaseDirectoryHashes();
+  bool reserve(uint64 capacity);
+  bool openPool();
+  bool loadResident(bool read);
+  bool isResident(void* p);
+  bool evictBlock(int i, char* data);
+  bool grow();
+  bool isBackingFile(const char* file);
+
+  void initDirtyTracking();
+  void markDirty(void* p, int len = 1);
+  void markDataDirty(void* p, int64 len);
+  void clearDirty();
+  int dirtyWords();
+
+  bool writeRange(uint64 offset, uint64 len);
+  bool syncImage();
+  bool writeBack();
+
+  void acquireJournal();
+  void releaseJournal();
+  bool writeCheckpoint();
+  void limitTransaction();
+  void fail();
+  bool intact();
+  bool writeTransaction();
+  bool logTransaction(int* end);
+  bool prepareTransaction(int* end);
+  bool flushTransaction(int end);
+  bool drainJournal();
+  bool resetJournal();
+  void replayJournal();
+
+  void initAllocator();
+
   int allocateBlock();
+  int allocateBlocks(int wanted, int* count, int goal);
   void deallocateBlock(int i);
+  void deallocateBlocks(int i, int count);
+  void releaseBlocks(int i, int count);
+  void applyFreedBlocks();
+  void holdReleasedBlocks(bool hold);
+  int freedBlocks();
+
+  int takeBlocks(int wanted, int* count, int goal);
+  int findRun(int wanted, int* count, int goal);
+  AllocationCache* lockAllocationCache();
+  void unlockAllocationCache(AllocationCache* cache);
+  bool drainAllocationCaches(bool wait);
+  void resetAllocationCaches();
+  int cachedBlocks();
+
+  int findFreeBlock(int from);
+  int freeRunLength(int start, int limit);
+  void setBlocksUsed(int i, int count, bool used);
+  void raiseHighWaterMark(int end);
+  uint64 bitmapBits(int w);
+  uint64* bitmapWord(int w);
+
+  uint* checksumAt(int i);
+  int64 verifyBlocks(char* p, int64 len);
+  void updateChecksums(char* p, int64 len);
+
+  bool findExtent(FileInfo* info, int logicalBlock, Extent* out);
+  bool appendExtent(FileInfo* info, Extent extent);
+  void truncateExtents(ExtentBlock* node, int keep);
+  void releaseExtents(ExtentBlock* node);
+  void truncateFile(FileInfo* info, uint64 size);
+
+  ChunkEntry* chunkEntry(FileInfo* info, int chunk);
+  int chunkBlocks(ChunkEntry* entry);
+  int loadChunk(ChunkEntry* entry, char* data, char* packed);
+  bool storeChunk(ChunkEntry* entry, char* data, int size, char* packed);
+  CachedChunk* cacheChunk(ChunkEntry* entry, bool read);
+  int64 chunkKey(ChunkEntry* entry);
+  bool writeChunk(CachedChunk* chunk);
+  bool flushChunks();
+  void dropChunk(ChunkEntry* entry);
+  void resetChunkCache();
+  int truncateChunks(FileInfo* info, uint64 size);
+
+  char* inlineData(FileInfo* info);
+  bool allocateSlot(FileInfo* info);
+  void releaseSlot(int block, int slot);
+  void findSlotBlocks();
 
   HeaderBlock* getHeaderBlock();
   DirectoryBlock* getDirectoryBlock(int i);
+  DirectoryIndexBlock* getDirectoryIndexBlock(int i);
   FileBlock* getFileBlock(int i);
-  EmptyBlock* getEmptyBlock(int i);
+  JournalBlock* getJournalBlock(int i);
+  ExtentBlock* getExtentBlock(int i);
 
   char* blockAt(int i);
   int blockIndex(void* p);
@@ -176,6 +813,10 @@ class FileSystem {
 
 class Directory {
 
+  friend FileSystem;
+  friend File;
+  friend DirectoryIterator;
+
   private:
   FileSystem* fs;
   DirectoryBlock* block;
@@ -204,46 +845,305 @@ class Directory {
 
   private:
 
-  FileInfo* getFileInfo(const char* name, char type, DirectoryBlock** outBlock, int* outIndex);
+  FileInfo* getFileInfo(const char* name, char type);
   FileInfo* addFileInfo(const char* name, char type);
-  void removeFileInfo(DirectoryBlock* block, int index);
+  void removeFileInfo(const char* name, char type);
+
+  DirectoryBlock* findLeaf(const char* name, char type, DirectoryPath* path);
+  int searchLeaf(DirectoryBlock* leaf, const char* name, char type, bool* found);
+  int searchIndex(DirectoryIndexBlock* node, const char* name, char type);
+  bool isFull(DirectoryBlock* node);
+
+  DirectoryHash* hashIndex(bool build);
+  void indexEntries(DirectoryHash* hash, DirectoryBlock* leaf, int from);
+  void unindexEntries(DirectoryHash* hash, DirectoryBlock* leaf, int from);
+
+};
+
+class DirectoryHash {
+
+  private:
+
+  struct Entry {
+    uint hash;
+    int block;
+    int slot;
+  };
+
+  FileSystem* fs;
+  Entry* entries;
+  int capacity;
+  int count;
+
+  public:
+
+  DirectoryHash(FileSystem* fs);
+
+  FileInfo* find(const char* name, char type);
+  void insert(FileInfo* fileInfo);
+  void remove(FileInfo* fileInfo);
+
+  ~DirectoryHash();
+
+  private:
+
+  int locate(const char* name, char type, uint hash);
+  void resize(int newCapacity);
+
+};
+
+class BufferPool {
+
+  private:
+
+  static const int maxChunks = 32;
+
+  FileSystem* fs;
+
+  // frames are added a chunk at a time when every frame is pinned or holds
+  // metadata that has to stay until the next checkpoint
+  int chunkFrames;
+  int chunkCount;
+  char* chunks[maxChunks];
+  BufferFrame* frames[maxChunks];
+
+  std::unordered_map<int, int> table;
+  int hand;
+  int window;
+
+  // chunks the pool had after the last checkpoint
+  int baseChunks;
+
+  std::mutex mutex;
+  std::condition_variable loaded;
+
+  public:
+
+  BufferPool(FileSystem* fs, int frames);
+
+  char* pin(int block);
+  void fetch(int block, int count);
+  int blockOf(void* p);
+  char* hold(int block);
+  void release(char* data);
+  void clear();
+
+  // most blocks fetched in one batch
+  int readAhead();
+
+  // whether chunks were added since the last checkpoint, and giving them back
+  bool overgrown();
+  void trim();
+  int frameCount();
+
+  static void unpinTo(size_t mark);
+
+  ~BufferPool();
+
+  private:
+
+  int frameOf(void* p);
+  BufferFrame* frameAt(int f);
+  char* dataAt(int f);
+  int evict();
+  bool addChunk();
+
+};
+
+// runs batches of block reads and writes through an io_uring, or through
+// a pool of threads doing pread and pwrite where io_uring is not available
+class IoEngine {
+
+  private:
+
+  static const int depth = 256;
+
+  int fd;
+
+  int ring;
+  char* submissionRing;
+  char* completionRing;
+  uint64 submissionRingSize;
+  uint64 completionRingSize;
+  void* entries;
+  uint* submissionHead;
+  uint* submissionTail;
+  uint* submissionMask;
+  uint* submissionArray;
+  uint* completionHead;
+  uint* completionTail;
+  uint* completionMask;
+  void* completions;
+  std::mutex ringMutex;
+
+  struct Task {
+    IoRequest* request;
+    int* remaining;
+    bool* ok;
+  };
+
+  std::vector<std::thread> workers;
+  std::deque<Task> tasks;
+  std::mutex taskMutex;
+  std::condition_variable taskQueued;
+  std::condition_variable taskDone;
+  bool stopping;
+
+  public:
+
+  IoEngine(int fd, bool useRing = true);
+
+  bool submit(IoRequest* requests, int count);
+  bool usesRing();
+
+  ~IoEngine();
+
+  private:
+
+  bool openRing();
+  void closeRing();
+  bool enterRing(IoRequest* requests, int count, iovec* vectors, int* next, int* inflight);
+  bool submitRing(IoRequest* requests, int count);
+  bool submitTasks(IoRequest* requests, int count);
+  void work();
+
+};
+
+// blocks fetched from a buffer pool stay pinned until the innermost scope
+// open at the time ends
+class PinScope {
+
+  private:
+  size_t mark;
+
+  public:
+
+  PinScope();
+  ~PinScope();
 
 };
 
 class File {
 
+  friend FileView;
+
   private:
   FileSystem* fs;
-  FileInfo* info;
+
+  // root block of the directory holding the file and the last known place of its entry
+  int directory;
+  char fileName[32];
+  int entryBlock;
+  int entrySlot;
+  uint64 version;
+
   FileOpenMode mode;
-  int pos;
+  int64 pos;
   bool _isOpen;
 
   public:
 
-  File(FileSystem* fs, FileInfo* info, FileOpenMode mode);
+  File(FileSystem* fs, int directory, FileInfo* entry, FileOpenMode mode);
   File();
 
   bool isOpen();
 
   char* name();
-  int size();
+  int64 size();
+
+  void setPosition(int64 pos);
+  int64 getPosition();
+
+  int64 write(char* bytes, int64 len);
+  int64 read(char* bytes, int64 len);
+
+  // scatter/gather at the position, each run of block data is resolved once
+  int64 writev(const iovec* buffers, int count);
+  int64 readv(const iovec* buffers, int count);
+
+  // at an offset, leaving the position alone so several readers can share the handle
+  int64 pwrite(char* bytes, int64 len, int64 offset);
+  int64 pread(char* bytes, int64 len, int64 offset);
 
-  void setPosition(int pos);
-  int getPosition();
+  // spans of file data without copying, see FileView
+  FileView view(int64 offset, int64 len);
 
-  void write(char* bytes, int len);
-  int read(char* bytes, int len);
+  // streams the whole file to a host descriptor, returns the bytes written or -1
+  int64 copyTo(int out);
+
+  #ifdef FS_COROUTINES
+  // the handle and buffer must stay valid and untouched until the operation completes
+  FileOperation<int64> writeAsync(char* bytes, int64 len);
+  FileOperation<int64> readAsync(char* bytes, int64 len);
+  #endif
 
   void close();
 
   private:
 
-  FileBlock* cachedFileBlock;
-  int cachedBlockStartPos;
-  int cachedBlockEndPos;
+  // end of the furthest positional write, close keeps the file up to there
+  int64 writtenEnd;
+
+  // operations work on a copy of the entry taken under the directory lock and store it back
+  FileInfo* resolve();
+  bool load(FileInfo* info);
+  void store(FileInfo* info);
+
+  // large writes are split so each piece fits in a transaction of its own
+  static const int64 writePiece = 1024 * 1024;
+
+  int64 transfer(const iovec* buffers, int count, int64* at, bool write);
+  int64 transferPiece(const iovec* buffers, int count, int64* at, bool write);
+  int64 transferBlocks(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write);
+  int64 transferChunks(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write);
+  int64 transferInline(FileInfo* info, const iovec* buffers, int64* at, int64 len, bool write);
+  bool promote(FileInfo* info);
 
-  FileBlock* blockAt(int pos, int* blockPos);
+  char* dataAt(FileInfo* info, Extent* extent, int64 pos, int64* available);
+  int64 fetchAhead(FileInfo* info, Extent* extent, int64 pos, int64 len);
+
+  int allocatedBlocks(FileInfo* info);
+  bool reserve(FileInfo* info, int64 size);
+  bool extend(FileInfo* info, int blocks);
+  ChunkEntry* addChunk(FileInfo* info, int chunk);
+
+};
+
+// walks a byte range of a file as spans pointing straight into its blocks,
+// in memory and mapped volumes a span stays valid while the file is open and
+// unchanged, on disk-backed volumes only the current span is kept in the pool,
+// and a compressed file is viewed one decompressed chunk at a time
+class FileView {
+
+  private:
+
+  File* file;
+  int64 pos;
+  int64 end;
+  const char* span;
+  int64 spanLength;
+  char* held;
+  bool _hasItems;
+
+  std::vector<char> chunk;
+
+  public:
+
+  FileView(File* file, int64 offset, int64 len);
+  FileView(FileView&& other);
+  FileView(const FileView&) = delete;
+
+  const char* data();
+  int64 length();
+
+  bool hasItems();
+  void nextItem();
+
+  ~FileView();
+
+  private:
+  void load();
+  void release();
 
 };
 
@@ -252,21 +1152,23 @@ class DirectoryIterator {
   private:
 
   FileSystem* fs;
-  DirectoryBlock* block;
-  FileInfo* fileInfo;
+  int directory;
+  int block;
   int index;
+  uint64 version;
+  FileInfo current;
   Path path;
   bool _hasItems;
 
   public:
 
   DirectoryIterator();
-  DirectoryIterator(FileSystem* fs, DirectoryBlock* block, const char* path);
+  DirectoryIterator(FileSystem* fs, DirectoryBlock* root, const char* path);
 
   char* directoryPath();
   char* name();
   char type();
-  int fileSize();
+  uint64 fileSize();
   uint64 dateCreated();
   uint64 dateModified();
 
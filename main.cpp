@@ -2,6 +2,10 @@
 #include <iostream>
 #include <cstring>
 #include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/stat.h>
 #include "fs.h"
 #include "printc.h"
 
@@ -10,6 +14,8 @@
 
 #define streq(a, b) (strcmp(a, b) == 0)
 
+#define UPLOAD_CHUNK (1024 * 1024)
+
 class StringSplitter {
 
   private:
@@ -110,13 +116,14 @@ class Input {
 
 };
 
-std::string cap(int size) {
+std::string cap(uint64 size) {
   
   char buffer[256];
 
-  if(size < 1024) sprintf(buffer, "%d B", size);
+  if(size < 1024) sprintf(buffer, "%d B", (int)size);
   else if(size < 1024 * 1024) sprintf(buffer, "%.1f KB", KB(size));
-  else sprintf(buffer, "%.1f MB", MB(size));
+  else if(size < 1024 * 1024 * 1024) sprintf(buffer, "%.1f MB", MB(size));
+  else sprintf(buffer, "%.1f GB", GB(size));
 
   return std::string(buffer);
 
@@ -191,19 +198,15 @@ void openFile(FileSystem &fs, const char* path, const char* name) {
   File file = fs.openFile(path, READ);
   if(!file.isOpen()) return;
 
-  int len = file.size();
-  char* buffer = new char[len];
-  
-  file.read(buffer, len);
-  file.close();
-
   std::fstream out(fileName, std::ios::out | std::ios::binary);
   if(!out) return;
 
-  out.write(buffer, len);
-  out.close();
+  for(FileView view = file.view(0, file.size()); view.hasItems(); view.nextItem()) {
+    out.write(view.data(), view.length());
+  }
 
-  delete[] buffer;
+  out.close();
+  file.close();
 
   char cmdBuffer[256];
   sprintf(cmdBuffer, "explorer %s", fileName);
@@ -214,10 +217,10 @@ void openFile(FileSystem &fs, const char* path, const char* name) {
   std::fstream in(fileName, std::ios::in | std::ios::binary | std::ios::ate);
   if(!in) return;
 
-  len = in.tellg();
+  int len = in.tellg();
   in.seekg(0);
   
-  buffer = new char[len];
+  char* buffer = new char[len];
   in.read(buffer, len);
   in.close();
 
@@ -232,14 +235,138 @@ void openFile(FileSystem &fs, const char* path, const char* name) {
 
 }
 
-int main() {
+void upload(FileSystem &fs, const char* name, const char* path) {
+
+  std::fstream in(name, std::ios::in | std::ios::binary);
+  if(!in) {
+    printfc("Upload failed: file %s does not exist\n", COLOR_RED, name);
+    return;
+  }
+
+  File file = fs.openFile(path, WRITE);
+  if(!file.isOpen()) {
+    printfc("Upload failed: cannot write file %s\n", COLOR_RED, path);
+    return;
+  }
+
+  // the host file goes through one chunk buffer and is checksummed on the way
+
+  char* buffer = new char[UPLOAD_CHUNK];
+  uint hash = 0;
+  int64 size = 0;
+  bool written = true;
+
+  while(true) {
+
+    in.read(buffer, UPLOAD_CHUNK);
+    int64 n = in.gcount();
+    if(n == 0) break;
+
+    hash = crc32c(buffer, n, hash);
+
+    if(file.write(buffer, n) != n) {
+      written = false;
+      break;
+    }
+
+    size += n;
+
+  }
+
+  bool failed = in.bad();
+
+  delete[] buffer;
+  in.close();
+  file.close();
+
+  if(!written || failed) {
+    printfc("Upload failed: cannot copy %s\n", COLOR_RED, name);
+    return;
+  }
+
+  // the stored copy is checked straight from its blocks
+
+  file = fs.openFile(path, READ);
+  if(!file.isOpen()) {
+    printfc("Upload failed: cannot read file %s\n", COLOR_RED, path);
+    return;
+  }
+
+  uint stored = 0;
+
+  for(FileView view = file.view(0, size); view.hasItems(); view.nextItem()) {
+    stored = crc32c(view.data(), view.length(), stored);
+  }
+
+  int64 fileSize = file.size();
+  file.close();
+
+  if(fileSize != size || stored != hash) {
+    printc("Upload failed: data integrity check\n", COLOR_RED);
+    return;
+  }
+
+  printfc("File %s uploaded successfully to %s  ( %s, crc32c %08x )\n", COLOR_BLUE, name, path, cap(size).c_str(), hash);
+
+}
+
+void download(FileSystem &fs, const char* path, const char* target) {
+
+  File file = fs.openFile(path, READ);
+  if(!file.isOpen()) return;
+
+  int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out == -1) {
+    printfc("Download failed: cannot create %s\n", COLOR_RED, target);
+    file.close();
+    return;
+  }
+
+  int64 size = file.copyTo(out);
+  file.close();
+
+  if(close(out) != 0 || size == -1) {
+    printfc("Download failed: cannot write %s\n", COLOR_RED, target);
+    return;
+  }
+
+  printfc("File %s downloaded to %s  ( %s )\n", COLOR_BLUE, path, target, cap(size).c_str());
+
+}
+
+int main(int argc, char** argv) {
 
   // g++ main.cpp fs.cpp -o app -D USE_PRINTFC ; if($?) { ./app }
+  // ./app mapped maps the whole image into memory instead of keeping it on disk behind
+  // a buffer pool, a mapped image may be left inconsistent by a crash
+  // ./app checksums creates a new volume with block checksums, also after mapped
+  // ./app compress stores the data of files created in this session compressed
 
   FileSystem fs;
 
-  bool ok = fs.load("storage.fs");
-  if(!ok) fs.create(32 * 1024 * 1024);
+  bool disk = true;
+
+  for(int i = 1; i < argc; i++) {
+    if(streq(argv[i], "mapped")) disk = false;
+    else if(streq(argv[i], "checksums")) fs.setChecksums(true);
+    else if(streq(argv[i], "compress")) fs.setCompression(true);
+  }
+
+  // a new volume is only created when there is no image, an image that cannot be opened is left untouched
+  struct stat st;
+  if(stat("storage.fs", &st) == 0) {
+    bool ok = disk ? fs.openDisk("storage.fs") : fs.map("storage.fs");
+    if(!ok) {
+      printc("Cannot open storage.fs, refusing to start\n", COLOR_RED);
+      return 1;
+    }
+  } else if(errno == ENOENT) {
+    bool ok = disk ? fs.createDisk("storage.fs", 32 * 1024 * 1024) : fs.createMapped("storage.fs", 32 * 1024 * 1024);
+    if(!ok) fs.create(32 * 1024 * 1024);
+  } else {
+    printfc("Cannot access storage.fs, %s\n", COLOR_RED, strerror(errno));
+    return 1;
+  }
 
   Input input;
   Path currentPath;
@@ -262,9 +389,10 @@ int main() {
         int used = fs.usedBlocks();
         int free = fs.freeBlocks();
 
-        printfc("total blocks: %-5d ( %s )\n", COLOR_BLUE, total, cap(total * BLOCK_SIZE).c_str());
-        printfc("used  blocks: %-5d  %.1f %c ( %s )\n", COLOR_BLUE, used, (float)used / (float)total * 100.0, '%', cap(used * BLOCK_SIZE).c_str());
-        printfc("free  blocks: %-5d  %.1f %c ( %s )\n", COLOR_BLUE, free, (float)free / (float)total * 100.0, '%', cap(free * BLOCK_SIZE).c_str());
+        printfc("total blocks: %-5d ( %s )\n", COLOR_BLUE, total, cap((uint64)total * BLOCK_SIZE).c_str());
+        printfc("used  blocks: %-5d  %.1f %c ( %s )\n", COLOR_BLUE, used, (float)used / (float)total * 100.0, '%', cap((uint64)used * BLOCK_SIZE).c_str());
+        printfc("free  blocks: %-5d  %.1f %c ( %s )\n", COLOR_BLUE, free, (float)free / (float)total * 100.0, '%', cap((uint64)free * BLOCK_SIZE).c_str());
+        printfc("path cache:   %" PRIu64 " hits, %" PRIu64 " misses\n", COLOR_BLUE, fs.pathCacheHitCount(), fs.pathCacheMissCount());
         
       } else if(streq(cmd, "mkdir")) {
 
@@ -343,17 +471,12 @@ int main() {
         File file = fs.openFile(path.string(), READ);
         if(!file.isOpen()) continue;
 
-        int size = file.size();
-        char* buffer = new char[size + 1];
+        for(FileView view = file.view(0, file.size()); view.hasItems(); view.nextItem()) {
+          printfc("%.*s", COLOR_BLUE, (int)view.length(), view.data());
+        }
 
-        file.read(buffer, size);
         file.close();
 
-        buffer[size] = 0;
-        printfc("%s", COLOR_BLUE, buffer);
-
-        delete[] buffer;
-
       } else if(streq(cmd, "cd")) {
 
         char* name = input.next();
@@ -378,59 +501,20 @@ int main() {
 
         char* name = input.next();
 
-        std::fstream inputFile(name, std::ios::in | std::ios::binary | std::ios::ate);
-        if(!inputFile) {
-          printfc("Upload failed: file %s does not exist\n", COLOR_RED, name);
-          continue;
-        }
-
-        int inputFileSize = inputFile.tellg();
-        inputFile.seekg(0);
-
-        char* inputBytes = new char[inputFileSize];
-        inputFile.read(inputBytes, inputFileSize);
-        inputFile.close();
-
         Path path = currentPath;
         path.push(name);
 
-        File file = fs.openFile(path.string(), WRITE);
-        if(!file.isOpen()) {
-          printfc("Upload failed: cannot write file %s\n", COLOR_RED, path.string());
-          delete[] inputBytes;
-          continue;
-        }
-
-        file.write(inputBytes, inputFileSize);
-        file.close();
-
-        ///////////////////////////////
+        upload(fs, name, path.string());
 
-        file = fs.openFile(path.string(), READ);
-        if(!file.isOpen()) {
-          printfc("Upload failed: cannot read file %s\n", COLOR_RED, path.string());
-          delete[] inputBytes;
-          continue;
-        }
-
-        int fileSize = file.size();
-        if(fileSize != inputFileSize) {
-          printc("Upload failed: data integrity check\n", COLOR_RED);
-          file.close();
-          delete[] inputBytes;
-          continue;
-        }
+      } else if(streq(cmd, "download")) {
 
-        char* buffer = new char[fileSize];
-        file.read(buffer, fileSize);
-        file.close();
+        char* name = input.next();
+        char* target = input.hasNext() ? input.next() : name;
 
-        int compare = memcmp(inputBytes, buffer, fileSize);
-        if(compare == 0) printfc("File %s uploaded successfully to %s\n", COLOR_BLUE, name, path.string());
-        else printc("Upload failed: data integrity check\n", COLOR_RED);
+        Path path = currentPath;
+        path.push(name);
 
-        delete[] inputBytes;
-        delete[] buffer;
+        download(fs, path.string(), target);
 
       } else if(streq(cmd, "open")) {
         
@@ -490,6 +574,12 @@ int main() {
         bool ok = fs.parentDirectory(&parent, currentPath.string());
         if(ok) printfc("Parent dir: %s\n", COLOR_BLUE, parent.string());
 
+      } else if(streq(cmd, "sync")) {
+
+        bool ok = fs.commit();
+        if(ok) printc("Changes committed\n", COLOR_BLUE);
+        else printc("Volume has no backing image\n", COLOR_RED);
+
       } else if(streq(cmd, "danger_format")) {
         fs.format();
       } else {
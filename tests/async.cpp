@@ -0,0 +1,142 @@
+#include "internals.h"
+#include <poll.h>
+
+// files written and read back by coroutines awaiting the executor, which is
+// driven by polling its descriptor, over io_uring and over worker threads
+
+#ifdef FS_COROUTINES
+
+static std::string content(int i) {
+  std::string data(100 * 1024 + i * 7919, 0);
+  for(uint64 k = 0; k < data.size(); k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+static std::string path(int i) {
+  return "/async/f" + std::to_string(i);
+}
+
+static const int files = 12;
+static const int pieces = 5;
+
+// operations each file awaits, opening twice, every piece and one read
+static const int operations = pieces + 3;
+
+struct Outcome {
+  bool opened = false;
+  bool written = false;
+  bool read = false;
+  bool done = false;
+};
+
+static Task<> roundTrip(FileSystem* fs, int i, Outcome* outcome) {
+
+  std::string data = content(i);
+  std::string name = path(i);
+
+  File file = co_await fs->openFileAsync(name.c_str(), WRITE);
+  outcome->opened = file.isOpen();
+
+  int64 piece = data.size() / pieces + 1;
+  int64 written = 0;
+
+  for(int64 at = 0; at < (int64)data.size(); at += piece) {
+    int64 len = std::min(piece, (int64)data.size() - at);
+    written += co_await file.writeAsync(data.data() + at, len);
+  }
+
+  file.close();
+  outcome->written = written == (int64)data.size();
+
+  File reader = co_await fs->openFileAsync(name.c_str(), READ);
+  std::string back(data.size() + 100, 0);
+
+  // reading past the end stops at the end of the file
+  int64 n = co_await reader.readAsync(back.data(), back.size());
+  reader.close();
+
+  back.resize(std::max(n, (int64)0));
+  outcome->read = back == data;
+  outcome->done = true;
+
+}
+
+static void exercise(bool ring) {
+
+  unlink("async.fs");
+
+  FileSystem fs;
+  fs.setPoolSize(256 * 1024);
+  CHECK(fs.createDisk("async.fs", 64 * 1024 * 1024));
+
+  if(!ring) {
+    delete fs.io;
+    fs.io = new IoEngine(fs.fd, false);
+  }
+  CHECK(ring || !fs.io->usesRing());
+  if(ring && !fs.io->usesRing()) printf("io_uring not available, worker threads tested twice\n");
+
+  CHECK(fs.createDirectory("/async"));
+
+  Executor executor(4);
+  fs.setExecutor(&executor);
+
+  Outcome outcomes[files];
+  for(int i = 0; i < files; i++) roundTrip(&fs, i, &outcomes[i]).detach();
+
+  // every operation is in flight or waiting before anything is polled
+  CHECK(executor.pending() > 0);
+
+  // the descriptor becomes readable as operations finish, each one resumes
+  // its coroutine exactly once
+  int resumed = 0;
+  while(executor.pending() > 0) {
+    pollfd p = { executor.fd(), POLLIN, 0 };
+    if(::poll(&p, 1, 10000) != 1) break;
+    resumed += executor.poll();
+  }
+
+  CHECK(executor.pending() == 0);
+  CHECK(resumed == files * operations);
+
+  for(int i = 0; i < files; i++) {
+    CHECK(outcomes[i].opened);
+    CHECK(outcomes[i].written);
+    CHECK(outcomes[i].read);
+    CHECK(outcomes[i].done);
+  }
+
+  // nothing is left to resume
+  CHECK(executor.poll() == 0);
+
+  // the same operations run inline without an executor
+  fs.setExecutor(NULL);
+  Outcome direct;
+  roundTrip(&fs, files, &direct).detach();
+  CHECK(direct.done && direct.read);
+
+  // what the coroutines wrote is what the volume holds
+  for(int i = 0; i <= files; i++) CHECK(readFile(fs, path(i).c_str()) == content(i));
+  CHECK(fs.commit());
+
+  unlink("async.fs");
+
+}
+
+int main() {
+
+  exercise(true);
+  exercise(false);
+
+  return finish("async");
+
+}
+
+#else
+
+int main() {
+  printf("coroutines not available, async test skipped\n");
+  return finish("async");
+}
+
+#endif
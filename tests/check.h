@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../fs.h"
+
+// every test is a program that returns non-zero when a check failed
+
+static int failures = 0;
+
+#define CHECK(x) do { if(!(x)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); failures++; } } while(0)
+
+inline int finish(const char* test) {
+  if(failures == 0) printf("%s passed\n", test);
+  else printf("%s failed %d checks\n", test, failures);
+  return failures != 0;
+}
+
+inline bool writeFile(FileSystem& fs, const char* path, const std::string& data) {
+  File file = fs.openFile(path, WRITE);
+  if(!file.isOpen()) return false;
+  int64 n = file.write((char*)data.data(), data.size());
+  file.close();
+  return n == (int64)data.size();
+}
+
+inline std::string readFile(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  if(!file.isOpen()) return "<missing>";
+  std::string data(file.size(), 0);
+  if(file.read(data.data(), data.size()) != (int64)data.size()) data = "<short read>";
+  file.close();
+  return data;
+}
+
+// copies an image as it is on disk right now, as if the machine went down
+inline bool copyImage(const char* from, const char* to) {
+
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(in == -1 || out == -1) return false;
+
+  char buffer[64 * 1024];
+  ssize_t n;
+  bool ok = true;
+  while((n = read(in, buffer, sizeof(buffer))) > 0) ok = write(out, buffer, n) == n && ok;
+
+  close(in);
+  close(out);
+  return ok && n == 0;
+
+}
@@ -0,0 +1,138 @@
+#include "internals.h"
+
+// a byte flipped in a data block on disk is caught by its checksum, reads stop
+// before the damaged block and copies fail instead of passing the damage on
+
+static std::string pattern(int i, int len) {
+  std::string data(len, 0);
+  for(int k = 0; k < len; k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+static int blockOf(FileSystem& fs, const char* path, int logicalBlock) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info)) return -1;
+  Extent extent;
+  if(!fs.findExtent(&info, logicalBlock, &extent)) return -1;
+  return extent.startBlock + logicalBlock - extent.logicalBlock;
+}
+
+static bool flipByte(const char* image, int block, int at) {
+  int fd = open(image, O_RDWR);
+  uint64 offset = sizeof(HeaderBlock) + (uint64)block * BLOCK_SIZE + at;
+  char byte = 0;
+  bool ok = pread(fd, &byte, 1, offset) == 1;
+  byte ^= 0x10;
+  ok = ok && pwrite(fd, &byte, 1, offset) == 1;
+  close(fd);
+  return ok;
+}
+
+static int64 copied(File& file) {
+  int out = open("checksums.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int64 n = file.copyTo(out);
+  close(out);
+  unlink("checksums.out");
+  return n;
+}
+
+static const int damagedBlock = 5;
+
+static void damaged(FileSystem& fs, const std::string& data) {
+
+  int64 intact = (int64)damagedBlock * BLOCK_SIZE;
+
+  // a read over the damaged block stops where it starts
+  File file = fs.openFile("/data", READ);
+  std::string read(data.size(), 0);
+  CHECK(file.pread(read.data(), read.size(), 0) == intact);
+  CHECK(read.compare(0, intact, data, 0, intact) == 0);
+
+  // reads around it are not affected
+  CHECK(file.pread(read.data(), 1000, intact - 1000) == 1000);
+  CHECK(file.pread(read.data(), 1000, intact + BLOCK_SIZE) == 1000);
+  CHECK(read.compare(0, 1000, data, intact + BLOCK_SIZE, 1000) == 0);
+
+  int64 viewed = 0;
+  for(FileView view = file.view(0, data.size()); view.hasItems(); view.nextItem()) viewed += view.length();
+  CHECK(viewed == intact);
+
+  CHECK(copied(file) == -1);
+  file.close();
+
+  // the neighbour written alongside is untouched
+  CHECK(readFile(fs, "/other") == pattern(2, 3 * BLOCK_SIZE));
+
+}
+
+int main() {
+
+  std::string data = pattern(1, 12 * BLOCK_SIZE);
+
+  for(int disk = 0; disk < 2; disk++) {
+
+    unlink("checksums.fs");
+
+    int block;
+    {
+      FileSystem fs;
+      fs.setChecksums(true);
+      CHECK(fs.createDisk("checksums.fs", 16 * 1024 * 1024));
+      CHECK(writeFile(fs, "/data", data));
+      CHECK(writeFile(fs, "/other", pattern(2, 3 * BLOCK_SIZE)));
+      CHECK(fs.commit());
+      CHECK(fs.checkpoint());
+      block = blockOf(fs, "/data", damagedBlock);
+    }
+
+    CHECK(block != -1);
+
+    // undamaged, the file reads back whole
+    {
+      FileSystem fs;
+      CHECK(disk ? fs.openDisk("checksums.fs") : fs.map("checksums.fs"));
+      CHECK(readFile(fs, "/data") == data);
+    }
+
+    CHECK(flipByte("checksums.fs", block, 1234));
+
+    FileSystem fs;
+    CHECK(disk ? fs.openDisk("checksums.fs") : fs.map("checksums.fs"));
+    damaged(fs, data);
+
+    // writing the block again gives it a new checksum
+    File file = fs.openFile("/data", APPEND);
+    CHECK(file.pwrite(data.data() + damagedBlock * BLOCK_SIZE, BLOCK_SIZE, damagedBlock * BLOCK_SIZE) == BLOCK_SIZE);
+    file.close();
+    CHECK(readFile(fs, "/data") == data);
+
+  }
+
+  // a volume without checksums has nothing to check against
+  {
+    unlink("checksums.fs");
+
+    int block;
+    {
+      FileSystem fs;
+      CHECK(fs.createDisk("checksums.fs", 16 * 1024 * 1024));
+      CHECK(writeFile(fs, "/data", data));
+      CHECK(fs.commit());
+      CHECK(fs.checkpoint());
+      block = blockOf(fs, "/data", damagedBlock);
+    }
+
+    CHECK(flipByte("checksums.fs", block, 1234));
+
+    FileSystem fs;
+    CHECK(fs.openDisk("checksums.fs"));
+    std::string read = readFile(fs, "/data");
+    CHECK(read.size() == data.size() && read != data);
+  }
+
+  unlink("checksums.fs");
+
+  return finish("checksums");
+
+}
@@ -0,0 +1,169 @@
+#include "internals.h"
+#include <dlfcn.h>
+
+// chunks are LZ4 blocks, checked against hand made blocks and, where the
+// system has it, against liblz4 in both directions
+
+static std::string sample(int kind, int len, uint seed) {
+
+  std::string data(len, 0);
+  uint x = seed * 2654435761u + 1;
+
+  for(int i = 0; i < len; i++) {
+    x = x * 1103515245 + 12345;
+    if(kind == 0) data[i] = 0;
+    else if(kind == 1) data[i] = x >> 24;
+    else if(kind == 2) data[i] = "the quick brown fox jumps over the lazy dog "[i % 44] ^ (x >> 28 == 0);
+    else if(kind == 3) data[i] = (i / 300) % 7;
+    else data[i] = i % 251 < 5 ? x >> 24 : "abcabcabd"[i % 9];
+  }
+
+  return data;
+
+}
+
+static std::string compress(const std::string& data) {
+  std::string out(data.size() + data.size() / 255 + 16, 0);
+  int n = compressChunk(data.data(), data.size(), out.data(), out.size());
+  out.resize(n);
+  return out;
+}
+
+static std::string decompress(const std::string& packed, int capacity) {
+  std::string out(capacity, 0);
+  int n = decompressChunk(packed.data(), packed.size(), out.data(), capacity);
+  if(n < 0) return "<damaged>";
+  out.resize(n);
+  return out;
+}
+
+static std::string bytes(std::initializer_list<int> list) {
+  std::string data;
+  for(int b : list) data += (char)b;
+  return data;
+}
+
+// the end rules of the format, no match starts in the last 12 bytes and the
+// last 5 are literals
+static bool conforming(const std::string& packed, int len) {
+
+  const unsigned char* p = (const unsigned char*)packed.data();
+  const unsigned char* end = p + packed.size();
+  int at = 0;
+
+  while(p < end) {
+    int token = *p++;
+    int literals = token >> 4;
+    if(literals == 15) while(true) { int b = *p++; literals += b; if(b < 255) break; }
+    p += literals;
+    at += literals;
+    if(p == end) return at == len;
+    if(at + 12 > len) return false;
+    p += 2;
+    int match = token & 15;
+    if(match == 15) while(true) { int b = *p++; match += b; if(b < 255) break; }
+    at += match + 4;
+    if(at > len - 5) return false;
+  }
+
+  return false;
+
+}
+
+typedef int (*Lz4Compress)(const char*, char*, int, int);
+typedef int (*Lz4Decompress)(const char*, char*, int, int);
+
+int main() {
+
+  // roundtrips of every kind of data at sizes around the end rules
+  for(int kind = 0; kind < 5; kind++) {
+    for(int len : { 0, 1, 4, 5, 11, 12, 13, 16, 17, 100, 4095, 4096, 65535, CHUNK_SIZE }) {
+      for(uint seed = 0; seed < 3; seed++) {
+        std::string data = sample(kind, len, seed);
+        std::string packed = compress(data);
+        CHECK(packed.size() > 0);
+        CHECK(conforming(packed, len));
+        CHECK(decompress(packed, len) == data);
+      }
+    }
+  }
+
+  // data that does not compress reports that it does not fit
+  {
+    std::string data = sample(1, CHUNK_SIZE, 9);
+    std::string out(CHUNK_SIZE - BLOCK_SIZE, 0);
+    CHECK(compressChunk(data.data(), data.size(), out.data(), out.size()) == 0);
+    CHECK(compress(sample(0, CHUNK_SIZE, 0)).size() < 300);
+  }
+
+  // hand made blocks, an overlapping match and a literal count past 15
+  CHECK(decompress(bytes({ 0x44, 'a', 'b', 'c', 'd', 4, 0, 0x50, 'x', 'y', 'z', 'z', 'y' }), 64) == "abcdabcdabcdxyzzy");
+  CHECK(decompress(bytes({ 0x1F, 'z', 1, 0, 6, 0x50, '1', '2', '3', '4', '5' }), 64) == std::string(26, 'z') + "12345");
+  CHECK(decompress(bytes({ 0xF0, 5 }) + std::string(20, 'q'), 64) == std::string(20, 'q'));
+  CHECK(decompress(bytes({ 0x00 }), 64) == "");
+
+  // damaged blocks are refused without writing past the output
+  CHECK(decompress(bytes({ 0x44, 'a', 'b', 'c', 'd', 0, 0, 0x50, 'x', 'y', 'z', 'z', 'y' }), 64) == "<damaged>");
+  CHECK(decompress(bytes({ 0x44, 'a', 'b', 'c', 'd', 5, 0, 0x50, 'x', 'y', 'z', 'z', 'y' }), 64) == "<damaged>");
+  CHECK(decompress(bytes({ 0x44, 'a', 'b', 'c', 'd', 4 }), 64) == "<damaged>");
+  CHECK(decompress(bytes({ 0x50, 'a', 'b' }), 64) == "<damaged>");
+  CHECK(decompress(bytes({ 0xF0, 255, 255 }), 64) == "<damaged>");
+  CHECK(decompress(bytes({ 0x1F, 'z', 1, 0, 6, 0x50, '1', '2', '3', '4', '5' }), 20) == "<damaged>");
+
+  {
+    std::string data = sample(2, CHUNK_SIZE, 1);
+    std::string packed = compress(data);
+
+    for(uint cut = 0; cut < packed.size(); cut += 1 + cut / 16) {
+      std::string result = decompress(packed.substr(0, cut), CHUNK_SIZE);
+      CHECK(result == "<damaged>" || data.compare(0, result.size(), result) == 0);
+    }
+
+    uint x = 7;
+    for(int n = 0; n < 2000; n++) {
+      std::string damaged = packed;
+      for(int k = 0; k < 1 + n % 4; k++) {
+        x = x * 1103515245 + 12345;
+        damaged[(x >> 8) % damaged.size()] ^= 1 + (x >> 24) % 255;
+      }
+      std::string out(CHUNK_SIZE + 64, 0x55);
+      int got = decompressChunk(damaged.data(), damaged.size(), out.data(), CHUNK_SIZE);
+      CHECK(got >= -1 && got <= CHUNK_SIZE);
+      CHECK(out.compare(CHUNK_SIZE, 64, std::string(64, 0x55)) == 0);
+    }
+  }
+
+  void* lz4 = dlopen("liblz4.so.1", RTLD_NOW);
+
+  if(lz4 == NULL) {
+    printf("liblz4 not available, cross-check skipped\n");
+    return finish("codec");
+  }
+
+  Lz4Compress lz4Compress = (Lz4Compress)dlsym(lz4, "LZ4_compress_default");
+  Lz4Decompress lz4Decompress = (Lz4Decompress)dlsym(lz4, "LZ4_decompress_safe");
+  CHECK(lz4Compress != NULL && lz4Decompress != NULL);
+
+  for(int kind = 0; kind < 5 && lz4Compress != NULL && lz4Decompress != NULL; kind++) {
+    for(int len : { 0, 1, 12, 13, 17, 1000, 4096, CHUNK_SIZE }) {
+
+      std::string data = sample(kind, len, kind + len);
+
+      std::string packed = compress(data);
+      std::string out(len, 0);
+      CHECK(lz4Decompress(packed.data(), out.data(), packed.size(), len) == len && out == data);
+
+      std::string theirs(len + len / 255 + 16, 0);
+      int n = lz4Compress(data.data(), theirs.data(), len, theirs.size());
+      CHECK(n > 0);
+      theirs.resize(n);
+      CHECK(decompress(theirs, len) == data);
+
+    }
+  }
+
+  dlclose(lz4);
+
+  return finish("codec");
+
+}
@@ -0,0 +1,176 @@
+#include "check.h"
+
+// compressed files through every operation, checked against a plain copy of
+// their content, in memory, on disk and mapped
+
+static std::string text(int i, int len) {
+  std::string data;
+  while((int)data.size() < len) data += "{\"level\":\"info\",\"id\":" + std::to_string(i++ % 977) + ",\"msg\":\"request done\"}\n";
+  data.resize(len);
+  return data;
+}
+
+static std::string noise(int i, int len) {
+  std::string data(len, 0);
+  for(int k = 0; k < len; k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+static bool pwriteAt(FileSystem& fs, const char* path, std::string& model, int64 offset, const std::string& data) {
+  File file = fs.openFile(path, APPEND);
+  bool ok = file.pwrite((char*)data.data(), data.size(), offset) == (int64)data.size();
+  file.close();
+  model.replace(offset, std::min(data.size(), model.size() - offset), data);
+  return ok;
+}
+
+static std::string viewed(FileSystem& fs, const char* path, int64 offset, int64 len) {
+  std::string data;
+  File file = fs.openFile(path, READ);
+  for(FileView view = file.view(offset, len); view.hasItems(); view.nextItem()) data.append(view.data(), view.length());
+  file.close();
+  return data;
+}
+
+static std::string copied(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  int out = open("compression.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int64 n = file.copyTo(out);
+  file.close();
+  std::string data(n > 0 ? n : 0, 0);
+  if(n > 0 && pread(out, data.data(), n, 0) != n) data = "<short read>";
+  close(out);
+  unlink("compression.out");
+  return data;
+}
+
+static bool intact(FileSystem& fs, const std::string& a, const std::string& b) {
+  return readFile(fs, "/c/a") == a && readFile(fs, "/c/b") == b;
+}
+
+static void exercise(FileSystem& fs, std::string& a, std::string& b) {
+
+  int base = fs.usedBlocks();
+  CHECK(fs.createDirectory("/c"));
+
+  // compressible text takes far fewer blocks than its size, noise does not grow
+  a = text(0, 300 * 1024);
+  CHECK(writeFile(fs, "/c/a", a));
+  CHECK(readFile(fs, "/c/a") == a);
+  CHECK((fs.usedBlocks() - base) * BLOCK_SIZE < (int)a.size() / 2);
+
+  b = noise(1, 200 * 1024);
+  CHECK(writeFile(fs, "/c/b", b));
+  CHECK(readFile(fs, "/c/b") == b);
+
+  // positional writes inside a chunk, across chunk ends and up to the end of the file
+  CHECK(pwriteAt(fs, "/c/a", a, 100, noise(2, 50)));
+  CHECK(pwriteAt(fs, "/c/a", a, CHUNK_SIZE - 1000, noise(3, 3000)));
+  CHECK(pwriteAt(fs, "/c/a", a, 2 * CHUNK_SIZE, text(4, CHUNK_SIZE)));
+  CHECK(pwriteAt(fs, "/c/a", a, a.size() - 10, text(5, 5000)));
+  CHECK(readFile(fs, "/c/a") == a);
+
+  // many small appends land in the same chunks
+  {
+    File file = fs.openFile("/c/b", APPEND);
+    for(int i = 0; i < 300; i++) {
+      std::string piece = text(i, 1 + i * 7 % 900);
+      CHECK(file.write((char*)piece.data(), piece.size()) == (int64)piece.size());
+      b += piece;
+    }
+    file.close();
+  }
+  CHECK(readFile(fs, "/c/b") == b);
+
+  // rewriting the start keeps the file up to where the writes ended, cutting
+  // the last chunk in its middle
+  {
+    std::string start = text(6, 2 * CHUNK_SIZE + 1234);
+    CHECK(writeFile(fs, "/c/b", start));
+    b = start;
+  }
+  CHECK(readFile(fs, "/c/b") == b);
+
+  // views across chunks and copies to a host file
+  CHECK(viewed(fs, "/c/a", 1000, 200000) == a.substr(1000, 200000));
+  CHECK(viewed(fs, "/c/b", CHUNK_SIZE - 5, 100) == b.substr(CHUNK_SIZE - 5, 100));
+  CHECK(copied(fs, "/c/a") == a);
+  CHECK(copied(fs, "/c/b") == b);
+
+  // a deleted file gives every block back
+  CHECK(writeFile(fs, "/c/gone", text(7, 500 * 1024)));
+  CHECK(fs.deleteFile("/c/gone"));
+  CHECK(!fs.fileExist("/c/gone"));
+  CHECK(intact(fs, a, b));
+
+  int used = fs.usedBlocks();
+  CHECK(writeFile(fs, "/c/gone", text(7, 500 * 1024)));
+  CHECK(fs.deleteFile("/c/gone"));
+  CHECK(fs.usedBlocks() == used);
+
+}
+
+int main() {
+
+  for(int mode = 0; mode < 3; mode++) {
+
+    unlink("compression.fs");
+
+    std::string a;
+    std::string b;
+
+    {
+      FileSystem fs;
+      fs.setCompression(true);
+      fs.setChecksums(true);
+      fs.setPoolSize(256 * 1024);
+
+      if(mode == 0) fs.create(64 * 1024 * 1024);
+      else if(mode == 1) CHECK(fs.createDisk("compression.fs", 64 * 1024 * 1024));
+      else CHECK(fs.createMapped("compression.fs", 64 * 1024 * 1024));
+
+      exercise(fs, a, b);
+
+      if(mode == 0) continue;
+      CHECK(fs.commit());
+    }
+
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    CHECK(mode == 1 ? fs.openDisk("compression.fs") : fs.map("compression.fs"));
+    CHECK(intact(fs, a, b));
+    CHECK(copied(fs, "/c/a") == a);
+
+    if(mode != 1) continue;
+
+    // a chunk written again goes to new blocks, the committed image keeps the old
+    // ones even once the pool has written the new ones out
+    std::string before = a;
+    CHECK(pwriteAt(fs, "/c/a", a, 3 * CHUNK_SIZE + 10, noise(8, 4000)));
+    CHECK(writeFile(fs, "/c/churn", noise(9, 2 * 1024 * 1024)));
+    CHECK(copyImage("compression.fs", "compression.copy"));
+
+    {
+      FileSystem crashed;
+      CHECK(crashed.openDisk("compression.copy"));
+      std::string found = readFile(crashed, "/c/a");
+      CHECK(found == before || found == a);
+      CHECK(readFile(crashed, "/c/b") == b);
+    }
+
+    CHECK(fs.commit());
+    CHECK(copyImage("compression.fs", "compression.copy"));
+
+    FileSystem crashed;
+    CHECK(crashed.openDisk("compression.copy"));
+    CHECK(intact(crashed, a, b));
+    CHECK(readFile(crashed, "/c/churn") == noise(9, 2 * 1024 * 1024));
+
+  }
+
+  unlink("compression.fs");
+  unlink("compression.copy");
+
+  return finish("compression");
+
+}
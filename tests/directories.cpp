@@ -0,0 +1,135 @@
+#include "internals.h"
+#include <map>
+#include <algorithm>
+
+// every entry of a directory as name to type, in the order the B+tree keeps them:
+// directories before files, each by name
+static std::vector<std::pair<char, std::string>> list(FileSystem& fs, const char* path) {
+  std::vector<std::pair<char, std::string>> entries;
+  for(DirectoryIterator it = fs.directoryIterator(path); it.hasItems(); it.nextItem()) entries.push_back({ it.type(), it.name() });
+  return entries;
+}
+
+static std::vector<std::pair<char, std::string>> expected(std::map<std::string, char>& model) {
+  std::vector<std::pair<char, std::string>> entries;
+  for(auto& it : model) entries.push_back({ it.second, it.first });
+  std::stable_sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.first == 'D' && b.first != 'D'; });
+  return entries;
+}
+
+static std::string name(int i) {
+  // names share long prefixes so keys only differ near the end
+  return "entry_" + std::to_string(i * 7919 % 100000);
+}
+
+static int treeDepth(FileSystem& fs, const char* path) {
+  Directory dir = fs.openRootDirectory().openDirectory(path + 1);
+  return dir.isValid() ? dir.block->depth : -1;
+}
+
+int main() {
+
+  {
+    FileSystem fs;
+    fs.create(128 * 1024 * 1024);
+    int base = fs.usedBlocks();
+
+    CHECK(fs.createDirectory("/big"));
+    std::map<std::string, char> model;
+
+    // inserted in scattered order, every tenth entry is a directory
+    for(int i = 0; i < 6000; i++) {
+      std::string path = "/big/" + name(i);
+      if(i % 10 == 0) CHECK(fs.createDirectory(path.c_str()));
+      else CHECK(writeFile(fs, path.c_str(), name(i)));
+      model[name(i)] = i % 10 == 0 ? 'D' : 'F';
+    }
+
+    CHECK(treeDepth(fs, "/big") >= 2);
+    CHECK(list(fs, "/big") == expected(model));
+
+    for(int i = 0; i < 6000; i += 13) {
+      std::string path = "/big/" + name(i);
+      CHECK(i % 10 == 0 ? fs.directoryExist(path.c_str()) : readFile(fs, path.c_str()) == name(i));
+    }
+    CHECK(!fs.fileExist("/big/entry_missing"));
+    CHECK(!fs.directoryExist("/big/entry_1"));
+
+    // renames move keys to other leaves
+    for(int i = 1; i < 6000; i += 10) {
+      std::string path = "/big/" + name(i);
+      std::string renamed = "renamed_" + name(i);
+      CHECK(fs.renameFile(path.c_str(), renamed.c_str()));
+      model.erase(name(i));
+      model[renamed] = 'F';
+    }
+    CHECK(list(fs, "/big") == expected(model));
+    CHECK(readFile(fs, ("/big/renamed_" + name(11)).c_str()) == name(11));
+
+    // deleting merges leaves back together
+    for(int i = 0; i < 6000; i++) {
+      if(i % 3 == 0) continue;
+      std::string entry = i % 10 == 1 ? "renamed_" + name(i) : name(i);
+      std::string path = "/big/" + entry;
+      CHECK(i % 10 == 0 ? fs.deleteDirectory(path.c_str()) : fs.deleteFile(path.c_str()));
+      model.erase(entry);
+    }
+    CHECK(list(fs, "/big") == expected(model));
+
+    // an iterator survives entries being added and removed under it
+    std::string last;
+    int seen = 0;
+    for(DirectoryIterator it = fs.directoryIterator("/big"); it.hasItems(); it.nextItem()) {
+      if(it.type() != 'F') continue;
+      std::string current = it.name();
+      CHECK(last < current);
+      last = current;
+      if(seen++ % 2 == 0) {
+        CHECK(fs.deleteFile(("/big/" + current).c_str()));
+        model.erase(current);
+      }
+      std::string added = "added_" + std::to_string(seen);
+      CHECK(writeFile(fs, ("/big/" + added).c_str(), added));
+      model[added] = 'F';
+    }
+    CHECK(list(fs, "/big") == expected(model));
+
+    for(auto& it : model) {
+      std::string path = "/big/" + it.first;
+      CHECK(it.second == 'D' ? fs.deleteDirectory(path.c_str()) : fs.deleteFile(path.c_str()));
+    }
+
+    CHECK(list(fs, "/big").empty());
+    CHECK(treeDepth(fs, "/big") == 0);
+    CHECK(fs.deleteDirectory("/big"));
+    CHECK(fs.usedBlocks() == base);
+  }
+
+  // a large directory reopens from disk with leaves read through the buffer pool
+  {
+    unlink("directories.fs");
+    std::map<std::string, char> model;
+
+    {
+      FileSystem fs;
+      fs.setPoolSize(1024 * 1024);
+      CHECK(fs.createDisk("directories.fs", 64 * 1024 * 1024));
+      CHECK(fs.createDirectory("/big"));
+      for(int i = 0; i < 4000; i++) {
+        CHECK(writeFile(fs, ("/big/" + name(i)).c_str(), name(i)));
+        model[name(i)] = 'F';
+      }
+      CHECK(fs.commit());
+    }
+
+    FileSystem fs;
+    fs.setPoolSize(1024 * 1024);
+    CHECK(fs.openDisk("directories.fs"));
+    CHECK(list(fs, "/big") == expected(model));
+    for(int i = 0; i < 4000; i += 11) CHECK(readFile(fs, ("/big/" + name(i)).c_str()) == name(i));
+    unlink("directories.fs");
+  }
+
+  return finish("directories");
+
+}
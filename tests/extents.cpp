@@ -0,0 +1,132 @@
+#include "internals.h"
+
+static std::string pattern(int block) {
+  std::string data(BLOCK_SIZE, 'a' + block % 26);
+  memcpy(data.data(), &block, sizeof(block));
+  return data;
+}
+
+// writes two files a block at a time so every block of the first is an extent of its own
+static std::string fragment(FileSystem& fs, const char* path, const char* other, int blocks) {
+
+  File file = fs.openFile(path, WRITE);
+  File interleaved = fs.openFile(other, WRITE);
+  std::string model;
+
+  for(int i = 0; i < blocks; i++) {
+    std::string data = pattern(i);
+    file.write(data.data(), data.size());
+    interleaved.write(data.data(), data.size());
+    model += data;
+  }
+
+  file.close();
+  interleaved.close();
+  return model;
+
+}
+
+static ExtentBlock* extentRoot(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info)) return NULL;
+  file.close();
+  return fs.getExtentBlock(info.firstBlock);
+}
+
+int main() {
+
+  {
+    FileSystem fs;
+    fs.create(64 * 1024 * 1024);
+    int base = fs.usedBlocks();
+
+    // more extents than fit in the root make the tree grow a level
+    std::string model = fragment(fs, "/a", "/b", 1000);
+    CHECK(extentRoot(fs, "/a")->depth >= 1);
+
+    File file = fs.openFile("/a", READ);
+    CHECK(file.size() == (int64)model.size());
+
+    for(int k = 0; k < 500; k++) {
+      int64 at = rand() % model.size();
+      int64 len = rand() % (3 * BLOCK_SIZE);
+      std::string data(len, 0);
+      int64 n = file.pread(data.data(), len, at);
+      CHECK(n == std::min<int64>(len, model.size() - at));
+      CHECK(memcmp(data.data(), model.data() + at, n) == 0);
+    }
+
+    std::string viewed;
+    for(FileView view = file.view(12345, 2000000); view.hasItems(); view.nextItem()) viewed.append(view.data(), view.length());
+    CHECK(viewed == model.substr(12345, 2000000));
+    file.close();
+
+    // truncating drops the extents past the new end
+    for(int64 keep : { (int64)700 * BLOCK_SIZE + 17, (int64)300 * BLOCK_SIZE, (int64)5 }) {
+      File truncated = fs.openFile("/a", WRITE);
+      truncated.setPosition(keep);
+      truncated.close();
+      CHECK(readFile(fs, "/a") == model.substr(0, keep));
+    }
+
+    CHECK(fs.deleteFile("/a"));
+    CHECK(fs.deleteFile("/b"));
+    CHECK(fs.usedBlocks() == base);
+
+    // a missing extent ends reads early instead of the program
+    model = fragment(fs, "/c", "/d", 300);
+    ExtentBlock* root = extentRoot(fs, "/c");
+    CHECK(root->depth == 0 && root->extentCount > 100);
+
+    int count = root->extentCount;
+    root->extentCount = 100;
+    Extent* last = &root->extents[99];
+    int64 intact = (int64)(last->logicalBlock + last->blockCount) * BLOCK_SIZE;
+
+    File damaged = fs.openFile("/c", READ);
+    std::string data(model.size(), 0);
+    CHECK(damaged.pread(data.data(), data.size(), 0) == intact);
+    CHECK(memcmp(data.data(), model.data(), intact) == 0);
+
+    int64 length = 0;
+    for(FileView view = damaged.view(0, model.size()); view.hasItems(); view.nextItem()) length += view.length();
+    CHECK(length == intact);
+
+    int out = open("extents.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(damaged.copyTo(out) == -1);
+    close(out);
+    unlink("extents.out");
+    damaged.close();
+
+    root->extentCount = count;
+    CHECK(readFile(fs, "/c") == model);
+    CHECK(fs.deleteFile("/c"));
+    CHECK(fs.deleteFile("/d"));
+    CHECK(fs.usedBlocks() == base);
+  }
+
+  // fragmented files come back intact from a disk-backed volume with a small pool
+  {
+    unlink("extents.fs");
+    std::string model;
+
+    {
+      FileSystem fs;
+      fs.setPoolSize(1024 * 1024);
+      CHECK(fs.createDisk("extents.fs", 64 * 1024 * 1024));
+      model = fragment(fs, "/a", "/b", 1000);
+      CHECK(fs.commit());
+    }
+
+    FileSystem fs;
+    fs.setPoolSize(1024 * 1024);
+    CHECK(fs.openDisk("extents.fs"));
+    CHECK(readFile(fs, "/a") == model);
+    CHECK(readFile(fs, "/b") == model);
+    unlink("extents.fs");
+  }
+
+  return finish("extents");
+
+}
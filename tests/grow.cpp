@@ -0,0 +1,116 @@
+#include "internals.h"
+
+// a small volume filled past its size grows while other threads keep reading
+// and writing, in memory, mapped and on disk, and keeps its files on remount
+
+static const uint64 initial = 4 * 1024 * 1024;
+static const uint64 maximum = 64 * 1024 * 1024;
+static const int threadCount = 4;
+static const int filesPerThread = 24;
+
+static std::string content(int t, int i) {
+  std::string data(200 * 1024 + i * 4099, 0);
+  for(uint64 k = 0; k < data.size(); k++) data[k] = (char)((t * 7919 + i * 131 + k) * 2654435761u >> 24);
+  return data;
+}
+
+static std::string path(int t, int i) {
+  return "/g" + std::to_string(t) + "/f" + std::to_string(i);
+}
+
+// each thread reads back everything it wrote so far after every file, so reads
+// of blocks below the old end run while the volume grows
+static void work(FileSystem* fs, int t, int* errors) {
+
+  for(int i = 0; i < filesPerThread; i++) {
+    if(!writeFile(*fs, path(t, i).c_str(), content(t, i))) (*errors)++;
+    for(int k = 0; k <= i; k += 1 + i / 4) {
+      if(readFile(*fs, path(t, k).c_str()) != content(t, k)) (*errors)++;
+    }
+  }
+
+}
+
+static bool intact(FileSystem& fs) {
+  bool ok = true;
+  for(int t = 0; t < threadCount; t++) {
+    for(int i = 0; i < filesPerThread; i++) ok = ok && readFile(fs, path(t, i).c_str()) == content(t, i);
+  }
+  return ok;
+}
+
+static bool open(FileSystem& fs, int mode) {
+  fs.setMaxCapacity(maximum);
+  if(mode == 0) return fs.load("grow.fs");
+  if(mode == 1) return fs.map("grow.fs");
+  return fs.openDisk("grow.fs");
+}
+
+int main() {
+
+  for(int mode = 0; mode < 3; mode++) {
+
+    unlink("grow.fs");
+
+    int grown;
+
+    {
+      FileSystem fs;
+      fs.setMaxCapacity(maximum);
+      fs.setPoolSize(512 * 1024);
+
+      if(mode == 0) fs.create(initial);
+      else if(mode == 1) CHECK(fs.createMapped("grow.fs", initial));
+      else CHECK(fs.createDisk("grow.fs", initial));
+
+      int start = fs.totalBlocks();
+      for(int t = 0; t < threadCount; t++) CHECK(fs.createDirectory(("/g" + std::to_string(t)).c_str()));
+
+      int errors[threadCount] = {};
+      std::vector<std::thread> threads;
+      for(int t = 0; t < threadCount; t++) threads.emplace_back(work, &fs, t, &errors[t]);
+      for(std::thread& thread : threads) thread.join();
+
+      for(int t = 0; t < threadCount; t++) CHECK(errors[t] == 0);
+
+      grown = fs.totalBlocks();
+      CHECK(grown > 4 * start);
+      CHECK((uint64)grown * BLOCK_SIZE <= maximum);
+      CHECK(intact(fs));
+      CHECK(!fs.failed);
+
+      if(mode == 0) fs.save("grow.fs");
+      else CHECK(fs.commit());
+    }
+
+    // the image has the grown size and every file, and can grow further
+    {
+      FileSystem fs;
+      CHECK(open(fs, mode));
+      CHECK(fs.totalBlocks() == grown);
+      CHECK(intact(fs));
+
+      std::string more(fs.freeBlocks() * (int64)BLOCK_SIZE + 1024 * 1024, 'm');
+      CHECK(writeFile(fs, "/more", more));
+      CHECK(fs.totalBlocks() > grown);
+      CHECK(readFile(fs, "/more") == more);
+      CHECK(intact(fs));
+    }
+
+    // a volume at its limit refuses to grow past it
+    {
+      FileSystem fs;
+      CHECK(open(fs, mode));
+      std::string huge(maximum, 'h');
+      CHECK(!writeFile(fs, "/huge", huge));
+      CHECK((uint64)fs.totalBlocks() * BLOCK_SIZE <= maximum);
+      CHECK(intact(fs));
+    }
+
+  }
+
+  unlink("grow.fs");
+
+  return finish("grow");
+
+}
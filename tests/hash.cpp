@@ -0,0 +1,106 @@
+#include "internals.h"
+#include <atomic>
+
+static std::string name(int i) {
+  return "file_" + std::to_string(i * 7919 % 100000);
+}
+
+static DirectoryHash* hashOf(FileSystem& fs, const char* path) {
+  Directory dir = fs.openRootDirectory().openDirectory(path + 1);
+  return dir.isValid() ? dir.hashIndex(false) : NULL;
+}
+
+// the table finds an entry exactly when the directory holds it
+static bool consistent(FileSystem& fs, DirectoryHash* hash, int from, int to, bool present) {
+  for(int i = from; i < to; i++) {
+    PinScope pins;
+    FileInfo* info = hash->find(name(i).c_str(), 'F');
+    if(present != (info != NULL)) return false;
+    if(info != NULL && name(i) != info->fileName) return false;
+  }
+  return true;
+}
+
+int main() {
+
+  {
+    FileSystem fs;
+    fs.create(128 * 1024 * 1024);
+
+    // a directory within one block is searched directly
+    CHECK(fs.createDirectory("/small"));
+    for(int i = 0; i < 20; i++) CHECK(writeFile(fs, ("/small/" + name(i)).c_str(), name(i)));
+    CHECK(fs.fileExist(("/small/" + name(3)).c_str()));
+    CHECK(hashOf(fs, "/small") == NULL);
+
+    // the first lookup in a larger one builds the table
+    CHECK(fs.createDirectory("/big"));
+    for(int i = 0; i < 5000; i++) CHECK(writeFile(fs, ("/big/" + name(i)).c_str(), name(i)));
+
+    CHECK(fs.fileExist(("/big/" + name(0)).c_str()));
+    DirectoryHash* hash = hashOf(fs, "/big");
+    CHECK(hash != NULL);
+    if(hash == NULL) return finish("hash");
+
+    CHECK(hash->count == 5000);
+    CHECK(consistent(fs, hash, 0, 5000, true));
+    CHECK(consistent(fs, hash, 5000, 5100, false));
+    CHECK(hash->find(name(1).c_str(), 'D') == NULL);
+
+    // entries move between and within leaves while the table is kept up to date
+    for(int i = 5000; i < 8000; i++) CHECK(writeFile(fs, ("/big/" + name(i)).c_str(), name(i)));
+    CHECK(hash->count == 8000);
+    CHECK(consistent(fs, hash, 0, 8000, true));
+
+    for(int i = 0; i < 8000; i += 2) CHECK(fs.deleteFile(("/big/" + name(i)).c_str()));
+    CHECK(hash->count == 4000);
+    for(int i = 0; i < 8000; i++) CHECK(consistent(fs, hash, i, i + 1, i % 2 == 1));
+
+    for(int i = 1; i < 8000; i += 4) CHECK(fs.renameFile(("/big/" + name(i)).c_str(), ("renamed_" + name(i)).c_str()));
+    CHECK(hash->count == 4000);
+    for(int i = 1; i < 8000; i += 4) {
+      PinScope pins;
+      CHECK(hash->find(name(i).c_str(), 'F') == NULL);
+      CHECK(hash->find(("renamed_" + name(i)).c_str(), 'F') != NULL);
+    }
+
+    // readers repair stale slot hints concurrently
+    std::atomic<int> wrong(0);
+    std::vector<std::thread> readers;
+    for(int t = 0; t < 4; t++) readers.emplace_back([&, t]() {
+      for(int i = t; i < 8000; i++) {
+        std::string path = "/big/" + (i % 4 == 1 ? "renamed_" + name(i) : name(i));
+        if(fs.fileExist(path.c_str()) != (i % 2 == 1)) wrong++;
+      }
+    });
+    for(std::thread& reader : readers) reader.join();
+    CHECK(wrong == 0);
+
+    // the table goes away with its directory
+    for(int i = 1; i < 8000; i += 2) CHECK(fs.deleteFile(("/big/" + (i % 4 == 1 ? "renamed_" + name(i) : name(i))).c_str()));
+    CHECK(fs.deleteDirectory("/big"));
+    CHECK(fs.directoryHashes.size() == 0);
+  }
+
+  // the table is built from leaves read through a small buffer pool
+  {
+    unlink("hash.fs");
+
+    FileSystem fs;
+    fs.setPoolSize(512 * 1024);
+    CHECK(fs.createDisk("hash.fs", 64 * 1024 * 1024));
+    CHECK(fs.createDirectory("/big"));
+    for(int i = 0; i < 5000; i++) CHECK(writeFile(fs, ("/big/" + name(i)).c_str(), name(i)));
+
+    CHECK(fs.fileExist(("/big/" + name(0)).c_str()));
+    DirectoryHash* hash = hashOf(fs, "/big");
+    CHECK(hash != NULL && hash->count == 5000);
+    for(int i = 0; i < 5000; i += 3) CHECK(readFile(fs, ("/big/" + name(i)).c_str()) == name(i));
+    for(int i = 5000; i < 5100; i++) CHECK(!fs.fileExist(("/big/" + name(i)).c_str()));
+
+    unlink("hash.fs");
+  }
+
+  return finish("hash");
+
+}
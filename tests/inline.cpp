@@ -0,0 +1,85 @@
+#include "internals.h"
+
+static std::string content(int i) {
+  return std::string(1 + i * 13 % InlineBlock::slotSize, 'a' + i % 26);
+}
+
+static std::string path(int i) {
+  return "/small/f" + std::to_string(i);
+}
+
+static int slotBlockOf(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info) || !(info.flags & FILE_INLINE)) return -1;
+  return info.firstBlock;
+}
+
+static bool open(FileSystem& fs, const char* image, bool disk) {
+  return disk ? fs.openDisk(image) : fs.map(image);
+}
+
+int main() {
+
+  for(int disk = 0; disk < 2; disk++) {
+
+    unlink("inline.fs");
+
+    // 40 files fill two slot blocks and part of a third
+    int used;
+    {
+      FileSystem fs;
+      CHECK(fs.createDisk("inline.fs", 64 * 1024 * 1024));
+      CHECK(fs.createDirectory("/small"));
+      for(int i = 0; i < 40; i++) CHECK(writeFile(fs, path(i).c_str(), content(i)));
+      CHECK(slotBlockOf(fs, path(0).c_str()) != slotBlockOf(fs, path(39).c_str()));
+      used = fs.usedBlocks();
+      CHECK(fs.commit());
+    }
+
+    // the free slots of the third block are used after a remount
+    int third;
+    {
+      FileSystem fs;
+      CHECK(open(fs, "inline.fs", disk));
+      third = slotBlockOf(fs, path(39).c_str());
+      for(int i = 40; i < 48; i++) CHECK(writeFile(fs, path(i).c_str(), content(i)));
+      CHECK(slotBlockOf(fs, path(47).c_str()) == third);
+      CHECK(fs.usedBlocks() == used);
+
+      // slots freed by deleting and by growing a file past its slot
+      for(int i = 0; i < 5; i++) CHECK(fs.deleteFile(path(i).c_str()));
+      CHECK(writeFile(fs, path(5).c_str(), std::string(1000, 'z')));
+      CHECK(slotBlockOf(fs, path(5).c_str()) == -1);
+      CHECK(fs.commit());
+    }
+
+    {
+      FileSystem fs;
+      CHECK(open(fs, "inline.fs", disk));
+      int first = slotBlockOf(fs, path(6).c_str());
+      used = fs.usedBlocks();
+
+      for(int i = 48; i < 54; i++) {
+        CHECK(writeFile(fs, path(i).c_str(), content(i)));
+        CHECK(slotBlockOf(fs, path(i).c_str()) == first);
+      }
+      CHECK(fs.usedBlocks() == used);
+
+      // every block is full again, the next file starts a new one
+      CHECK(writeFile(fs, path(54).c_str(), content(54)));
+      int next = slotBlockOf(fs, path(54).c_str());
+      CHECK(next != -1 && next != first && next != third);
+      CHECK(fs.usedBlocks() == used + 1);
+
+      for(int i = 6; i < 55; i++) CHECK(readFile(fs, path(i).c_str()) == content(i));
+      CHECK(readFile(fs, path(5).c_str()) == std::string(1000, 'z'));
+    }
+
+  }
+
+  unlink("inline.fs");
+
+  return finish("inline");
+
+}
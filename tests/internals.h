@@ -0,0 +1,29 @@
+#pragma once
+
+// tests that damage or rewrite volumes reach into private members, every
+// standard header fs.h uses is included before private is redefined
+
+#include <inttypes.h>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <unordered_map>
+#include <set>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <sys/uio.h>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <functional>
+#endif
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define private public
+#include "check.h"
+#undef private
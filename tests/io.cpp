@@ -0,0 +1,93 @@
+#include "internals.h"
+
+// a batch larger than the ring depth, written and read back through the engine
+static bool roundTrip(IoEngine& engine, int salt) {
+
+  const int count = 600;
+  std::vector<char> out((uint64)count * BLOCK_SIZE), in((uint64)count * BLOCK_SIZE);
+  std::vector<IoRequest> requests(count);
+
+  for(uint64 i = 0; i < out.size(); i++) out[i] = (char)(i * 31 + salt);
+
+  // scattered offsets so no two neighbours are written by one request
+  for(int i = 0; i < count; i++) requests[i] = { &out[(uint64)i * BLOCK_SIZE], (uint64)(i * 7 % count) * BLOCK_SIZE, BLOCK_SIZE, true };
+  if(!engine.submit(requests.data(), count)) return false;
+
+  for(int i = 0; i < count; i++) requests[i] = { &in[(uint64)i * BLOCK_SIZE], (uint64)(i * 7 % count) * BLOCK_SIZE, BLOCK_SIZE, false };
+  if(!engine.submit(requests.data(), count)) return false;
+
+  return in == out;
+
+}
+
+// the ring descriptor is swapped for one io_uring_enter refuses
+static void breakRing(IoEngine& engine) {
+  int null = open("/dev/null", O_RDWR);
+  dup2(null, engine.ring);
+  close(null);
+}
+
+int main() {
+
+  int fd = open("io.img", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHECK(ftruncate(fd, 8 * 1024 * 1024) == 0);
+
+  {
+    IoEngine engine(fd, false);
+    CHECK(!engine.usesRing());
+    CHECK(roundTrip(engine, 1));
+  }
+
+  {
+    IoEngine engine(fd);
+    bool ring = engine.usesRing();
+    CHECK(roundTrip(engine, 2));
+
+    // a ring that stops working hands its batches to worker threads
+    if(ring) {
+      breakRing(engine);
+      CHECK(roundTrip(engine, 3));
+      CHECK(!engine.usesRing());
+      CHECK(roundTrip(engine, 4));
+    }else{
+      printf("io_uring not available, fallback not tested\n");
+    }
+  }
+
+  close(fd);
+  unlink("io.img");
+
+  // a disk-backed volume keeps working when its ring breaks
+  {
+    unlink("io.fs");
+
+    std::string data(3 * 1024 * 1024, 0);
+    for(uint64 i = 0; i < data.size(); i++) data[i] = 'a' + i % 23;
+
+    {
+      FileSystem fs;
+      fs.setPoolSize(256 * 1024);
+      CHECK(fs.createDisk("io.fs", 64 * 1024 * 1024));
+      CHECK(writeFile(fs, "/before", data));
+      CHECK(fs.commit());
+
+      if(fs.io->usesRing()) breakRing(*fs.io);
+
+      CHECK(readFile(fs, "/before") == data);
+      CHECK(writeFile(fs, "/after", data.substr(1000)));
+      CHECK(fs.commit());
+      CHECK(fs.checkpoint());
+      CHECK(!fs.failed);
+    }
+
+    FileSystem fs;
+    CHECK(fs.openDisk("io.fs"));
+    CHECK(readFile(fs, "/before") == data);
+    CHECK(readFile(fs, "/after") == data.substr(1000));
+
+    unlink("io.fs");
+  }
+
+  return finish("io");
+
+}
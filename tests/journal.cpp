@@ -0,0 +1,288 @@
+#include "check.h"
+
+// a crash is simulated by copying the image of a volume that is still open,
+// the copy is what the disk would hold if the machine went down right then
+
+static std::string content(int i) {
+  return "file " + std::to_string(i) + std::string(i * 37 % 900, 'a' + i % 26);
+}
+
+static HeaderBlock readHeader(const char* image) {
+  HeaderBlock header = {};
+  int fd = open(image, O_RDONLY);
+  if(pread(fd, &header, sizeof(header), 0) != sizeof(header)) header.magic = 0;
+  close(fd);
+  return header;
+}
+
+static uint64 blockOffset(int i) {
+  return sizeof(HeaderBlock) + (uint64)i * BLOCK_SIZE;
+}
+
+static std::string pattern(int i, int len) {
+  std::string data(len, 0);
+  for(int k = 0; k < len; k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+// a file is either missing or has its content, or the part of it that was committed
+static bool consistent(FileSystem& fs, const char* path, const std::string& data) {
+  if(!fs.fileExist(path)) return true;
+  std::string read = readFile(fs, path);
+  return read.size() <= data.size() && data.compare(0, read.size(), read) == 0;
+}
+
+// damages the first logged image of the transaction with the given sequence,
+// or the block number its descriptor gives for that image
+static bool tearTransaction(const char* image, uint64 sequence, bool descriptorItself = false) {
+
+  HeaderBlock header = readHeader(image);
+  int fd = open(image, O_RDWR);
+  bool found = false;
+
+  JournalBlock descriptor;
+
+  for(int p = 0; p < header.journalBlocks;) {
+
+    if(pread(fd, &descriptor, sizeof(descriptor), blockOffset(header.journalBlock + p)) != sizeof(descriptor)) break;
+    if(descriptor.magic != JOURNAL_MAGIC || descriptor.count <= 0) break;
+
+    if(descriptor.sequence == sequence) {
+      char byte;
+      uint64 offset = descriptorItself ? blockOffset(header.journalBlock + p) + offsetof(JournalBlock, blocks) : blockOffset(header.journalBlock + p + 1) + 100;
+      found = pread(fd, &byte, 1, offset) == 1;
+      byte ^= 1;
+      found = found && pwrite(fd, &byte, 1, offset) == 1;
+      break;
+    }
+
+    p += 1 + descriptor.count;
+
+  }
+
+  close(fd);
+  return found;
+
+}
+
+int main() {
+
+  unlink("journal.fs");
+
+  FileSystem fs;
+  CHECK(fs.createDisk("journal.fs", 64 * 1024 * 1024));
+
+  // first transaction
+  CHECK(fs.createDirectory("/d"));
+  for(int i = 0; i < 50; i++) CHECK(writeFile(fs, ("/d/f" + std::to_string(i)).c_str(), content(i)));
+  CHECK(writeFile(fs, "/big", std::string(200000, 'b')));
+  CHECK(fs.commit());
+
+  int usedFirst = fs.usedBlocks();
+  uint64 sequence = readHeader("journal.fs").journalSequence;
+  CHECK(copyImage("journal.fs", "first.fs"));
+
+  // second transaction
+  CHECK(writeFile(fs, "/second", "second transaction"));
+  CHECK(fs.deleteFile("/d/f0"));
+  CHECK(fs.commit());
+
+  int usedSecond = fs.usedBlocks();
+  CHECK(copyImage("journal.fs", "second.fs"));
+
+  // changes that were never committed
+  CHECK(writeFile(fs, "/late", "never committed"));
+  CHECK(copyImage("journal.fs", "late.fs"));
+  CHECK(copyImage("journal.fs", "torn.fs"));
+  CHECK(copyImage("journal.fs", "misdirected.fs"));
+
+  // both transactions are still only in the journal, the root directory in place
+  // is wiped so opening works only if the journal is replayed
+  CHECK(readHeader("second.fs").journalSequence == sequence);
+  {
+    int fd = open("second.fs", O_RDWR);
+    std::string zero(BLOCK_SIZE, 0);
+    CHECK(pwrite(fd, zero.data(), BLOCK_SIZE, blockOffset(0)) == BLOCK_SIZE);
+    close(fd);
+  }
+
+  {
+    FileSystem crashed;
+    CHECK(crashed.openDisk("first.fs"));
+    CHECK(crashed.usedBlocks() == usedFirst);
+    for(int i = 0; i < 50; i++) CHECK(readFile(crashed, ("/d/f" + std::to_string(i)).c_str()) == content(i));
+    CHECK(readFile(crashed, "/big") == std::string(200000, 'b'));
+    CHECK(!crashed.fileExist("/second"));
+  }
+
+  {
+    FileSystem crashed;
+    CHECK(crashed.openDisk("second.fs"));
+    CHECK(crashed.usedBlocks() == usedSecond);
+    CHECK(readFile(crashed, "/second") == "second transaction");
+    CHECK(!crashed.fileExist("/d/f0"));
+    CHECK(readFile(crashed, "/d/f1") == content(1));
+
+    // the replayed volume keeps working and its journal starts over
+    CHECK(writeFile(crashed, "/after", "after replay"));
+    CHECK(crashed.commit());
+    CHECK(crashed.checkpoint());
+  }
+
+  {
+    FileSystem reopened;
+    CHECK(reopened.openDisk("second.fs"));
+    CHECK(readFile(reopened, "/after") == "after replay");
+    CHECK(readFile(reopened, "/big") == std::string(200000, 'b'));
+  }
+
+  {
+    FileSystem crashed;
+    CHECK(crashed.openDisk("late.fs"));
+    CHECK(crashed.usedBlocks() == usedSecond);
+    CHECK(!crashed.fileExist("/late"));
+    CHECK(readFile(crashed, "/second") == "second transaction");
+  }
+
+  // a torn second transaction is dropped and the first one still replays
+  CHECK(tearTransaction("torn.fs", sequence + 1));
+
+  {
+    FileSystem crashed;
+    CHECK(crashed.openDisk("torn.fs"));
+    CHECK(crashed.usedBlocks() == usedFirst);
+    CHECK(!crashed.fileExist("/second"));
+    CHECK(readFile(crashed, "/d/f0") == content(0));
+  }
+
+  // so is one whose descriptor would send an image to another block
+  CHECK(tearTransaction("misdirected.fs", sequence + 1, true));
+
+  {
+    FileSystem crashed;
+    CHECK(crashed.openDisk("misdirected.fs"));
+    CHECK(crashed.usedBlocks() == usedFirst);
+    CHECK(!crashed.fileExist("/second"));
+    CHECK(readFile(crashed, "/d/f0") == content(0));
+    for(int i = 1; i < 50; i++) CHECK(readFile(crashed, ("/d/f" + std::to_string(i)).c_str()) == content(i));
+  }
+
+  // a transaction far larger than the journal is committed in pieces on the way
+  {
+    for(int i = 0; i < 3000; i++) CHECK(writeFile(fs, ("/d/g" + std::to_string(i)).c_str(), content(i)));
+    CHECK(fs.commit());
+    CHECK(copyImage("journal.fs", "large.fs"));
+
+    FileSystem crashed;
+    CHECK(crashed.openDisk("large.fs"));
+    CHECK(crashed.usedBlocks() == fs.usedBlocks());
+    for(int i = 0; i < 3000; i += 7) CHECK(readFile(crashed, ("/d/g" + std::to_string(i)).c_str()) == content(i));
+  }
+
+  // blocks freed by an operation are not written over before the free is committed,
+  // the committed image still has the deleted file
+  {
+    unlink("reuse.fs");
+    std::string a = pattern(1, 5 * 1024 * 1024);
+    std::string b = pattern(2, 5 * 1024 * 1024);
+
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    fs.setChecksums(true);
+    fs.setMaxCapacity(8 * 1024 * 1024);
+    CHECK(fs.createDisk("reuse.fs", 8 * 1024 * 1024));
+    CHECK(writeFile(fs, "/a", a));
+    CHECK(fs.commit());
+
+    CHECK(fs.deleteFile("/a"));
+    CHECK(writeFile(fs, "/b", b));
+    CHECK(copyImage("reuse.fs", "reuse.copy"));
+
+    FileSystem crashed;
+    CHECK(crashed.openDisk("reuse.copy"));
+    CHECK(!crashed.fileExist("/a") || readFile(crashed, "/a") == a);
+    CHECK(consistent(crashed, "/b", b));
+
+    CHECK(fs.commit());
+    CHECK(readFile(fs, "/b") == b);
+  }
+
+  // a journal of 16 blocks, as volumes were formatted before, only has room for
+  // one operation at a time, transactions that do not fit behind the ones in it
+  // are still logged and never written in place
+  {
+    unlink("small.fs");
+    {
+      FileSystem fs;
+      fs.setChecksums(true);
+      CHECK(fs.createDisk("small.fs", 16 * 1024 * 1024));
+    }
+
+    HeaderBlock header = readHeader("small.fs");
+    header.journalBlocks = 16;
+    int fd = open("small.fs", O_RDWR);
+    CHECK(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+    close(fd);
+
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    CHECK(fs.openDisk("small.fs"));
+
+    for(int i = 0; i < 12; i++) {
+
+      std::string small = "/s" + std::to_string(i);
+      std::string large = "/l" + std::to_string(i);
+
+      CHECK(writeFile(fs, small.c_str(), content(i)));
+      CHECK(writeFile(fs, large.c_str(), pattern(i, (i + 1) * 300 * 1024 % (3 * 1024 * 1024))));
+      if(i % 3 == 2) CHECK(fs.deleteFile(("/l" + std::to_string(i - 1)).c_str()));
+
+      // what was committed before is intact whatever this iteration wrote so far
+      CHECK(copyImage("small.fs", "small.copy"));
+      {
+        FileSystem crashed;
+        CHECK(crashed.openDisk("small.copy"));
+        for(int k = 0; k < i; k++) CHECK(readFile(crashed, ("/s" + std::to_string(k)).c_str()) == content(k));
+        CHECK(consistent(crashed, large.c_str(), pattern(i, (i + 1) * 300 * 1024 % (3 * 1024 * 1024))));
+      }
+
+      CHECK(fs.commit());
+      CHECK(copyImage("small.fs", "small.copy"));
+
+      FileSystem crashed;
+      CHECK(crashed.openDisk("small.copy"));
+      CHECK(crashed.usedBlocks() == fs.usedBlocks());
+      for(int k = 0; k <= i; k++) {
+        CHECK(readFile(crashed, ("/s" + std::to_string(k)).c_str()) == content(k));
+        if(k % 3 == 1 && k < i) continue;
+        CHECK(readFile(crashed, ("/l" + std::to_string(k)).c_str()) == pattern(k, (k + 1) * 300 * 1024 % (3 * 1024 * 1024)));
+      }
+
+    }
+
+    // one write larger than the journal could ever log goes in pieces
+    std::string huge = pattern(99, 6 * 1024 * 1024);
+    CHECK(writeFile(fs, "/huge", huge));
+    CHECK(fs.commit());
+    CHECK(copyImage("small.fs", "small.copy"));
+
+    FileSystem crashed;
+    CHECK(crashed.openDisk("small.copy"));
+    CHECK(readFile(crashed, "/huge") == huge);
+  }
+
+  unlink("reuse.fs");
+  unlink("reuse.copy");
+  unlink("small.fs");
+  unlink("small.copy");
+  unlink("journal.fs");
+  unlink("first.fs");
+  unlink("second.fs");
+  unlink("late.fs");
+  unlink("torn.fs");
+  unlink("misdirected.fs");
+  unlink("large.fs");
+
+  return finish("journal");
+
+}
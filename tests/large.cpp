@@ -0,0 +1,96 @@
+#include "internals.h"
+
+// a volume past 2 GiB, block offsets no longer fit in an int there
+
+static const uint64 capacity = 3ULL * 1024 * 1024 * 1024;
+static const int64 fillSize = 2200LL * 1024 * 1024;
+
+static std::string pattern(int64 i, int len) {
+  std::string data(len, 0);
+  for(int k = 0; k < len; k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+static int firstBlockOf(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info)) return -1;
+  Extent extent;
+  return fs.findExtent(&info, 0, &extent) ? extent.startBlock : -1;
+}
+
+int main() {
+
+  unlink("large.fs");
+
+  std::string high = pattern(7, 5 * 1024 * 1024);
+
+  {
+    FileSystem fs;
+    fs.setChecksums(true);
+    fs.setMaxCapacity(capacity);
+    CHECK(fs.createMapped("large.fs", capacity));
+
+    // every block of the fill file starts with its own index
+    File fill = fs.openFile("/fill", WRITE);
+    std::string chunk(8 * 1024 * 1024, 0);
+    for(int64 at = 0; at < fillSize; at += chunk.size()) {
+      for(uint64 k = 0; k < chunk.size(); k += BLOCK_SIZE) *(int64*)&chunk[k] = (at + k) / BLOCK_SIZE;
+      CHECK(fill.write(chunk.data(), chunk.size()) == (int64)chunk.size());
+    }
+    fill.close();
+
+    CHECK(writeFile(fs, "/high", high));
+
+    int block = firstBlockOf(fs, "/high");
+    CHECK(block > (int)(2ULL * 1024 * 1024 * 1024 / BLOCK_SIZE));
+    CHECK(fs.blockIndex(fs.blockAt(block)) == block);
+    CHECK(fs.blockAt(block) - fs.memory > (int64)2 * 1024 * 1024 * 1024);
+
+    CHECK(readFile(fs, "/high") == high);
+    CHECK(fs.commit());
+  }
+
+  // the same blocks read through a mapping and through the buffer pool
+  for(int disk = 0; disk < 2; disk++) {
+
+    FileSystem fs;
+    fs.setMaxCapacity(capacity);
+    CHECK(disk ? fs.openDisk("large.fs") : fs.map("large.fs"));
+
+    CHECK(readFile(fs, "/high") == high);
+
+    File fill = fs.openFile("/fill", READ);
+    CHECK(fill.size() == fillSize);
+    for(int64 at = fillSize - 10 * BLOCK_SIZE; at > 0; at -= 40000 * (int64)BLOCK_SIZE) {
+      int64 index = -1;
+      CHECK(fill.pread((char*)&index, sizeof(index), at) == sizeof(index));
+      CHECK(index == at / BLOCK_SIZE);
+    }
+    fill.close();
+
+    // a view and a copy of data above 2 GiB
+    std::string viewed;
+    File file = fs.openFile("/high", READ);
+    for(FileView view = file.view(1000, high.size()); view.hasItems(); view.nextItem()) viewed.append(view.data(), view.length());
+    CHECK(viewed == high.substr(1000));
+
+    int out = open("large.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(file.copyTo(out) == (int64)high.size());
+    std::string copied(high.size(), 0);
+    CHECK(pread(out, copied.data(), copied.size(), 0) == (ssize_t)copied.size());
+    CHECK(copied == high);
+    close(out);
+    unlink("large.out");
+    file.close();
+
+    CHECK(fs.deleteFile("/high"));
+    CHECK(writeFile(fs, "/high", high));
+    CHECK(readFile(fs, "/high") == high);
+  }
+
+  unlink("large.fs");
+
+  return finish("large");
+
+}
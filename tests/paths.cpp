@@ -0,0 +1,98 @@
+#include "check.h"
+
+// resolved path prefixes are remembered, renaming or deleting a directory must
+// not leave a remembered prefix pointing at the old place
+
+static void exercise(FileSystem& fs) {
+
+  CHECK(fs.createDirectory("/a"));
+  CHECK(fs.createDirectory("/a/b"));
+  CHECK(fs.createDirectory("/a/b/c"));
+  CHECK(writeFile(fs, "/a/b/c/f", "first"));
+
+  // the second lookup of a prefix is a hit
+  uint64 hits = fs.pathCacheHitCount();
+  CHECK(readFile(fs, "/a/b/c/f") == "first");
+  CHECK(readFile(fs, "/a/b/c/f") == "first");
+  CHECK(fs.pathCacheHitCount() > hits);
+
+  // a renamed directory is only found under its new name
+  CHECK(fs.renameDirectory("/a/b", "x"));
+  CHECK(!fs.fileExist("/a/b/c/f"));
+  CHECK(readFile(fs, "/a/b/c/f") == "<missing>");
+  CHECK(!fs.directoryExist("/a/b/c"));
+  CHECK(readFile(fs, "/a/x/c/f") == "first");
+  CHECK(!writeFile(fs, "/a/b/c/g", "refused"));
+
+  // a directory created under the old name is a different one
+  CHECK(fs.createDirectory("/a/b"));
+  CHECK(fs.createDirectory("/a/b/c"));
+  CHECK(!fs.fileExist("/a/b/c/f"));
+  CHECK(writeFile(fs, "/a/b/c/g", "second"));
+  CHECK(!fs.fileExist("/a/x/c/g"));
+  CHECK(readFile(fs, "/a/x/c/f") == "first");
+  CHECK(readFile(fs, "/a/b/c/g") == "second");
+
+  // renaming a directory further up moves every prefix below it
+  CHECK(readFile(fs, "/a/x/c/f") == "first");
+  CHECK(fs.renameDirectory("/a", "z"));
+  CHECK(!fs.fileExist("/a/x/c/f"));
+  CHECK(!fs.fileExist("/a/b/c/g"));
+  CHECK(readFile(fs, "/z/x/c/f") == "first");
+  CHECK(readFile(fs, "/z/b/c/g") == "second");
+
+  // a deleted directory is gone, one created again in its place starts empty
+  CHECK(fs.deleteFile("/z/x/c/f"));
+  CHECK(fs.deleteDirectory("/z/x/c"));
+  CHECK(!fs.directoryExist("/z/x/c"));
+  CHECK(!fs.fileExist("/z/x/c/f"));
+  CHECK(!writeFile(fs, "/z/x/c/f", "refused"));
+
+  CHECK(fs.createDirectory("/z/x/c"));
+  CHECK(!fs.fileExist("/z/x/c/f"));
+  CHECK(writeFile(fs, "/z/x/c/f", "third"));
+  CHECK(readFile(fs, "/z/x/c/f") == "third");
+
+  // and a whole deleted tree takes its deeper prefixes with it
+  CHECK(fs.deleteFile("/z/x/c/f"));
+  CHECK(fs.deleteDirectory("/z/x/c"));
+  CHECK(fs.deleteDirectory("/z/x"));
+  CHECK(!fs.fileExist("/z/x/c/f"));
+  CHECK(fs.createDirectory("/z/x"));
+  CHECK(!fs.directoryExist("/z/x/c"));
+  CHECK(readFile(fs, "/z/b/c/g") == "second");
+
+}
+
+int main() {
+
+  {
+    FileSystem fs;
+    fs.create(16 * 1024 * 1024);
+    exercise(fs);
+  }
+
+  unlink("paths.fs");
+
+  {
+    FileSystem fs;
+    CHECK(fs.createDisk("paths.fs", 16 * 1024 * 1024));
+    exercise(fs);
+    CHECK(fs.commit());
+  }
+
+  // nothing remembered survives a remount
+  {
+    FileSystem fs;
+    CHECK(fs.openDisk("paths.fs"));
+    CHECK(fs.pathCacheHitCount() == 0);
+    CHECK(!fs.directoryExist("/a"));
+    CHECK(readFile(fs, "/z/b/c/g") == "second");
+    CHECK(fs.directoryExist("/z/x"));
+  }
+
+  unlink("paths.fs");
+
+  return finish("paths");
+
+}
@@ -0,0 +1,118 @@
+#include "internals.h"
+
+static std::string content(int i) {
+  return "file " + std::to_string(i);
+}
+
+static std::string path(int i) {
+  return "/d" + std::to_string(i % 50) + "/f" + std::to_string(i);
+}
+
+static int firstBlockOf(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info)) return -1;
+  Extent extent;
+  return fs.findExtent(&info, 0, &extent) ? extent.startBlock : -1;
+}
+
+int main() {
+
+  unlink("pool.fs");
+
+  // metadata waiting for a checkpoint does not make the pool grow without bound
+  {
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    CHECK(fs.createDisk("pool.fs", 256 * 1024 * 1024));
+
+    int frames = fs.pool->frameCount();
+    int largest = frames;
+
+    for(int d = 0; d < 50; d++) CHECK(fs.createDirectory(("/d" + std::to_string(d)).c_str()));
+
+    for(int i = 0; i < 20000; i++) {
+      CHECK(writeFile(fs, path(i).c_str(), content(i)));
+      largest = std::max(largest, fs.pool->frameCount());
+    }
+
+    printf("pool frames %d, largest %d\n", frames, largest);
+    CHECK(largest <= 4 * frames);
+    CHECK(!fs.failed);
+    CHECK(fs.commit());
+    CHECK(fs.checkpoint());
+    CHECK(fs.pool->frameCount() == frames);
+
+    for(int i = 0; i < 20000; i += 97) CHECK(readFile(fs, path(i).c_str()) == content(i));
+  }
+
+  {
+    FileSystem fs;
+    fs.setPoolSize(1024 * 1024);
+    CHECK(fs.openDisk("pool.fs"));
+    for(int i = 0; i < 20000; i += 89) CHECK(readFile(fs, path(i).c_str()) == content(i));
+
+    // a pool that cannot hold what is pinned fails the volume instead of the program,
+    // it grows by no more than twice the journal and pinned frames keep their blocks
+    CHECK(writeFile(fs, "/uncommitted", "lost"));
+    CHECK(writeFile(fs, "/pinned", std::string(3 * BLOCK_SIZE, 'p')));
+
+    {
+      PinScope pins;
+      int frames = fs.pool->frameCount();
+      int journal = fs.getHeaderBlock()->journalBlocks;
+
+      char* pinned = fs.blockAt(firstBlockOf(fs, "/pinned"));
+      CHECK(std::string(pinned, BLOCK_SIZE) == std::string(BLOCK_SIZE, 'p'));
+
+      int blocks = fs.totalBlocks();
+      int i = fs.residentBlocks;
+      for(; i < blocks && !fs.failed; i++) fs.blockAt(i);
+
+      CHECK(fs.failed);
+      CHECK(fs.pool->frameCount() <= 3 * frames + 2 * journal);
+
+      // once every frame is pinned the blocks handed out are zeros of their own
+      char* spare = NULL;
+      for(int n = fs.pool->frameCount() + 1; n > 0 && i < blocks; n--, i++) {
+        spare = fs.blockAt(i);
+        if(fs.blockIndex(spare) == -1) break;
+      }
+      CHECK(spare != NULL && fs.blockIndex(spare) == -1);
+      CHECK(std::string(spare, BLOCK_SIZE) == std::string(BLOCK_SIZE, 0));
+
+      CHECK(std::string(pinned, BLOCK_SIZE) == std::string(BLOCK_SIZE, 'p'));
+    }
+
+    CHECK(fs.failed);
+    CHECK(!fs.commit());
+    CHECK(!fs.checkpoint());
+    CHECK(!fs.fileExist(path(0).c_str()));
+    CHECK(!writeFile(fs, "/after", "refused"));
+  }
+
+  // the image is left as it was at the last commit
+  {
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    CHECK(fs.openDisk("pool.fs"));
+    CHECK(!fs.fileExist("/uncommitted"));
+    CHECK(!fs.fileExist("/after"));
+    for(int i = 0; i < 20000; i += 83) CHECK(readFile(fs, path(i).c_str()) == content(i));
+
+    // a block that cannot be read fails the volume as well
+    int image = open("pool.fs", O_RDWR);
+    CHECK(ftruncate(image, 2 * 1024 * 1024) == 0);
+    close(image);
+
+    std::string data = readFile(fs, path(19999).c_str());
+    CHECK(data != content(19999));
+    CHECK(fs.failed);
+    CHECK(!fs.commit());
+  }
+
+  unlink("pool.fs");
+
+  return finish("pool");
+
+}
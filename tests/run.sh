@@ -0,0 +1,34 @@
+#!/bin/sh
+# builds and runs every test, from anywhere: sh tests/run.sh [name...]
+# SANITIZE=thread or SANITIZE=address builds the volume and the tests with that sanitizer
+
+cd "$(dirname "$0")/.." || exit 1
+mkdir -p tests/build
+
+flags="-std=c++20 -O2"
+[ -n "$SANITIZE" ] && flags="$flags -g -fsanitize=$SANITIZE"
+
+g++ $flags -c fs.cpp -o tests/build/fs.o || exit 1
+
+tests="$*"
+[ -z "$tests" ] && tests=$(ls tests/*.cpp | xargs -n1 basename | sed 's/\.cpp$//')
+
+failed=0
+
+for name in $tests; do
+  if ! g++ $flags -I. tests/$name.cpp tests/build/fs.o -o tests/build/$name -lpthread -ldl; then
+    echo "$name did not build"
+    failed=1
+    continue
+  fi
+  (cd tests/build && ./$name > $name.log 2>&1)
+  if [ $? -ne 0 ]; then
+    grep "CHECK" tests/build/$name.log
+    echo "$name FAILED, output in tests/build/$name.log"
+    failed=1
+  else
+    tail -n 1 tests/build/$name.log
+  fi
+done
+
+exit $failed
@@ -0,0 +1,155 @@
+#include "internals.h"
+
+// threads creating, writing, reading and deleting files at once, in a directory
+// they share and in directories of their own, also built with SANITIZE=thread
+
+static const int threadCount = 8;
+static const int filesPerThread = 120;
+
+static std::string content(int t, int i, int round) {
+  // inline files, files of a few blocks and files of many blocks
+  int len = i % 3 == 0 ? 1 + i % 200 : i % 3 == 1 ? 5000 + i * 37 : 40000 + i * 113;
+  std::string data(len, 0);
+  for(int k = 0; k < len; k++) data[k] = (char)((t * 7919 + i * 131 + round * 17 + k) * 2654435761u >> 24);
+  return data;
+}
+
+static std::string directory(int t, bool shared) {
+  return shared ? "/shared" : "/t" + std::to_string(t);
+}
+
+static std::string path(int t, int i, bool shared) {
+  return directory(t, shared) + "/f" + std::to_string(t) + "_" + std::to_string(i);
+}
+
+// every file that is kept holds its second round, every third one is deleted
+static bool kept(int i) {
+  return i % 3 != 2;
+}
+
+static void work(FileSystem* fs, int t, bool shared, int* errors) {
+
+  for(int i = 0; i < filesPerThread; i++) {
+    std::string name = path(t, i, shared);
+    if(!writeFile(*fs, name.c_str(), content(t, i, 0))) (*errors)++;
+    if(readFile(*fs, name.c_str()) != content(t, i, 0)) (*errors)++;
+  }
+
+  for(int i = 0; i < filesPerThread; i++) {
+    std::string name = path(t, i, shared);
+    if(readFile(*fs, name.c_str()) != content(t, i, 0)) (*errors)++;
+    if(!kept(i)) {
+      if(!fs->deleteFile(name.c_str())) (*errors)++;
+    }else{
+      if(!writeFile(*fs, name.c_str(), content(t, i, 1))) (*errors)++;
+    }
+  }
+
+}
+
+static bool intact(FileSystem& fs, bool shared) {
+
+  bool ok = true;
+
+  for(int t = 0; t < threadCount; t++) {
+    for(int i = 0; i < filesPerThread; i++) {
+      std::string name = path(t, i, shared);
+      ok = ok && (kept(i) ? readFile(fs, name.c_str()) == content(t, i, 1) : !fs.fileExist(name.c_str()));
+    }
+  }
+
+  return ok;
+
+}
+
+// deleting everything the threads left gives back every block they took
+static bool emptied(FileSystem& fs, bool shared, int base) {
+
+  bool ok = true;
+
+  for(int t = 0; t < threadCount; t++) {
+    for(int i = 0; i < filesPerThread; i++) {
+      if(kept(i)) ok = fs.deleteFile(path(t, i, shared).c_str()) && ok;
+    }
+    if(!shared) ok = fs.deleteDirectory(directory(t, shared).c_str()) && ok;
+  }
+
+  if(shared) ok = fs.deleteDirectory("/shared") && ok;
+  return ok && fs.usedBlocks() == base;
+
+}
+
+static void run(FileSystem& fs, bool shared, bool disk) {
+
+  int base = fs.usedBlocks();
+
+  if(shared) CHECK(fs.createDirectory("/shared"));
+  else for(int t = 0; t < threadCount; t++) CHECK(fs.createDirectory(directory(t, false).c_str()));
+
+  int errors[threadCount] = {};
+  std::vector<std::thread> threads;
+  for(int t = 0; t < threadCount; t++) threads.emplace_back(work, &fs, t, shared, &errors[t]);
+
+  // transactions are committed while the threads work
+  bool committing = true;
+  std::thread committer([&]() {
+    while(disk && __atomic_load_n(&committing, __ATOMIC_RELAXED)) {
+      if(!fs.commit()) __atomic_store_n(&committing, false, __ATOMIC_RELAXED);
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  });
+
+  for(std::thread& thread : threads) thread.join();
+
+  bool stopped = disk && !__atomic_load_n(&committing, __ATOMIC_RELAXED);
+  __atomic_store_n(&committing, false, __ATOMIC_RELAXED);
+  committer.join();
+
+  CHECK(!stopped);
+  for(int t = 0; t < threadCount; t++) CHECK(errors[t] == 0);
+  CHECK(intact(fs, shared));
+  CHECK(!fs.failed);
+
+  if(disk) {
+
+    // the committed image, as if the machine went down, has the same files and
+    // no block is lost to the caches of the threads that allocated them
+    CHECK(fs.commit());
+    CHECK(copyImage("threads.fs", "threads.copy"));
+
+    FileSystem crashed;
+    CHECK(crashed.openDisk("threads.copy"));
+    CHECK(intact(crashed, shared));
+    CHECK(crashed.usedBlocks() == fs.usedBlocks());
+    CHECK(emptied(crashed, shared, base));
+
+  }
+
+  CHECK(emptied(fs, shared, base));
+
+}
+
+int main() {
+
+  for(int disk = 0; disk < 2; disk++) {
+    for(int shared = 0; shared < 2; shared++) {
+
+      unlink("threads.fs");
+
+      FileSystem fs;
+      fs.setPoolSize(1024 * 1024);
+
+      if(disk) CHECK(fs.createDisk("threads.fs", 256 * 1024 * 1024));
+      else fs.create(256 * 1024 * 1024);
+
+      run(fs, shared, disk);
+
+    }
+  }
+
+  unlink("threads.fs");
+  unlink("threads.copy");
+
+  return finish("threads");
+
+}
@@ -0,0 +1,191 @@
+#include "internals.h"
+
+// older images are made by rewriting a current one on disk the way the older
+// version laid it out, then opened and upgraded
+
+static std::string content(int i) {
+  std::string data(300 + i * 37 % 2000, 0);
+  for(uint64 k = 0; k < data.size(); k++) data[k] = 'a' + (i + k) % 26;
+  return data;
+}
+
+static std::string path(int i) {
+  return (i % 3 ? "/big/f" : "/big/sub/f") + std::to_string(i);
+}
+
+static const int files = 900;
+
+static bool build(const char* image) {
+
+  unlink(image);
+
+  FileSystem fs;
+  if(!fs.createDisk(image, 64 * 1024 * 1024)) return false;
+
+  bool ok = fs.createDirectory("/big") && fs.createDirectory("/big/sub");
+  for(int i = 0; i < files; i++) ok = writeFile(fs, path(i).c_str(), content(i)) && ok;
+  ok = writeFile(fs, "/large", std::string(200 * 1024, 'x')) && ok;
+
+  return ok && fs.commit() && fs.checkpoint();
+
+}
+
+static bool readBlock(int image, int i, void* data) {
+  return pread(image, data, BLOCK_SIZE, sizeof(HeaderBlock) + (uint64)i * BLOCK_SIZE) == BLOCK_SIZE;
+}
+
+static bool writeBlock(int image, int i, void* data) {
+  return pwrite(image, data, BLOCK_SIZE, sizeof(HeaderBlock) + (uint64)i * BLOCK_SIZE) == BLOCK_SIZE;
+}
+
+static void downgradeLeaf(DirectoryBlock* leaf) {
+
+  DirectoryBlockV6 old;
+  memset(&old, 0, sizeof(old));
+
+  old.parentDirectory = leaf->parentDirectory;
+  old.previousBlock = leaf->previousBlock;
+  old.nextBlock = leaf->nextBlock;
+  old.depth = 0;
+  old.fileCount = leaf->fileCount;
+
+  for(uint i = 0; i < leaf->fileCount; i++) {
+    FileInfo* entry = &leaf->files[i];
+    memcpy(old.files[i].fileName, entry->fileName, sizeof(entry->fileName));
+    old.files[i].fileType = entry->fileType;
+    old.files[i].fileSize = (uint)entry->fileSize;
+    old.files[i].dateCreated = entry->dateCreated;
+    old.files[i].dateModified = entry->dateModified;
+    old.files[i].firstBlock = entry->firstBlock;
+    old.files[i].lastBlock = entry->lastBlock;
+  }
+
+  memcpy(leaf, &old, sizeof(old));
+
+}
+
+static bool downgrade(const char* file, uint version) {
+
+  int image = open(file, O_RDWR);
+  if(image == -1) return false;
+
+  HeaderBlock header;
+  bool ok = pread(image, &header, sizeof(header), 0) == sizeof(header);
+
+  header.version = version;
+  if(version < 8) header.checksumBlock = 0x5a5a5a5a;
+  ok = ok && pwrite(image, &header, sizeof(header), 0) == sizeof(header);
+
+  std::vector<int> nodes = { 0 };
+  char block[BLOCK_SIZE];
+
+  while(ok && !nodes.empty()) {
+
+    int n = nodes.back();
+    nodes.pop_back();
+    ok = readBlock(image, n, block);
+
+    DirectoryIndexBlock* node = (DirectoryIndexBlock*)block;
+    if(node->depth > 0) {
+      for(uint i = 0; i < node->keyCount; i++) nodes.push_back(node->keys[i].childBlock);
+      continue;
+    }
+
+    DirectoryBlock* leaf = (DirectoryBlock*)block;
+    for(uint i = 0; i < leaf->fileCount; i++) {
+      if(leaf->files[i].fileType == 'D') nodes.push_back(leaf->files[i].firstBlock);
+      if(version < 9) leaf->files[i].flags = 0x7f;
+    }
+
+    if(version == 6) downgradeLeaf(leaf);
+
+    ok = ok && writeBlock(image, n, block);
+
+  }
+
+  close(image);
+  return ok;
+
+}
+
+static bool open(FileSystem& fs, const char* image, bool disk) {
+  return disk ? fs.openDisk(image) : fs.map(image);
+}
+
+// every file is there with its old content and reads as a plain file
+static bool intact(FileSystem& fs) {
+
+  bool ok = true;
+
+  for(int i = 0; i < files && ok; i++) {
+    File file = fs.openFile(path(i).c_str(), READ);
+    FileInfo info;
+    ok = file.load(&info) && info.flags == 0;
+    file.close();
+    ok = ok && readFile(fs, path(i).c_str()) == content(i);
+  }
+
+  return ok && readFile(fs, "/large") == std::string(200 * 1024, 'x');
+
+}
+
+static void upgradeFrom(uint version) {
+
+  std::string name = "v" + std::to_string(version) + ".fs";
+  const char* image = name.c_str();
+
+  for(int disk = 0; disk < 2; disk++) {
+
+    CHECK(build(image));
+    CHECK(downgrade(image, version));
+
+    {
+      FileSystem fs;
+      CHECK(open(fs, image, disk));
+      CHECK(fs.getHeaderBlock()->version == FS_VERSION);
+      CHECK(fs.getHeaderBlock()->checksumBlock == 0);
+      CHECK(intact(fs));
+      CHECK(writeFile(fs, "/big/sub/after", content(1)));
+      CHECK(writeFile(fs, "/big/sub/small", "inline"));
+      CHECK(fs.commit());
+    }
+
+    // the upgrade was written back, the image opens as a current one
+    FileSystem fs;
+    CHECK(open(fs, image, disk));
+    CHECK(fs.getHeaderBlock()->version == FS_VERSION);
+    CHECK(intact(fs));
+    CHECK(readFile(fs, "/big/sub/after") == content(1));
+    CHECK(readFile(fs, "/big/sub/small") == "inline");
+  }
+
+  unlink(image);
+
+}
+
+int main() {
+
+  // 32-bit file sizes and denser leaves, every directory is rebuilt
+  upgradeFrom(6);
+
+  // checksumBlock was padding before, whatever it held means no checksums
+  upgradeFrom(7);
+
+  // the flags byte was padding before, no file is taken as compressed or inline
+  upgradeFrom(8);
+
+  // inline files are new, the version number is all that changes
+  upgradeFrom(9);
+
+  // an image newer than this build is refused
+  {
+    CHECK(build("new.fs"));
+    CHECK(downgrade("new.fs", FS_VERSION + 1));
+    FileSystem fs;
+    CHECK(!fs.map("new.fs"));
+    unlink("new.fs");
+  }
+
+  return finish("upgrade");
+
+}
@@ -0,0 +1,208 @@
+#include "internals.h"
+
+// writev and readv with buffers split right at and around the ends of blocks,
+// extents, slots, chunks and write pieces, with empty buffers in between
+
+static std::string pattern(int i, int64 len) {
+  std::string data(len, 0);
+  for(int64 k = 0; k < len; k++) data[k] = (char)((i + k) * 2654435761u >> 24);
+  return data;
+}
+
+// buffers over data cut at every offset given, a cut given twice leaves an empty
+// buffer there and empty buffers start and end the list
+static std::vector<iovec> split(char* data, int64 len, std::vector<int64> cuts) {
+
+  std::vector<iovec> buffers;
+  buffers.push_back({ data, 0 });
+
+  int64 at = 0;
+  cuts.push_back(len);
+
+  for(int64 cut : cuts) {
+    cut = std::min(std::max(cut, at), len);
+    buffers.push_back({ data + at, (size_t)(cut - at) });
+    at = cut;
+  }
+
+  buffers.push_back({ data + len, 0 });
+  return buffers;
+
+}
+
+static bool writeAt(FileSystem& fs, const char* path, std::string& model, int64 offset, const std::string& data, const std::vector<int64>& cuts) {
+
+  File file = fs.openFile(path, APPEND);
+  file.setPosition(offset);
+
+  std::string copy = data;
+  std::vector<iovec> buffers = split(copy.data(), copy.size(), cuts);
+  bool ok = file.writev(buffers.data(), buffers.size()) == (int64)data.size();
+  ok = ok && file.getPosition() == offset + (int64)data.size();
+  file.close();
+
+  // closing keeps the file up to where the handle ended
+  model = model.substr(0, offset) + data;
+  return ok;
+
+}
+
+static bool readAt(FileSystem& fs, const char* path, const std::string& model, int64 offset, int64 len, const std::vector<int64>& cuts) {
+
+  File file = fs.openFile(path, READ);
+  file.setPosition(offset);
+
+  std::string data(len, 0x55);
+  std::vector<iovec> buffers = split(data.data(), len, cuts);
+  int64 n = file.readv(buffers.data(), buffers.size());
+  file.close();
+
+  int64 expected = std::max(std::min(len, (int64)model.size() - offset), (int64)0);
+  return n == expected && data.compare(0, n, model, offset, n) == 0 && data.compare(n, len - n, std::string(len - n, 0x55)) == 0;
+
+}
+
+// cuts around each multiple of unit up to len, relative to a file offset
+static std::vector<int64> around(int64 offset, int64 len, int64 unit) {
+  std::vector<int64> cuts;
+  for(int64 edge = (offset / unit + 1) * unit; edge - offset < len; edge += unit) {
+    for(int64 d : { -1, 0, 0, 1 }) cuts.push_back(edge - offset + d);
+  }
+  return cuts;
+}
+
+static int flagsOf(FileSystem& fs, const char* path) {
+  File file = fs.openFile(path, READ);
+  FileInfo info;
+  if(!file.load(&info)) return -1;
+  return info.flags;
+}
+
+// two files written a block at a time, every block of the first is an extent of its own
+static std::string fragment(FileSystem& fs, const char* path, const char* other, int blocks) {
+
+  File file = fs.openFile(path, WRITE);
+  File interleaved = fs.openFile(other, WRITE);
+  std::string model;
+
+  for(int i = 0; i < blocks; i++) {
+    std::string data = pattern(i, BLOCK_SIZE);
+    file.write(data.data(), data.size());
+    interleaved.write(data.data(), data.size());
+    model += data;
+  }
+
+  file.close();
+  interleaved.close();
+  return model;
+
+}
+
+static void exercise(FileSystem& fs) {
+
+  // a small file fills its slot from empty buffers and pieces, then moves out
+  // to blocks on a write split across the end of the slot
+  {
+    std::string model;
+    CHECK(writeAt(fs, "/inline", model, 0, pattern(1, 200), { 0, 0, 100, 100, 199 }));
+    CHECK(readFile(fs, "/inline") == model);
+    CHECK(flagsOf(fs, "/inline") == FILE_INLINE);
+    CHECK(readAt(fs, "/inline", model, 0, 1000, { 0, 1, 150, 150, 200 }));
+
+    int64 slot = InlineBlock::slotSize;
+    CHECK(writeAt(fs, "/inline", model, 150, pattern(2, slot), { slot - 151, slot - 150, slot - 150, slot - 149 }));
+    CHECK(readFile(fs, "/inline") == model);
+    CHECK(flagsOf(fs, "/inline") == 0);
+    CHECK(readAt(fs, "/inline", model, 0, model.size(), around(0, model.size(), slot)));
+  }
+
+  // buffers ending one byte before, at and after every block end
+  {
+    std::string model;
+    std::string data = pattern(3, 10 * BLOCK_SIZE + 123);
+    CHECK(writeAt(fs, "/blocks", model, 0, data, around(0, data.size(), BLOCK_SIZE)));
+    CHECK(readFile(fs, "/blocks") == model);
+
+    CHECK(writeAt(fs, "/blocks", model, 5000, pattern(4, 3 * BLOCK_SIZE), around(5000, 3 * BLOCK_SIZE, BLOCK_SIZE)));
+    CHECK(readAt(fs, "/blocks", model, 17, model.size(), around(17, model.size(), BLOCK_SIZE)));
+    CHECK(readFile(fs, "/blocks") == model);
+  }
+
+  // every block of a fragmented file is its own extent, buffers straddle them
+  {
+    std::string original = fragment(fs, "/extents", "/other", 40);
+    std::string model = original;
+
+    File file = fs.openFile("/extents", READ);
+    FileInfo info;
+    CHECK(file.load(&info));
+    Extent extent;
+    CHECK(fs.findExtent(&info, 7, &extent) && extent.blockCount == 1);
+    file.close();
+
+    CHECK(readAt(fs, "/extents", model, 3, model.size(), around(3, model.size(), BLOCK_SIZE)));
+    CHECK(writeAt(fs, "/extents", model, BLOCK_SIZE - 7, pattern(5, 20 * BLOCK_SIZE + 14), around(BLOCK_SIZE - 7, 20 * BLOCK_SIZE + 14, BLOCK_SIZE)));
+
+    // and past the last extent the file grows
+    CHECK(writeAt(fs, "/extents", model, model.size() - 100, pattern(6, 3 * BLOCK_SIZE), { 99, 100, 100, 101 }));
+    CHECK(readFile(fs, "/extents") == model);
+    CHECK(readFile(fs, "/other") == original);
+  }
+
+  // a write larger than a piece is split between buffers and inside them
+  {
+    std::string model;
+    int64 piece = File::writePiece;
+    std::string data = pattern(7, 3 * piece + 5000);
+    CHECK(writeAt(fs, "/pieces", model, 0, data, { 10, 10, piece - 1, piece, piece, 2 * piece + 1, 3 * piece }));
+    CHECK(readAt(fs, "/pieces", model, 1, model.size(), around(1, model.size(), piece)));
+    CHECK(readFile(fs, "/pieces") == model);
+  }
+
+  // compressed files are split at their chunks
+  {
+    fs.setCompression(true);
+    std::string model;
+    std::string data = pattern(8, 3 * CHUNK_SIZE + 77);
+    for(int64 k = 0; k < (int64)data.size(); k += 3) data[k] = 'c';
+    CHECK(writeAt(fs, "/chunks", model, 0, data, around(0, data.size(), CHUNK_SIZE)));
+    CHECK(writeAt(fs, "/chunks", model, CHUNK_SIZE / 2, pattern(9, CHUNK_SIZE), around(CHUNK_SIZE / 2, CHUNK_SIZE, CHUNK_SIZE)));
+    CHECK(readAt(fs, "/chunks", model, 5, model.size(), around(5, model.size(), CHUNK_SIZE)));
+    CHECK(readFile(fs, "/chunks") == model);
+    fs.setCompression(false);
+  }
+
+  // nothing but empty buffers moves nothing
+  {
+    File file = fs.openFile("/blocks", APPEND);
+    std::vector<iovec> empty = { { NULL, 0 }, { NULL, 0 } };
+    CHECK(file.writev(empty.data(), empty.size()) == 0);
+    CHECK(file.readv(empty.data(), empty.size()) == 0);
+    file.close();
+  }
+
+}
+
+int main() {
+
+  {
+    FileSystem fs;
+    fs.create(64 * 1024 * 1024);
+    exercise(fs);
+  }
+
+  unlink("vectors.fs");
+
+  {
+    FileSystem fs;
+    fs.setPoolSize(256 * 1024);
+    CHECK(fs.createDisk("vectors.fs", 64 * 1024 * 1024));
+    exercise(fs);
+    CHECK(fs.commit());
+  }
+
+  unlink("vectors.fs");
+
+  return finish("vectors");
+
+}